@@ -33,6 +33,7 @@
 #include "canvas_base.h"
 #include "pixman_utils.h"
 #include "canvas_utils.h"
+#include "image_dedup.h"
 #include "rect.h"
 #include "lines.h"
 #include "rop3.h"
@@ -118,6 +119,17 @@ typedef struct GlzData {
     LzDecodeUsrData decode_data;
 } GlzData;
 
+/* size of the inflate window used when zlib-glz images are decoded
+   through SpiceGlzDecoderOps::decode_stream */
+#define ZLIB_GLZ_STREAM_CHUNK_SIZE (64 * 1024)
+
+typedef struct ZlibGlzStream {
+    SpiceGlzStream base;
+    SpiceZlibDecoder *zlib;
+    int remaining;
+    uint8_t buf[ZLIB_GLZ_STREAM_CHUNK_SIZE];
+} ZlibGlzStream;
+
 typedef struct QuicData {
     QuicUsrContext usr;
     QuicContext *quic;
@@ -127,6 +139,15 @@ typedef struct QuicData {
     uint32_t current_chunk;
 } QuicData;
 
+#define CANVAS_INVERTED_MASKS 8
+
+typedef struct CanvasInvertedMask {
+    uint64_t id;
+    pixman_image_t *mask;       // the cached mask it was made from, referenced so that its
+                                // bits can't be reused by another mask
+    pixman_image_t *image;
+} CanvasInvertedMask;
+
 typedef struct CanvasBase {
     SpiceCanvas parent;
     uint32_t color_shift;
@@ -144,6 +165,10 @@ typedef struct CanvasBase {
 #ifdef SW_CANVAS_CACHE
     SpicePaletteCache *palette_cache;
 #endif
+#if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
+    CanvasInvertedMask inverted_masks[CANVAS_INVERTED_MASKS];
+    int next_inverted_mask;
+#endif
 #ifdef WIN32
     HDC dc;
 #endif
@@ -152,8 +177,12 @@ typedef struct CanvasBase {
 
     LzData lz_data;
     GlzData glz_data;
+    SpicePaletteTablesCache palette_tables;
     SpiceJpegDecoder* jpeg;
     SpiceZlibDecoder* zlib;
+    ZlibGlzStream *zlib_glz_stream;
+
+    SpiceImageDedup *image_dedup;
 
     void *usr_data;
     spice_destroy_fn_t usr_data_destroy;
@@ -494,9 +523,13 @@ static void dump_jpeg(uint8_t* data, int data_size)
 }
 #endif
 
-static pixman_image_t *canvas_get_jpeg(CanvasBase *canvas, SpiceImage *image, int invers)
+static pixman_image_t *canvas_get_jpeg(CanvasBase *canvas, SpiceImage *image, int invers,
+                                       int want_original, int scale_denom)
 {
     pixman_image_t *surface = NULL;
+    pixman_format_code_t pixman_format;
+    int jpeg_format;
+    uint32_t invers_mask;
     int stride;
     int width;
     int height;
@@ -508,11 +541,31 @@ static pixman_image_t *canvas_get_jpeg(CanvasBase *canvas, SpiceImage *image, in
     spice_return_val_if_fail((uint32_t)width == image->descriptor.width, NULL);
     spice_return_val_if_fail((uint32_t)height == image->descriptor.height, NULL);
 
+    if (scale_denom > 1) {
+        spice_return_val_if_fail(canvas->jpeg->ops->set_scale != NULL, NULL);
+        canvas->jpeg->ops->set_scale(canvas->jpeg, scale_denom, &width, &height);
+        spice_return_val_if_fail(width > 0 && height > 0, NULL);
+    }
+
+    /* Decode straight into the canvas format when the decoder can do it,
+       rather than converting from 32 bpp afterwards */
+    if (!want_original && canvas->format == SPICE_SURFACE_FMT_16_555 &&
+        canvas->jpeg->ops->supports_format &&
+        canvas->jpeg->ops->supports_format(canvas->jpeg, SPICE_BITMAP_FMT_16BIT)) {
+        pixman_format = PIXMAN_x1r5g5b5;
+        jpeg_format = SPICE_BITMAP_FMT_16BIT;
+        invers_mask = 0x7fff7fff;
+    } else {
+        pixman_format = PIXMAN_x8r8g8b8;
+        jpeg_format = SPICE_BITMAP_FMT_32BIT;
+        invers_mask = 0x00ffffff;
+    }
+
     surface = surface_create(
 #ifdef WIN32
                              canvas->dc,
 #endif
-                             PIXMAN_x8r8g8b8,
+                             pixman_format,
                              width, height, FALSE);
     if (surface == NULL) {
         spice_warning("create surface failed");
@@ -522,18 +575,20 @@ static pixman_image_t *canvas_get_jpeg(CanvasBase *canvas, SpiceImage *image, in
     dest = (uint8_t *)pixman_image_get_data(surface);
     stride = pixman_image_get_stride(surface);
 
-    canvas->jpeg->ops->decode(canvas->jpeg, dest, stride, SPICE_BITMAP_FMT_32BIT);
+    canvas->jpeg->ops->decode(canvas->jpeg, dest, stride, jpeg_format);
 
     if (invers) {
         uint8_t *end = dest + height * stride;
+        int line_words = (width * (PIXMAN_FORMAT_BPP(pixman_format) / 8) + 3) >> 2;
+
         for (; dest != end; dest += stride) {
             uint32_t *pix;
             uint32_t *end_pix;
 
             pix = (uint32_t *)dest;
-            end_pix = pix + width;
+            end_pix = pix + line_words;
             for (; pix < end_pix; pix++) {
-                *pix ^= 0x00ffffff;
+                *pix ^= invers_mask;
             }
         }
     }
@@ -631,6 +686,7 @@ static pixman_image_t *canvas_bitmap_to_surface(CanvasBase *canvas, SpiceBitmap*
     uint8_t* src;
     pixman_image_t *image;
     pixman_format_code_t format;
+    const SpicePaletteTables *tables;
 
     spice_chunks_linearize(bitmap->data);
 
@@ -654,12 +710,22 @@ static pixman_image_t *canvas_bitmap_to_surface(CanvasBase *canvas, SpiceBitmap*
         return NULL;
     }
 
-    spice_bitmap_convert_to_pixman(format, image,
-                                   bitmap->format,
-                                   bitmap->flags,
-                                   bitmap->x, bitmap->y,
-                                   src, bitmap->stride,
-                                   canvas->format, palette);
+    tables = spice_palette_tables_cache_get(&canvas->palette_tables, palette, canvas->format);
+    if (tables) {
+        spice_bitmap_convert_to_pixman_tables(format, image,
+                                              bitmap->format,
+                                              bitmap->flags,
+                                              bitmap->x, bitmap->y,
+                                              src, bitmap->stride,
+                                              tables);
+    } else {
+        spice_bitmap_convert_to_pixman(format, image,
+                                       bitmap->format,
+                                       bitmap->flags,
+                                       bitmap->x, bitmap->y,
+                                       src, bitmap->stride,
+                                       canvas->format, palette);
+    }
     return image;
 }
 
@@ -684,6 +750,7 @@ static inline SpicePalette *canvas_get_palette(CanvasBase *canvas, SpicePalette
 static inline SpicePalette *canvas_get_localized_palette(CanvasBase *canvas, SpicePalette *base_palette, uint64_t palette_id, uint8_t flags, int *free_palette)
 {
     SpicePalette *palette = canvas_get_palette(canvas, base_palette, palette_id, flags);
+    const SpicePaletteTables *tables;
     SpicePalette *copy;
     uint32_t *now, *end;
     size_t size;
@@ -693,6 +760,12 @@ static inline SpicePalette *canvas_get_localized_palette(CanvasBase *canvas, Spi
         return palette;
     }
 
+    // palettes with an id are converted once, in their tables
+    tables = spice_palette_tables_cache_get(&canvas->palette_tables, palette, canvas->format);
+    if (tables && tables->palette_32bpp) {
+        return tables->palette_32bpp;
+    }
+
     size = sizeof(SpicePalette) + palette->num_ents * 4;
     copy = (SpicePalette *)spice_malloc(size);
     memcpy(copy, palette, size);
@@ -869,6 +942,55 @@ static pixman_image_t *canvas_get_glz(CanvasBase *canvas, SpiceImage *image,
     return canvas_get_glz_rgb_common(canvas, image->u.lz_rgb.data->chunk[0].data, want_original);
 }
 
+static int zlib_glz_stream_more_data(SpiceGlzStream *stream, uint8_t **io_ptr)
+{
+    ZlibGlzStream *zlib_stream = (ZlibGlzStream *)stream;
+    int n;
+
+    if (zlib_stream->remaining <= 0) {
+        return 0;
+    }
+
+    n = zlib_stream->zlib->ops->decode_more(zlib_stream->zlib, zlib_stream->buf,
+                                            MIN(zlib_stream->remaining,
+                                                ZLIB_GLZ_STREAM_CHUNK_SIZE));
+    if (n <= 0) {
+        zlib_stream->remaining = 0;
+        return 0;
+    }
+    zlib_stream->remaining -= n;
+    *io_ptr = zlib_stream->buf;
+    return n;
+}
+
+/* Inflate the zlib payload one ZLIB_GLZ_STREAM_CHUNK_SIZE window at a time
+ * while the glz decoder consumes it, instead of inflating everything into
+ * a glz_data_size buffer first. */
+static pixman_image_t *canvas_get_zlib_glz_rgb_stream(CanvasBase *canvas, SpiceImage *image,
+                                                      int want_original)
+{
+    ZlibGlzStream *stream;
+
+    spice_return_val_if_fail(canvas->glz_data.decoder != NULL, NULL);
+
+    if (!canvas->zlib_glz_stream) {
+        canvas->zlib_glz_stream = spice_new(ZlibGlzStream, 1);
+        canvas->zlib_glz_stream->base.more_data = zlib_glz_stream_more_data;
+    }
+    stream = canvas->zlib_glz_stream;
+    stream->zlib = canvas->zlib;
+    stream->remaining = image->u.zlib_glz.glz_data_size;
+
+    canvas->zlib->ops->decode_begin(canvas->zlib, image->u.zlib_glz.data->chunk[0].data,
+                                    image->u.zlib_glz.data->chunk[0].len);
+    canvas->glz_data.decoder->ops->decode_stream(canvas->glz_data.decoder,
+                                                 &stream->base, NULL,
+                                                 &canvas->glz_data.decode_data);
+    canvas->zlib->ops->decode_end(canvas->zlib);
+
+    return canvas->glz_data.decode_data.out_surface;
+}
+
 static pixman_image_t *canvas_get_zlib_glz_rgb(CanvasBase *canvas, SpiceImage *image,
                                                int want_original)
 {
@@ -878,6 +1000,13 @@ static pixman_image_t *canvas_get_zlib_glz_rgb(CanvasBase *canvas, SpiceImage *i
     spice_return_val_if_fail(canvas->zlib != NULL, NULL);
 
     spice_return_val_if_fail(image->u.zlib_glz.data->num_chunks == 1, NULL); /* TODO: Handle chunks */
+
+    if (canvas->zlib->ops->decode_begin && canvas->zlib->ops->decode_more &&
+        canvas->zlib->ops->decode_end && canvas->glz_data.decoder &&
+        canvas->glz_data.decoder->ops->decode_stream) {
+        return canvas_get_zlib_glz_rgb_stream(canvas, image, want_original);
+    }
+
     glz_data = (uint8_t*)spice_malloc(image->u.zlib_glz.glz_data_size);
     canvas->zlib->ops->decode(canvas->zlib, image->u.zlib_glz.data->chunk[0].data,
                               image->u.zlib_glz.data->chunk[0].len,
@@ -1050,7 +1179,8 @@ static SpiceCanvas *canvas_get_surface_mask_internal(CanvasBase *canvas, SpiceIm
  * e.g. losing alpha when blending a argb32 image on a rgb16 surface.
  */
 static pixman_image_t *canvas_get_image_internal(CanvasBase *canvas, SpiceImage *image,
-                                                 int want_original, int real_get)
+                                                 int want_original, int real_get,
+                                                 int jpeg_scale_denom)
 {
     SpiceImageDescriptor *descriptor = &image->descriptor;
     pixman_image_t *surface, *converted;
@@ -1095,7 +1225,7 @@ static pixman_image_t *canvas_get_image_internal(CanvasBase *canvas, SpiceImage
     }
 #endif
     case SPICE_IMAGE_TYPE_JPEG: {
-        surface = canvas_get_jpeg(canvas, image, 0);
+        surface = canvas_get_jpeg(canvas, image, 0, want_original, jpeg_scale_denom);
         break;
     }
     case SPICE_IMAGE_TYPE_JPEG_ALPHA: {
@@ -1145,6 +1275,22 @@ static pixman_image_t *canvas_get_image_internal(CanvasBase *canvas, SpiceImage
                                    0xff000000U, SPICE_ROP_OR);
     }
 
+    /* Decoded images going to the cache are shared with the ones of the same
+       content, after the only modification done here to them. The others are
+       used once and aren't worth remembering */
+    if (canvas->image_dedup &&
+        descriptor->type != SPICE_IMAGE_TYPE_FROM_CACHE &&
+#ifdef SW_CANVAS_CACHE
+        descriptor->type != SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS &&
+#endif
+        (descriptor->flags & SPICE_IMAGE_FLAGS_CACHE_ME
+#ifdef SW_CANVAS_CACHE
+         || descriptor->flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME
+#endif
+        )) {
+        surface = image_dedup_share(canvas->image_dedup, surface);
+    }
+
     if (descriptor->flags & SPICE_IMAGE_FLAGS_CACHE_ME &&
 #ifdef SW_CANVAS_CACHE
         descriptor->type != SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS &&
@@ -1225,7 +1371,8 @@ static pixman_image_t *canvas_get_image_internal(CanvasBase *canvas, SpiceImage
 #else
 
 static pixman_image_t *canvas_get_image_internal(CanvasBase *canvas, SpiceImage *image,
-                                                 int want_original, int real_get)
+                                                 int want_original, int real_get,
+                                                 int jpeg_scale_denom)
 {
     SpiceImageDescriptor *descriptor = &image->descriptor;
     pixman_format_code_t format;
@@ -1265,12 +1412,54 @@ static SpiceCanvas *canvas_get_surface(CanvasBase *canvas, SpiceImage *image)
 static pixman_image_t *canvas_get_image(CanvasBase *canvas, SpiceImage *image,
                                         int want_original)
 {
-    return canvas_get_image_internal(canvas, image, want_original, TRUE);
+    return canvas_get_image_internal(canvas, image, want_original, TRUE, 1);
+}
+
+/* Returns the source image for drawing src_area of image scaled into
+ * dest_area. JPEG decoders can produce a 1/2, 1/4 or 1/8 downscaled image
+ * almost for free during the IDCT, so when an uncached JPEG is going to
+ * be scaled down anyway, decode it at the smallest such size that still
+ * covers dest_area and adjust src_area to match.
+ */
+static pixman_image_t *canvas_get_image_for_area(CanvasBase *canvas, SpiceImage *image,
+                                                 SpiceRect *src_area,
+                                                 const SpiceRect *dest_area)
+{
+    int src_width = src_area->right - src_area->left;
+    int src_height = src_area->bottom - src_area->top;
+    int denom;
+
+    if (image->descriptor.type != SPICE_IMAGE_TYPE_JPEG ||
+        canvas->jpeg == NULL || canvas->jpeg->ops->set_scale == NULL ||
+        image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME
+#ifdef SW_CANVAS_CACHE
+        || image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME
+#endif
+       ) {
+        return canvas_get_image(canvas, image, FALSE);
+    }
+
+    for (denom = 8; denom > 1; denom >>= 1) {
+        if (src_width / denom >= dest_area->right - dest_area->left &&
+            src_height / denom >= dest_area->bottom - dest_area->top) {
+            break;
+        }
+    }
+    if (denom == 1) {
+        return canvas_get_image(canvas, image, FALSE);
+    }
+
+    src_area->left /= denom;
+    src_area->top /= denom;
+    src_area->right = src_area->left + src_width / denom;
+    src_area->bottom = src_area->top + src_height / denom;
+
+    return canvas_get_image_internal(canvas, image, FALSE, TRUE, denom);
 }
 
 static void canvas_touch_image(CanvasBase *canvas, SpiceImage *image)
 {
-    canvas_get_image_internal(canvas, image, TRUE, FALSE);
+    canvas_get_image_internal(canvas, image, TRUE, FALSE, 1);
 }
 
 static pixman_image_t* canvas_get_image_from_self(SpiceCanvas *canvas,
@@ -1312,17 +1501,51 @@ static pixman_image_t* canvas_get_image_from_self(SpiceCanvas *canvas,
     return surface;
 }
 
+#define REVERS_BITS_2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define REVERS_BITS_4(n) REVERS_BITS_2(n), REVERS_BITS_2(n + 2 * 16), \
+                         REVERS_BITS_2(n + 1 * 16), REVERS_BITS_2(n + 3 * 16)
+#define REVERS_BITS_6(n) REVERS_BITS_4(n), REVERS_BITS_4(n + 2 * 4), \
+                         REVERS_BITS_4(n + 1 * 4), REVERS_BITS_4(n + 3 * 4)
+
+static const uint8_t revers_bits_table[256] = {
+    REVERS_BITS_6(0), REVERS_BITS_6(2), REVERS_BITS_6(1), REVERS_BITS_6(3)
+};
+
+#undef REVERS_BITS_2
+#undef REVERS_BITS_4
+#undef REVERS_BITS_6
+
 static inline uint8_t revers_bits(uint8_t byte)
 {
-    uint8_t ret = 0;
-    int i;
+    return revers_bits_table[byte];
+}
+
+/* Copies a line of a 1 bpp mask, reversing the bit order of each byte and/or inverting it */
+static inline void canvas_copy_mask_line(uint8_t *dest, const uint8_t *src, int line_size,
+                                         int reverse, int invers)
+{
+    int i = 0;
+
+    if (reverse) {
+        const uint8_t xor_mask = invers ? 0xff : 0x00;
 
-    for (i = 0; i < 4; i++) {
-        int shift = 7 - i * 2;
-        ret |= (byte & (1 << i)) << shift;
-        ret |= (byte & (0x80 >> i)) >> shift;
+        for (; i < line_size; i++) {
+            dest[i] = revers_bits_table[src[i]] ^ xor_mask;
+        }
+    } else if (invers) {
+        for (; i + 4 <= line_size; i += 4) {
+            uint32_t word;
+
+            memcpy(&word, src + i, sizeof(word));
+            word = ~word;
+            memcpy(dest + i, &word, sizeof(word));
+        }
+        for (; i < line_size; i++) {
+            dest[i] = ~src[i];
+        }
+    } else {
+        memcpy(dest, src, line_size);
     }
-    return ret;
 }
 
 static pixman_image_t *canvas_get_bitmap_mask(CanvasBase *canvas, SpiceBitmap* bitmap, int invers)
@@ -1334,6 +1557,27 @@ static pixman_image_t *canvas_get_bitmap_mask(CanvasBase *canvas, SpiceBitmap* b
     int src_stride;
     int line_size;
     int dest_stride;
+    int reverse;
+
+    switch (bitmap->format) {
+#if defined(GL_CANVAS) || defined(GDI_CANVAS)
+    case SPICE_BITMAP_FMT_1BIT_BE:
+#else
+    case SPICE_BITMAP_FMT_1BIT_LE:
+#endif
+        reverse = FALSE;
+        break;
+#if defined(GL_CANVAS) || defined(GDI_CANVAS)
+    case SPICE_BITMAP_FMT_1BIT_LE:
+#else
+    case SPICE_BITMAP_FMT_1BIT_BE:
+#endif
+        reverse = TRUE;
+        break;
+    default:
+        spice_warn_if_reached();
+        return NULL;
+    }
 
     surface = surface_create(
 #ifdef WIN32
@@ -1360,75 +1604,8 @@ static pixman_image_t *canvas_get_bitmap_mask(CanvasBase *canvas, SpiceBitmap* b
         dest_stride = -dest_stride;
     }
 
-    if (invers) {
-        switch (bitmap->format) {
-#if defined(GL_CANVAS) || defined(GDI_CANVAS)
-        case SPICE_BITMAP_FMT_1BIT_BE:
-#else
-        case SPICE_BITMAP_FMT_1BIT_LE:
-#endif
-            for (; src_line != end_line; src_line += src_stride, dest_line += dest_stride) {
-                uint8_t *dest = dest_line;
-                uint8_t *now = src_line;
-                uint8_t *end = now + line_size;
-                while (now < end) {
-                    *(dest++) = ~*(now++);
-                }
-            }
-            break;
-#if defined(GL_CANVAS) || defined(GDI_CANVAS)
-        case SPICE_BITMAP_FMT_1BIT_LE:
-#else
-        case SPICE_BITMAP_FMT_1BIT_BE:
-#endif
-            for (; src_line != end_line; src_line += src_stride, dest_line += dest_stride) {
-                uint8_t *dest = dest_line;
-                uint8_t *now = src_line;
-                uint8_t *end = now + line_size;
-
-                while (now < end) {
-                    *(dest++) = ~revers_bits(*(now++));
-                }
-            }
-            break;
-        default:
-            pixman_image_unref(surface);
-            surface = NULL;
-            spice_warn_if_reached();
-            return NULL;
-        }
-    } else {
-        switch (bitmap->format) {
-#if defined(GL_CANVAS) || defined(GDI_CANVAS)
-        case SPICE_BITMAP_FMT_1BIT_BE:
-#else
-        case SPICE_BITMAP_FMT_1BIT_LE:
-#endif
-            for (; src_line != end_line; src_line += src_stride, dest_line += dest_stride) {
-                memcpy(dest_line, src_line, line_size);
-            }
-            break;
-#if defined(GL_CANVAS) || defined(GDI_CANVAS)
-        case SPICE_BITMAP_FMT_1BIT_LE:
-#else
-        case SPICE_BITMAP_FMT_1BIT_BE:
-#endif
-            for (; src_line != end_line; src_line += src_stride, dest_line += dest_stride) {
-                uint8_t *dest = dest_line;
-                uint8_t *now = src_line;
-                uint8_t *end = now + line_size;
-
-                while (now < end) {
-                    *(dest++) = revers_bits(*(now++));
-                }
-            }
-            break;
-        default:
-            pixman_image_unref(surface);
-            surface = NULL;
-            spice_warn_if_reached();
-            return NULL;
-        }
+    for (; src_line != end_line; src_line += src_stride, dest_line += dest_stride) {
+        canvas_copy_mask_line(dest_line, src_line, line_size, reverse, invers);
     }
     return surface;
 }
@@ -1454,16 +1631,46 @@ static inline pixman_image_t *canvas_A1_invers(pixman_image_t *src_surf)
     dest_stride = pixman_image_get_stride(invers);
 
     for (; src_line != end_line; src_line += src_stride, dest_line += dest_stride) {
-        uint8_t *dest = dest_line;
-        uint8_t *now = src_line;
-        uint8_t *end = now + line_size;
-        while (now < end) {
-            *(dest++) = ~*(now++);
-        }
+        canvas_copy_mask_line(dest_line, src_line, line_size, FALSE, TRUE);
     }
     return invers;
 }
 
+#if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
+/* Returns the inverted copy of a mask of the image cache, made the first time it is needed.
+   Cached masks are identified by their id and their bits, so that a mask replaced in the
+   image cache doesn't match. The entries keep a reference to the mask, so its bits stay
+   its own while it can match */
+static pixman_image_t *canvas_get_inverted_mask(CanvasBase *canvas, uint64_t id,
+                                                pixman_image_t *mask)
+{
+    uint32_t *bits = pixman_image_get_data(mask);
+    CanvasInvertedMask *entry;
+    int i;
+
+    for (i = 0; i < CANVAS_INVERTED_MASKS; i++) {
+        entry = &canvas->inverted_masks[i];
+        if (entry->image && entry->id == id && pixman_image_get_data(entry->mask) == bits) {
+            return pixman_image_ref(entry->image);
+        }
+    }
+
+    entry = &canvas->inverted_masks[canvas->next_inverted_mask];
+    canvas->next_inverted_mask = (canvas->next_inverted_mask + 1) % CANVAS_INVERTED_MASKS;
+    if (entry->image) {
+        pixman_image_unref(entry->image);
+        pixman_image_unref(entry->mask);
+    }
+    entry->id = id;
+    entry->image = canvas_A1_invers(mask);
+    if (!entry->image) {
+        return NULL;
+    }
+    entry->mask = pixman_image_ref(mask);
+    return pixman_image_ref(entry->image);
+}
+#endif
+
 static pixman_image_t *canvas_get_mask(CanvasBase *canvas, SpiceQMask *mask, int *needs_invert_out)
 {
     SpiceImage *image;
@@ -1518,7 +1725,7 @@ static pixman_image_t *canvas_get_mask(CanvasBase *canvas, SpiceQMask *mask, int
             *needs_invert_out = TRUE;
         } else {
             pixman_image_t *inv_surf;
-            inv_surf = canvas_A1_invers(surface);
+            inv_surf = canvas_get_inverted_mask(canvas, image->descriptor.id, surface);
             pixman_image_unref(surface);
             surface = inv_surf;
         }
@@ -1850,8 +2057,22 @@ static int quic_usr_more_lines(QuicUsrContext *usr, uint8_t **lines)
 
 static void canvas_base_destroy(CanvasBase *canvas)
 {
+#if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
+    int i;
+
+#endif
     quic_destroy(canvas->quic_data.quic);
     lz_destroy(canvas->lz_data.lz);
+    free(canvas->zlib_glz_stream);
+    spice_palette_tables_cache_fini(&canvas->palette_tables);
+#if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
+    for (i = 0; i < CANVAS_INVERTED_MASKS; i++) {
+        if (canvas->inverted_masks[i].image) {
+            pixman_image_unref(canvas->inverted_masks[i].image);
+            pixman_image_unref(canvas->inverted_masks[i].mask);
+        }
+    }
+#endif
 #ifdef GDI_CANVAS
     DeleteDC(canvas->dc);
 #endif
@@ -1884,6 +2105,12 @@ void *spice_canvas_get_usr_data(SpiceCanvas *spice_canvas)
     CanvasBase *canvas = (CanvasBase *)spice_canvas;
     return  canvas->usr_data;
 }
+
+void spice_canvas_set_image_dedup(SpiceCanvas *spice_canvas, SpiceImageDedup *dedup)
+{
+    CanvasBase *canvas = (CanvasBase *)spice_canvas;
+    canvas->image_dedup = dedup;
+}
 #endif
 
 
@@ -2195,30 +2422,32 @@ static void canvas_draw_copy(SpiceCanvas *spice_canvas, SpiceRect *bbox, SpiceCl
             }
         }
     } else {
-        src_image = canvas_get_image(canvas, copy->src_bitmap, FALSE);
+        SpiceRect src_area = copy->src_area;
+
+        src_image = canvas_get_image_for_area(canvas, copy->src_bitmap, &src_area, bbox);
         spice_return_if_fail(src_image != NULL);
 
-        if (rect_is_same_size(bbox, &copy->src_area)) {
+        if (rect_is_same_size(bbox, &src_area)) {
             if (rop == SPICE_ROP_COPY) {
                 spice_canvas->ops->blit_image(spice_canvas, &dest_region,
                                               src_image,
-                                              bbox->left - copy->src_area.left,
-                                              bbox->top - copy->src_area.top);
+                                              bbox->left - src_area.left,
+                                              bbox->top - src_area.top);
             } else {
                 spice_canvas->ops->blit_image_rop(spice_canvas, &dest_region,
                                                   src_image,
-                                                  bbox->left - copy->src_area.left,
-                                                  bbox->top - copy->src_area.top,
+                                                  bbox->left - src_area.left,
+                                                  bbox->top - src_area.top,
                                                   rop);
             }
         } else {
             if (rop == SPICE_ROP_COPY) {
                 spice_canvas->ops->scale_image(spice_canvas, &dest_region,
                                                src_image,
-                                               copy->src_area.left,
-                                               copy->src_area.top,
-                                               copy->src_area.right - copy->src_area.left,
-                                               copy->src_area.bottom - copy->src_area.top,
+                                               src_area.left,
+                                               src_area.top,
+                                               src_area.right - src_area.left,
+                                               src_area.bottom - src_area.top,
                                                bbox->left,
                                                bbox->top,
                                                bbox->right - bbox->left,
@@ -2227,10 +2456,10 @@ static void canvas_draw_copy(SpiceCanvas *spice_canvas, SpiceRect *bbox, SpiceCl
             } else {
                 spice_canvas->ops->scale_image_rop(spice_canvas, &dest_region,
                                                    src_image,
-                                                   copy->src_area.left,
-                                                   copy->src_area.top,
-                                                   copy->src_area.right - copy->src_area.left,
-                                                   copy->src_area.bottom - copy->src_area.top,
+                                                   src_area.left,
+                                                   src_area.top,
+                                                   src_area.right - src_area.left,
+                                                   src_area.bottom - src_area.top,
                                                    bbox->left,
                                                    bbox->top,
                                                    bbox->right - bbox->left,
@@ -2466,21 +2695,23 @@ static void canvas_draw_opaque(SpiceCanvas *spice_canvas, SpiceRect *bbox, Spice
                                                         opaque->scale_mode);
         }
     } else {
-        src_image = canvas_get_image(canvas, opaque->src_bitmap, FALSE);
+        SpiceRect src_area = opaque->src_area;
+
+        src_image = canvas_get_image_for_area(canvas, opaque->src_bitmap, &src_area, bbox);
         spice_return_if_fail(src_image != NULL);
 
-        if (rect_is_same_size(bbox, &opaque->src_area)) {
+        if (rect_is_same_size(bbox, &src_area)) {
             spice_canvas->ops->blit_image(spice_canvas, &dest_region,
                                           src_image,
-                                          bbox->left - opaque->src_area.left,
-                                          bbox->top - opaque->src_area.top);
+                                          bbox->left - src_area.left,
+                                          bbox->top - src_area.top);
         } else {
             spice_canvas->ops->scale_image(spice_canvas, &dest_region,
                                            src_image,
-                                           opaque->src_area.left,
-                                           opaque->src_area.top,
-                                           opaque->src_area.right - opaque->src_area.left,
-                                           opaque->src_area.bottom - opaque->src_area.top,
+                                           src_area.left,
+                                           src_area.top,
+                                           src_area.right - src_area.left,
+                                           src_area.bottom - src_area.top,
                                            bbox->left,
                                            bbox->top,
                                            bbox->right - bbox->left,
@@ -3488,6 +3719,8 @@ static int canvas_base_init(CanvasBase *canvas, SpiceCanvasOps *ops,
     canvas->glz_data.decoder = glz_decoder;
     canvas->jpeg = jpeg_decoder;
     canvas->zlib = zlib_decoder;
+    canvas->zlib_glz_stream = NULL;
+    spice_palette_tables_cache_init(&canvas->palette_tables);
 
     canvas->format = format;
 
@@ -3509,6 +3742,8 @@ static int canvas_base_init(CanvasBase *canvas, SpiceCanvasOps *ops,
 
 #if defined(SW_CANVAS_CACHE) || defined(SW_CANVAS_IMAGE_CACHE)
     canvas->bits_cache = bits_cache;
+    memset(canvas->inverted_masks, 0, sizeof(canvas->inverted_masks));
+    canvas->next_inverted_mask = 0;
 #endif
 #ifdef SW_CANVAS_CACHE
     canvas->palette_cache = palette_cache;
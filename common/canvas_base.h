@@ -39,7 +39,9 @@ typedef struct _SpicePaletteCache SpicePaletteCache;
 typedef struct _SpiceGlzDecoder SpiceGlzDecoder;
 typedef struct _SpiceJpegDecoder SpiceJpegDecoder;
 typedef struct _SpiceZlibDecoder SpiceZlibDecoder;
+typedef struct _SpiceGlzStream SpiceGlzStream;
 typedef struct _SpiceCanvas SpiceCanvas;
+typedef struct SpiceImageDedup SpiceImageDedup;
 
 typedef struct {
     void (*put)(SpiceImageCache *cache,
@@ -85,11 +87,25 @@ struct _SpicePaletteCache {
   SpicePaletteCacheOps *ops;
 };
 
+/* Source of glz compressed bytes for SpiceGlzDecoderOps::decode_stream.
+ * more_data gets the next chunk of the glz stream; it returns the number
+ * of bytes in the chunk, or 0 when the stream is exhausted. The chunk
+ * stays valid until the next call to more_data. */
+struct _SpiceGlzStream {
+    int (*more_data)(SpiceGlzStream *stream, uint8_t **io_ptr);
+};
+
 typedef struct {
     void (*decode)(SpiceGlzDecoder *decoder,
                    uint8_t *data,
                    SpicePalette *plt,
                    void *usr_data);
+    /* optional, same as decode but pulls the glz data from stream.
+       The first chunk is also read through stream->more_data */
+    void (*decode_stream)(SpiceGlzDecoder *decoder,
+                          SpiceGlzStream *stream,
+                          SpicePalette *plt,
+                          void *usr_data);
 } SpiceGlzDecoderOps;
 
 struct _SpiceGlzDecoder {
@@ -107,6 +123,18 @@ typedef struct SpiceJpegDecoderOps {
                    uint8_t* dest,
                    int stride,
                    int format);
+    /* optional: make the following decode produce an image downscaled by
+       1/scale_denom (2, 4 or 8), which the IDCT can do at a fraction of the
+       cost of a full decode. Called between begin_decode and decode,
+       returns the size of the scaled output */
+    void (*set_scale)(SpiceJpegDecoder *decoder,
+                      int scale_denom,
+                      int* out_width,
+                      int* out_height);
+    /* optional: return TRUE if decode can write the given SPICE_BITMAP_FMT
+       directly. SPICE_BITMAP_FMT_32BIT is always supported */
+    int (*supports_format)(SpiceJpegDecoder *decoder,
+                           int format);
 } SpiceJpegDecoderOps;
 
 struct _SpiceJpegDecoder {
@@ -119,6 +147,17 @@ typedef struct {
                    int data_size,
                    uint8_t *dest,
                    int dest_size);
+    /* optional incremental interface, used together with
+       SpiceGlzDecoderOps::decode_stream. decode_more inflates up to
+       dest_size bytes and returns the number of bytes written to dest,
+       which is less than dest_size only at the end of the stream */
+    void (*decode_begin)(SpiceZlibDecoder *decoder,
+                         uint8_t *data,
+                         int data_size);
+    int (*decode_more)(SpiceZlibDecoder *decoder,
+                       uint8_t *dest,
+                       int dest_size);
+    void (*decode_end)(SpiceZlibDecoder *decoder);
 } SpiceZlibDecoderOps;
 
 struct _SpiceZlibDecoder {
@@ -308,10 +347,24 @@ typedef struct {
                         pixman_region32_t *dest_region,
                         int dx, int dy);
     pixman_image_t *(*get_image)(SpiceCanvas *canvas, int force_opaque);
+
+    /* Like put_image, but takes a 4:2:0 video frame and converts it while
+       drawing, so stream frames need no intermediate RGB buffer. Added after
+       the other ops to keep their slots. */
+    void (*put_yuv_image)(SpiceCanvas *canvas,
+                          const SpiceRect *dest,
+                          SpiceYUVFormat format,
+                          const uint8_t *planes[3], const int strides[3],
+                          uint32_t src_width, uint32_t src_height,
+                          const QRegion *clip);
 } SpiceCanvasOps;
 
 void spice_canvas_set_usr_data(SpiceCanvas *canvas, void *data, spice_destroy_fn_t destroy_fn);
 void *spice_canvas_get_usr_data(SpiceCanvas *canvas);
+/* Makes the images decoded by canvas for its image cache share their pixels
+   with the identical ones in dedup (see image_dedup.h), NULL to stop. dedup
+   must outlive the images of the canvas */
+void spice_canvas_set_image_dedup(SpiceCanvas *canvas, SpiceImageDedup *dedup);
 
 struct _SpiceCanvas {
   SpiceCanvasOps *ops;
@@ -0,0 +1,329 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Replays a canvas trace recorded with spice_canvas_trace_start() on a
+   software canvas, and prints the time spent in each op and the checksum
+   of the resulting surface.
+
+   With --image-cache, every image drawn is also decoded again and put in
+   an image cache (see image_cache.h) under a new id, as when the server
+   sends the same content under several ids, and the memory held by the
+   cache is printed. --dedup puts the images through an image dedup (see
+   image_dedup.h) before, which shows how much of that memory it saves. As
+   every use of an image counts as a new id, this is an upper bound. The op
+   times then include the caching. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sw_canvas.h"
+#include "canvas_trace.h"
+#include "canvas_utils.h"
+#include "image_cache.h"
+#include "image_dedup.h"
+#include "message_stats.h"
+
+#define REPLAY_CACHE_BYTES (64 * 1024 * 1024)
+#define REPLAY_DEDUP_BYTES (64 * 1024 * 1024)
+
+static SpiceCanvasOps canvas_ops;
+static SpiceCanvasOps replay_ops;
+static SpiceImageCache *image_cache;
+static SpiceImageDedup *image_dedup;
+static uint64_t image_id;
+
+/* What the canvas does with an image it decoded and was asked to cache */
+static void replay_cache_image(pixman_image_t *image)
+{
+    pixman_format_code_t format;
+    pixman_image_t *decoded;
+    uint8_t *src, *dest;
+    int src_stride, stride, row_bytes, height, y;
+
+    if (!spice_pixman_image_get_format(image, &format)) {
+        return;
+    }
+    height = pixman_image_get_height(image);
+#ifdef WIN32
+    decoded = surface_create(NULL, format, pixman_image_get_width(image), height, TRUE);
+#else
+    decoded = surface_create(format, pixman_image_get_width(image), height, TRUE);
+#endif
+    src = (uint8_t *)pixman_image_get_data(image);
+    src_stride = pixman_image_get_stride(image);
+    dest = (uint8_t *)pixman_image_get_data(decoded);
+    stride = pixman_image_get_stride(decoded);
+    row_bytes = (pixman_image_get_width(image) * PIXMAN_FORMAT_BPP(format) + 7) / 8;
+    for (y = 0; y < height; y++, src += src_stride, dest += stride) {
+        memcpy(dest, src, row_bytes);
+    }
+
+    if (image_dedup) {
+        decoded = image_dedup_share(image_dedup, decoded);
+    }
+    image_cache->ops->put(image_cache, image_id++, decoded);
+    pixman_image_unref(decoded);
+}
+
+static void replay_fill_tiled_rects(SpiceCanvas *canvas, pixman_box32_t *rects, int n_rects,
+                                    pixman_image_t *tile, int offset_x, int offset_y)
+{
+    replay_cache_image(tile);
+    canvas_ops.fill_tiled_rects(canvas, rects, n_rects, tile, offset_x, offset_y);
+}
+
+static void replay_fill_tiled_rects_rop(SpiceCanvas *canvas, pixman_box32_t *rects,
+                                        int n_rects, pixman_image_t *tile,
+                                        int offset_x, int offset_y, SpiceROP rop)
+{
+    replay_cache_image(tile);
+    canvas_ops.fill_tiled_rects_rop(canvas, rects, n_rects, tile, offset_x, offset_y, rop);
+}
+
+static void replay_blit_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                              pixman_image_t *src_image, int offset_x, int offset_y)
+{
+    replay_cache_image(src_image);
+    canvas_ops.blit_image(canvas, region, src_image, offset_x, offset_y);
+}
+
+static void replay_blit_image_rop(SpiceCanvas *canvas, pixman_region32_t *region,
+                                  pixman_image_t *src_image, int offset_x, int offset_y,
+                                  SpiceROP rop)
+{
+    replay_cache_image(src_image);
+    canvas_ops.blit_image_rop(canvas, region, src_image, offset_x, offset_y, rop);
+}
+
+static void replay_scale_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                               pixman_image_t *src_image,
+                               int src_x, int src_y, int src_width, int src_height,
+                               int dest_x, int dest_y, int dest_width, int dest_height,
+                               int scale_mode)
+{
+    replay_cache_image(src_image);
+    canvas_ops.scale_image(canvas, region, src_image, src_x, src_y, src_width, src_height,
+                           dest_x, dest_y, dest_width, dest_height, scale_mode);
+}
+
+static void replay_scale_image_rop(SpiceCanvas *canvas, pixman_region32_t *region,
+                                   pixman_image_t *src_image,
+                                   int src_x, int src_y, int src_width, int src_height,
+                                   int dest_x, int dest_y, int dest_width, int dest_height,
+                                   int scale_mode, SpiceROP rop)
+{
+    replay_cache_image(src_image);
+    canvas_ops.scale_image_rop(canvas, region, src_image, src_x, src_y, src_width, src_height,
+                               dest_x, dest_y, dest_width, dest_height, scale_mode, rop);
+}
+
+static void replay_blend_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                               int dest_has_alpha, pixman_image_t *src_image,
+                               int src_x, int src_y, int dest_x, int dest_y,
+                               int width, int height, int overall_alpha)
+{
+    replay_cache_image(src_image);
+    canvas_ops.blend_image(canvas, region, dest_has_alpha, src_image, src_x, src_y,
+                           dest_x, dest_y, width, height, overall_alpha);
+}
+
+static void replay_blend_scale_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                                     int dest_has_alpha, pixman_image_t *src_image,
+                                     int src_x, int src_y, int src_width, int src_height,
+                                     int dest_x, int dest_y, int dest_width, int dest_height,
+                                     int scale_mode, int overall_alpha)
+{
+    replay_cache_image(src_image);
+    canvas_ops.blend_scale_image(canvas, region, dest_has_alpha, src_image,
+                                 src_x, src_y, src_width, src_height,
+                                 dest_x, dest_y, dest_width, dest_height,
+                                 scale_mode, overall_alpha);
+}
+
+static void replay_colorkey_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                                  pixman_image_t *src_image, int offset_x, int offset_y,
+                                  uint32_t transparent_color)
+{
+    replay_cache_image(src_image);
+    canvas_ops.colorkey_image(canvas, region, src_image, offset_x, offset_y,
+                              transparent_color);
+}
+
+static void replay_colorkey_scale_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                                        pixman_image_t *src_image,
+                                        int src_x, int src_y, int src_width, int src_height,
+                                        int dest_x, int dest_y,
+                                        int dest_width, int dest_height,
+                                        uint32_t transparent_color)
+{
+    replay_cache_image(src_image);
+    canvas_ops.colorkey_scale_image(canvas, region, src_image,
+                                    src_x, src_y, src_width, src_height,
+                                    dest_x, dest_y, dest_width, dest_height,
+                                    transparent_color);
+}
+
+static void replay_hook_images(SpiceCanvas *canvas)
+{
+    canvas_ops = *canvas->ops;
+    replay_ops = canvas_ops;
+    replay_ops.fill_tiled_rects = replay_fill_tiled_rects;
+    replay_ops.fill_tiled_rects_rop = replay_fill_tiled_rects_rop;
+    replay_ops.blit_image = replay_blit_image;
+    replay_ops.blit_image_rop = replay_blit_image_rop;
+    replay_ops.scale_image = replay_scale_image;
+    replay_ops.scale_image_rop = replay_scale_image_rop;
+    replay_ops.blend_image = replay_blend_image;
+    replay_ops.blend_scale_image = replay_blend_scale_image;
+    replay_ops.colorkey_image = replay_colorkey_image;
+    replay_ops.colorkey_scale_image = replay_colorkey_scale_image;
+    canvas->ops = &replay_ops;
+}
+
+static void replay_print_image_memory(void)
+{
+    SpiceImageCacheStats cache_stats;
+    uint64_t bytes;
+
+    image_cache_get_stats(image_cache, &cache_stats);
+    printf("image cache: %llu images put, %llu kept, %llu bytes, %llu evictions\n",
+           (unsigned long long)image_id, (unsigned long long)cache_stats.n_images,
+           (unsigned long long)cache_stats.bytes, (unsigned long long)cache_stats.evictions);
+    bytes = cache_stats.bytes - cache_stats.shared_bytes;
+    if (image_dedup) {
+        SpiceImageDedupStats dedup_stats;
+
+        image_dedup_get_stats(image_dedup, &dedup_stats);
+        printf("image dedup: %llu hits, %llu misses, %llu images, %llu bytes\n",
+               (unsigned long long)dedup_stats.hits, (unsigned long long)dedup_stats.misses,
+               (unsigned long long)dedup_stats.n_images,
+               (unsigned long long)dedup_stats.bytes);
+        bytes += dedup_stats.bytes;
+    }
+    printf("image memory: %llu bytes, %.1f%% of the cached images\n",
+           (unsigned long long)bytes,
+           cache_stats.bytes ? bytes * 100.0 / cache_stats.bytes : 100.0);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--image-cache [--dedup]] TRACE\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    SpiceCanvasTraceStats stats;
+    SpiceCanvas *canvas;
+    pixman_image_t *image;
+    uint64_t start, total;
+    int width, height;
+    uint32_t format;
+    const char *path = NULL;
+    int use_cache = FALSE, use_dedup = FALSE;
+    FILE *file;
+    int ret, i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image-cache") == 0) {
+            use_cache = TRUE;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            use_dedup = TRUE;
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (path == NULL || (use_dedup && !use_cache)) {
+        usage(argv[0]);
+    }
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    if (!spice_canvas_trace_read_header(file, &width, &height, &format)) {
+        fprintf(stderr, "%s: not a canvas trace\n", path);
+        fclose(file);
+        return 1;
+    }
+
+    sw_canvas_init();
+    canvas = canvas_create(width, height, format
+#ifdef SW_CANVAS_CACHE
+                           , NULL, NULL
+#elif defined(SW_CANVAS_IMAGE_CACHE)
+                           , NULL
+#endif
+                           , NULL, NULL, NULL, NULL);
+    if (canvas == NULL) {
+        fprintf(stderr, "failed to create a %dx%d canvas of format %u\n",
+                width, height, format);
+        fclose(file);
+        return 1;
+    }
+    if (use_cache) {
+        image_cache = image_cache_create(REPLAY_CACHE_BYTES);
+        if (use_dedup) {
+            image_dedup = image_dedup_create(REPLAY_DEDUP_BYTES);
+        }
+        replay_hook_images(canvas);
+    }
+
+    start = spice_message_stats_now();
+    ret = spice_canvas_trace_replay(file, canvas, &stats);
+    total = spice_message_stats_now() - start;
+    fclose(file);
+    if (!ret) {
+        fprintf(stderr, "%s: truncated or corrupted trace, stopped replaying\n", path);
+    }
+
+    printf("%-24s %10s %12s %10s\n", "op", "count", "total ms", "avg us");
+    for (i = 0; i < SPICE_CANVAS_TRACE_N_OPS; i++) {
+        SpiceCanvasTraceOpStats *op = &stats.ops[i];
+
+        if (op->count == 0) {
+            continue;
+        }
+        printf("%-24s %10llu %12.3f %10.3f\n",
+               spice_canvas_trace_op_name(i), (unsigned long long)op->count,
+               op->time_ns / 1e6, op->time_ns / 1e3 / op->count);
+    }
+    printf("images: %llu, %llu bytes\n",
+           (unsigned long long)stats.n_images, (unsigned long long)stats.image_bytes);
+    printf("total: %.3f ms\n", total / 1e6);
+    if (image_cache) {
+        replay_print_image_memory();
+    }
+
+    image = canvas->ops->get_image(canvas, FALSE);
+    printf("checksum: %016llx\n", (unsigned long long)spice_canvas_trace_image_checksum(image));
+    pixman_image_unref(image);
+    canvas->ops->destroy(canvas);
+    /* the cache references the images of the dedup */
+    image_cache_destroy(image_cache);
+    image_dedup_destroy(image_dedup);
+
+    return ret ? 0 : 1;
+}
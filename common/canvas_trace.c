@@ -0,0 +1,1252 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "canvas_trace.h"
+#include "canvas_utils.h"
+#include "message_stats.h"
+#include "spice_common.h"
+#include "mem.h"
+
+/* A trace is a header followed by records, each starting with a one byte
+   tag. Images are written in an image record the first time they are used
+   and referred to by their index, in order of appearance, afterwards.
+   Integers are 32 bits, regions and rects are a count followed by boxes. */
+
+#define TRACE_MAGIC 0x54435053 /* "SPCT" */
+#define TRACE_VERSION 1
+
+#define TRACE_RECORD_IMAGE 0x80
+
+/* Limits checked when reading, so a corrupted file can't make us allocate
+   unreasonable amounts of memory */
+#define TRACE_MAX_BOXES (1 << 22)
+#define TRACE_MAX_IMAGE_SIZE (1 << 16)
+#define TRACE_MAX_IMAGE_PIXELS (1 << 26)
+
+typedef struct TraceImage {
+    uint64_t hash;
+    uint32_t index;
+} TraceImage;
+
+struct SpiceCanvasTrace {
+    SpiceCanvasOps ops; /* installed on the canvas, must be first */
+    SpiceCanvasOps *canvas_ops;
+    SpiceCanvas *canvas;
+    FILE *file;
+    int error;
+
+    /* open addressing table of the images written so far, hash 0 is free */
+    TraceImage *images;
+    uint32_t images_size;
+    uint32_t n_images;
+};
+
+static const char *const op_names[SPICE_CANVAS_TRACE_N_OPS] = {
+    "fill_solid_spans",
+    "fill_solid_rects",
+    "fill_solid_rects_rop",
+    "fill_tiled_rects",
+    "fill_tiled_rects_rop",
+    "blit_image",
+    "blit_image_rop",
+    "scale_image",
+    "scale_image_rop",
+    "blend_image",
+    "blend_scale_image",
+    "colorkey_image",
+    "colorkey_scale_image",
+    "copy_region",
+    "put_image",
+    "put_pixels",
+    "clear",
+    "group_start",
+    "group_end",
+};
+
+const char *spice_canvas_trace_op_name(SpiceCanvasTraceOp op)
+{
+    if ((unsigned)op >= SPICE_CANVAS_TRACE_N_OPS) {
+        return "unknown";
+    }
+    return op_names[op];
+}
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t *data, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t spice_canvas_trace_image_checksum(pixman_image_t *image)
+{
+    int width = pixman_image_get_width(image);
+    int height = pixman_image_get_height(image);
+    int stride = pixman_image_get_stride(image);
+    int row_bytes = (width * spice_pixman_image_get_bpp(image) + 7) / 8;
+    const uint8_t *line = (const uint8_t *)pixman_image_get_data(image);
+    uint32_t header[3];
+    uint64_t hash;
+    int y;
+
+    header[0] = pixman_image_get_depth(image);
+    header[1] = width;
+    header[2] = height;
+    hash = fnv1a(FNV_OFFSET_BASIS, (const uint8_t *)header, sizeof(header));
+    for (y = 0; y < height; y++, line += stride) {
+        hash = fnv1a(hash, line, row_bytes);
+    }
+    return hash;
+}
+
+static pixman_format_code_t image_format_from_depth(int depth)
+{
+    switch (depth) {
+    case 32:
+        return PIXMAN_a8r8g8b8;
+    case 24:
+        return PIXMAN_x8r8g8b8;
+    case 16:
+        return PIXMAN_r5g6b5;
+    case 15:
+        return PIXMAN_x1r5g5b5;
+    case 8:
+        return PIXMAN_a8;
+    case 1:
+        return PIXMAN_a1;
+    default:
+        return 0;
+    }
+}
+
+static uint32_t surface_format_from_depth(int depth)
+{
+    switch (depth) {
+    case 32:
+        return SPICE_SURFACE_FMT_32_ARGB;
+    case 24:
+        return SPICE_SURFACE_FMT_32_xRGB;
+    case 16:
+        return SPICE_SURFACE_FMT_16_565;
+    case 15:
+        return SPICE_SURFACE_FMT_16_555;
+    case 8:
+        return SPICE_SURFACE_FMT_8_A;
+    case 1:
+        return SPICE_SURFACE_FMT_1_A;
+    default:
+        return SPICE_SURFACE_FMT_INVALID;
+    }
+}
+
+/* Recording */
+
+static void trace_write(SpiceCanvasTrace *trace, const void *data, size_t size)
+{
+    if (trace->error || size == 0) {
+        return;
+    }
+    if (fwrite(data, 1, size, trace->file) != size) {
+        spice_warning("failed to write canvas trace, stopped recording");
+        trace->error = TRUE;
+    }
+}
+
+static void trace_write_tag(SpiceCanvasTrace *trace, uint8_t tag)
+{
+    trace_write(trace, &tag, sizeof(tag));
+}
+
+static void trace_write_ints(SpiceCanvasTrace *trace, const int32_t *values, int n)
+{
+    trace_write(trace, values, n * sizeof(int32_t));
+}
+
+static void trace_write_int(SpiceCanvasTrace *trace, int32_t value)
+{
+    trace_write_ints(trace, &value, 1);
+}
+
+static void trace_write_boxes(SpiceCanvasTrace *trace, const pixman_box32_t *boxes, int n)
+{
+    trace_write_int(trace, n);
+    trace_write(trace, boxes, n * sizeof(pixman_box32_t));
+}
+
+static TraceImage *trace_find_image(SpiceCanvasTrace *trace, uint64_t hash)
+{
+    uint32_t mask = trace->images_size - 1;
+    uint32_t i = hash & mask;
+
+    while (trace->images[i].hash != 0 && trace->images[i].hash != hash) {
+        i = (i + 1) & mask;
+    }
+    return &trace->images[i];
+}
+
+static void trace_grow_images(SpiceCanvasTrace *trace)
+{
+    TraceImage *old_images = trace->images;
+    uint32_t old_size = trace->images_size;
+    uint32_t i;
+
+    trace->images_size *= 2;
+    trace->images = spice_new0(TraceImage, trace->images_size);
+    for (i = 0; i < old_size; i++) {
+        if (old_images[i].hash != 0) {
+            *trace_find_image(trace, old_images[i].hash) = old_images[i];
+        }
+    }
+    free(old_images);
+}
+
+/* Writes the (x, y, width, height) area of image unless the same pixels
+   were already written, and returns the index to refer to them. format
+   overrides the one of image, to record an x8r8g8b8 surface that is used
+   as a8r8g8b8 */
+static uint32_t trace_add_image(SpiceCanvasTrace *trace, pixman_image_t *image,
+                                pixman_format_code_t format,
+                                int x, int y, int width, int height)
+{
+    int stride = pixman_image_get_stride(image);
+    int bpp = PIXMAN_FORMAT_BPP(format);
+    int row_bytes = (width * bpp + 7) / 8;
+    uint8_t *line;
+    TraceImage *entry;
+    uint64_t hash;
+    int32_t header[3];
+
+    line = (uint8_t *)pixman_image_get_data(image) + y * stride + x * bpp / 8;
+    hash = spice_pixman_hash_pixels(format, line, stride, width, height, bpp);
+    if (hash == 0) {
+        hash = 1;
+    }
+
+    entry = trace_find_image(trace, hash);
+    if (entry->hash != 0) {
+        return entry->index;
+    }
+    entry->hash = hash;
+    entry->index = trace->n_images++;
+
+    trace_write_tag(trace, TRACE_RECORD_IMAGE);
+    header[0] = format;
+    header[1] = width;
+    header[2] = height;
+    trace_write_ints(trace, header, 3);
+    for (; height > 0; height--, line += stride) {
+        trace_write(trace, line, row_bytes);
+    }
+
+    if (trace->n_images * 2 > trace->images_size) {
+        uint32_t index = entry->index;
+
+        trace_grow_images(trace);
+        return index;
+    }
+    return entry->index;
+}
+
+static uint32_t trace_add_whole_image(SpiceCanvasTrace *trace, pixman_image_t *image)
+{
+    return trace_add_image(trace, image,
+                           image_format_from_depth(pixman_image_get_depth(image)),
+                           0, 0, pixman_image_get_width(image),
+                           pixman_image_get_height(image));
+}
+
+static uint32_t trace_add_surface(SpiceCanvasTrace *trace, SpiceCanvas *surface,
+                                  int with_alpha)
+{
+    pixman_image_t *image = surface->ops->get_image(surface, FALSE);
+    int depth = pixman_image_get_depth(image);
+    uint32_t index;
+
+    index = trace_add_image(trace, image,
+                            image_format_from_depth(with_alpha && depth == 24 ? 32 : depth),
+                            0, 0, pixman_image_get_width(image),
+                            pixman_image_get_height(image));
+    pixman_image_unref(image);
+    return index;
+}
+
+static void trace_write_op(SpiceCanvasTrace *trace, SpiceCanvasTraceOp op,
+                           const pixman_box32_t *boxes, int n_boxes,
+                           const int32_t *args, int n_args)
+{
+    trace_write_tag(trace, op);
+    trace_write_boxes(trace, boxes, n_boxes);
+    trace_write_ints(trace, args, n_args);
+}
+
+static void trace_write_region_op(SpiceCanvasTrace *trace, SpiceCanvasTraceOp op,
+                                  pixman_region32_t *region,
+                                  const int32_t *args, int n_args)
+{
+    pixman_box32_t *boxes;
+    int n_boxes;
+
+    boxes = pixman_region32_rectangles(region, &n_boxes);
+    trace_write_op(trace, op, boxes, n_boxes, args, n_args);
+}
+
+/* Records the pixels of the canvas in the given area, for the ops that draw
+   without going through the implementation vfuncs */
+static void trace_put_pixels(SpiceCanvasTrace *trace, SpiceCanvas *canvas,
+                             int x1, int y1, int x2, int y2)
+{
+    pixman_image_t *image = trace->canvas_ops->get_image(canvas, FALSE);
+    pixman_box32_t box;
+
+    if (spice_pixman_image_get_bpp(image) < 8) {
+        /* only record whole bytes */
+        x1 = 0;
+        x2 = pixman_image_get_width(image);
+    }
+    box.x1 = MAX(x1, 0);
+    box.y1 = MAX(y1, 0);
+    box.x2 = MIN(x2, pixman_image_get_width(image));
+    box.y2 = MIN(y2, pixman_image_get_height(image));
+    if (box.x1 < box.x2 && box.y1 < box.y2) {
+        int32_t args[3];
+
+        args[0] = trace_add_image(trace, image,
+                                  image_format_from_depth(pixman_image_get_depth(image)),
+                                  box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+        args[1] = box.x1;
+        args[2] = box.y1;
+        trace_write_op(trace, SPICE_CANVAS_TRACE_OP_PUT_PIXELS, &box, 1, args, 3);
+    }
+    pixman_image_unref(image);
+}
+
+#define TRACE_FROM_CANVAS(canvas) ((SpiceCanvasTrace *)(canvas)->ops)
+
+static void trace_fill_solid_spans(SpiceCanvas *canvas, SpicePoint *points, int *widths,
+                                   int n_spans, uint32_t color)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int i;
+
+    trace_write_tag(trace, SPICE_CANVAS_TRACE_OP_FILL_SOLID_SPANS);
+    trace_write_int(trace, n_spans);
+    for (i = 0; i < n_spans; i++) {
+        int32_t span[3] = { points[i].x, points[i].y, widths[i] };
+
+        trace_write_ints(trace, span, 3);
+    }
+    trace_write_int(trace, color);
+    trace->canvas_ops->fill_solid_spans(canvas, points, widths, n_spans, color);
+}
+
+static void trace_fill_solid_rects(SpiceCanvas *canvas, pixman_box32_t *rects, int n_rects,
+                                   uint32_t color)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[1] = { color };
+
+    trace_write_op(trace, SPICE_CANVAS_TRACE_OP_FILL_SOLID_RECTS, rects, n_rects, args, 1);
+    trace->canvas_ops->fill_solid_rects(canvas, rects, n_rects, color);
+}
+
+static void trace_fill_solid_rects_rop(SpiceCanvas *canvas, pixman_box32_t *rects, int n_rects,
+                                       uint32_t color, SpiceROP rop)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[2] = { color, rop };
+
+    trace_write_op(trace, SPICE_CANVAS_TRACE_OP_FILL_SOLID_RECTS_ROP, rects, n_rects, args, 2);
+    trace->canvas_ops->fill_solid_rects_rop(canvas, rects, n_rects, color, rop);
+}
+
+static void trace_fill_tiled_rects(SpiceCanvas *canvas, pixman_box32_t *rects, int n_rects,
+                                   pixman_image_t *tile, int offset_x, int offset_y)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[3] = { trace_add_whole_image(trace, tile), offset_x, offset_y };
+
+    trace_write_op(trace, SPICE_CANVAS_TRACE_OP_FILL_TILED_RECTS, rects, n_rects, args, 3);
+    trace->canvas_ops->fill_tiled_rects(canvas, rects, n_rects, tile, offset_x, offset_y);
+}
+
+static void trace_fill_tiled_rects_from_surface(SpiceCanvas *canvas, pixman_box32_t *rects,
+                                                int n_rects, SpiceCanvas *tile,
+                                                int offset_x, int offset_y)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[3] = { trace_add_surface(trace, tile, FALSE), offset_x, offset_y };
+
+    trace_write_op(trace, SPICE_CANVAS_TRACE_OP_FILL_TILED_RECTS, rects, n_rects, args, 3);
+    trace->canvas_ops->fill_tiled_rects_from_surface(canvas, rects, n_rects, tile,
+                                                     offset_x, offset_y);
+}
+
+static void trace_fill_tiled_rects_rop(SpiceCanvas *canvas, pixman_box32_t *rects, int n_rects,
+                                       pixman_image_t *tile, int offset_x, int offset_y,
+                                       SpiceROP rop)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[4] = { trace_add_whole_image(trace, tile), offset_x, offset_y, rop };
+
+    trace_write_op(trace, SPICE_CANVAS_TRACE_OP_FILL_TILED_RECTS_ROP, rects, n_rects, args, 4);
+    trace->canvas_ops->fill_tiled_rects_rop(canvas, rects, n_rects, tile, offset_x, offset_y,
+                                            rop);
+}
+
+static void trace_fill_tiled_rects_rop_from_surface(SpiceCanvas *canvas, pixman_box32_t *rects,
+                                                    int n_rects, SpiceCanvas *tile,
+                                                    int offset_x, int offset_y, SpiceROP rop)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[4] = { trace_add_surface(trace, tile, FALSE), offset_x, offset_y, rop };
+
+    trace_write_op(trace, SPICE_CANVAS_TRACE_OP_FILL_TILED_RECTS_ROP, rects, n_rects, args, 4);
+    trace->canvas_ops->fill_tiled_rects_rop_from_surface(canvas, rects, n_rects, tile,
+                                                         offset_x, offset_y, rop);
+}
+
+static void trace_blit_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                             pixman_image_t *src_image, int offset_x, int offset_y)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[3] = { trace_add_whole_image(trace, src_image), offset_x, offset_y };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_BLIT_IMAGE, region, args, 3);
+    trace->canvas_ops->blit_image(canvas, region, src_image, offset_x, offset_y);
+}
+
+static void trace_blit_image_from_surface(SpiceCanvas *canvas, pixman_region32_t *region,
+                                          SpiceCanvas *src_image, int offset_x, int offset_y)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[3] = { trace_add_surface(trace, src_image, FALSE), offset_x, offset_y };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_BLIT_IMAGE, region, args, 3);
+    trace->canvas_ops->blit_image_from_surface(canvas, region, src_image, offset_x, offset_y);
+}
+
+static void trace_blit_image_rop(SpiceCanvas *canvas, pixman_region32_t *region,
+                                 pixman_image_t *src_image, int offset_x, int offset_y,
+                                 SpiceROP rop)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[4] = { trace_add_whole_image(trace, src_image), offset_x, offset_y, rop };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_BLIT_IMAGE_ROP, region, args, 4);
+    trace->canvas_ops->blit_image_rop(canvas, region, src_image, offset_x, offset_y, rop);
+}
+
+static void trace_blit_image_rop_from_surface(SpiceCanvas *canvas, pixman_region32_t *region,
+                                              SpiceCanvas *src_image, int offset_x, int offset_y,
+                                              SpiceROP rop)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[4] = { trace_add_surface(trace, src_image, FALSE), offset_x, offset_y, rop };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_BLIT_IMAGE_ROP, region, args, 4);
+    trace->canvas_ops->blit_image_rop_from_surface(canvas, region, src_image,
+                                                   offset_x, offset_y, rop);
+}
+
+static void trace_scale_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                              pixman_image_t *src_image,
+                              int src_x, int src_y, int src_width, int src_height,
+                              int dest_x, int dest_y, int dest_width, int dest_height,
+                              int scale_mode)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[10] = { trace_add_whole_image(trace, src_image),
+                         src_x, src_y, src_width, src_height,
+                         dest_x, dest_y, dest_width, dest_height, scale_mode };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_SCALE_IMAGE, region, args, 10);
+    trace->canvas_ops->scale_image(canvas, region, src_image,
+                                   src_x, src_y, src_width, src_height,
+                                   dest_x, dest_y, dest_width, dest_height, scale_mode);
+}
+
+static void trace_scale_image_from_surface(SpiceCanvas *canvas, pixman_region32_t *region,
+                                           SpiceCanvas *src_image,
+                                           int src_x, int src_y, int src_width, int src_height,
+                                           int dest_x, int dest_y,
+                                           int dest_width, int dest_height,
+                                           int scale_mode)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[10] = { trace_add_surface(trace, src_image, FALSE),
+                         src_x, src_y, src_width, src_height,
+                         dest_x, dest_y, dest_width, dest_height, scale_mode };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_SCALE_IMAGE, region, args, 10);
+    trace->canvas_ops->scale_image_from_surface(canvas, region, src_image,
+                                                src_x, src_y, src_width, src_height,
+                                                dest_x, dest_y, dest_width, dest_height,
+                                                scale_mode);
+}
+
+static void trace_scale_image_rop(SpiceCanvas *canvas, pixman_region32_t *region,
+                                  pixman_image_t *src_image,
+                                  int src_x, int src_y, int src_width, int src_height,
+                                  int dest_x, int dest_y, int dest_width, int dest_height,
+                                  int scale_mode, SpiceROP rop)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[11] = { trace_add_whole_image(trace, src_image),
+                         src_x, src_y, src_width, src_height,
+                         dest_x, dest_y, dest_width, dest_height, scale_mode, rop };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_SCALE_IMAGE_ROP, region, args, 11);
+    trace->canvas_ops->scale_image_rop(canvas, region, src_image,
+                                       src_x, src_y, src_width, src_height,
+                                       dest_x, dest_y, dest_width, dest_height,
+                                       scale_mode, rop);
+}
+
+static void trace_scale_image_rop_from_surface(SpiceCanvas *canvas, pixman_region32_t *region,
+                                               SpiceCanvas *src_image,
+                                               int src_x, int src_y,
+                                               int src_width, int src_height,
+                                               int dest_x, int dest_y,
+                                               int dest_width, int dest_height,
+                                               int scale_mode, SpiceROP rop)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[11] = { trace_add_surface(trace, src_image, FALSE),
+                         src_x, src_y, src_width, src_height,
+                         dest_x, dest_y, dest_width, dest_height, scale_mode, rop };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_SCALE_IMAGE_ROP, region, args, 11);
+    trace->canvas_ops->scale_image_rop_from_surface(canvas, region, src_image,
+                                                    src_x, src_y, src_width, src_height,
+                                                    dest_x, dest_y, dest_width, dest_height,
+                                                    scale_mode, rop);
+}
+
+static void trace_blend_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                              int dest_has_alpha, pixman_image_t *src_image,
+                              int src_x, int src_y, int dest_x, int dest_y,
+                              int width, int height, int overall_alpha)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[9] = { dest_has_alpha, trace_add_whole_image(trace, src_image),
+                        src_x, src_y, dest_x, dest_y, width, height, overall_alpha };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_BLEND_IMAGE, region, args, 9);
+    trace->canvas_ops->blend_image(canvas, region, dest_has_alpha, src_image,
+                                   src_x, src_y, dest_x, dest_y, width, height,
+                                   overall_alpha);
+}
+
+static void trace_blend_image_from_surface(SpiceCanvas *canvas, pixman_region32_t *region,
+                                           int dest_has_alpha, SpiceCanvas *src_image,
+                                           int src_has_alpha,
+                                           int src_x, int src_y, int dest_x, int dest_y,
+                                           int width, int height, int overall_alpha)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[9] = { dest_has_alpha, trace_add_surface(trace, src_image, src_has_alpha),
+                        src_x, src_y, dest_x, dest_y, width, height, overall_alpha };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_BLEND_IMAGE, region, args, 9);
+    trace->canvas_ops->blend_image_from_surface(canvas, region, dest_has_alpha,
+                                                src_image, src_has_alpha,
+                                                src_x, src_y, dest_x, dest_y,
+                                                width, height, overall_alpha);
+}
+
+static void trace_blend_scale_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                                    int dest_has_alpha, pixman_image_t *src_image,
+                                    int src_x, int src_y, int src_width, int src_height,
+                                    int dest_x, int dest_y, int dest_width, int dest_height,
+                                    int scale_mode, int overall_alpha)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[12] = { dest_has_alpha, trace_add_whole_image(trace, src_image),
+                         src_x, src_y, src_width, src_height,
+                         dest_x, dest_y, dest_width, dest_height,
+                         scale_mode, overall_alpha };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_BLEND_SCALE_IMAGE, region, args, 12);
+    trace->canvas_ops->blend_scale_image(canvas, region, dest_has_alpha, src_image,
+                                         src_x, src_y, src_width, src_height,
+                                         dest_x, dest_y, dest_width, dest_height,
+                                         scale_mode, overall_alpha);
+}
+
+static void trace_blend_scale_image_from_surface(SpiceCanvas *canvas,
+                                                 pixman_region32_t *region,
+                                                 int dest_has_alpha, SpiceCanvas *src_image,
+                                                 int src_has_alpha,
+                                                 int src_x, int src_y,
+                                                 int src_width, int src_height,
+                                                 int dest_x, int dest_y,
+                                                 int dest_width, int dest_height,
+                                                 int scale_mode, int overall_alpha)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[12] = { dest_has_alpha, trace_add_surface(trace, src_image, src_has_alpha),
+                         src_x, src_y, src_width, src_height,
+                         dest_x, dest_y, dest_width, dest_height,
+                         scale_mode, overall_alpha };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_BLEND_SCALE_IMAGE, region, args, 12);
+    trace->canvas_ops->blend_scale_image_from_surface(canvas, region, dest_has_alpha,
+                                                      src_image, src_has_alpha,
+                                                      src_x, src_y, src_width, src_height,
+                                                      dest_x, dest_y,
+                                                      dest_width, dest_height,
+                                                      scale_mode, overall_alpha);
+}
+
+static void trace_colorkey_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                                 pixman_image_t *src_image, int offset_x, int offset_y,
+                                 uint32_t transparent_color)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[4] = { trace_add_whole_image(trace, src_image), offset_x, offset_y,
+                        transparent_color };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_COLORKEY_IMAGE, region, args, 4);
+    trace->canvas_ops->colorkey_image(canvas, region, src_image, offset_x, offset_y,
+                                      transparent_color);
+}
+
+static void trace_colorkey_image_from_surface(SpiceCanvas *canvas, pixman_region32_t *region,
+                                              SpiceCanvas *src_image,
+                                              int offset_x, int offset_y,
+                                              uint32_t transparent_color)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[4] = { trace_add_surface(trace, src_image, FALSE), offset_x, offset_y,
+                        transparent_color };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_COLORKEY_IMAGE, region, args, 4);
+    trace->canvas_ops->colorkey_image_from_surface(canvas, region, src_image,
+                                                   offset_x, offset_y, transparent_color);
+}
+
+static void trace_colorkey_scale_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                                       pixman_image_t *src_image,
+                                       int src_x, int src_y, int src_width, int src_height,
+                                       int dest_x, int dest_y,
+                                       int dest_width, int dest_height,
+                                       uint32_t transparent_color)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[10] = { trace_add_whole_image(trace, src_image),
+                         src_x, src_y, src_width, src_height,
+                         dest_x, dest_y, dest_width, dest_height, transparent_color };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_COLORKEY_SCALE_IMAGE, region, args, 10);
+    trace->canvas_ops->colorkey_scale_image(canvas, region, src_image,
+                                            src_x, src_y, src_width, src_height,
+                                            dest_x, dest_y, dest_width, dest_height,
+                                            transparent_color);
+}
+
+static void trace_colorkey_scale_image_from_surface(SpiceCanvas *canvas,
+                                                    pixman_region32_t *region,
+                                                    SpiceCanvas *src_image,
+                                                    int src_x, int src_y,
+                                                    int src_width, int src_height,
+                                                    int dest_x, int dest_y,
+                                                    int dest_width, int dest_height,
+                                                    uint32_t transparent_color)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[10] = { trace_add_surface(trace, src_image, FALSE),
+                         src_x, src_y, src_width, src_height,
+                         dest_x, dest_y, dest_width, dest_height, transparent_color };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_COLORKEY_SCALE_IMAGE, region, args, 10);
+    trace->canvas_ops->colorkey_scale_image_from_surface(canvas, region, src_image,
+                                                         src_x, src_y, src_width, src_height,
+                                                         dest_x, dest_y,
+                                                         dest_width, dest_height,
+                                                         transparent_color);
+}
+
+static void trace_copy_region(SpiceCanvas *canvas, pixman_region32_t *dest_region,
+                              int dx, int dy)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    int32_t args[2] = { dx, dy };
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_COPY_REGION, dest_region, args, 2);
+    trace->canvas_ops->copy_region(canvas, dest_region, dx, dy);
+}
+
+static void trace_put_image(SpiceCanvas *canvas,
+#ifdef WIN32
+                            HDC dc,
+#endif
+                            const SpiceRect *dest, const uint8_t *src_data,
+                            uint32_t src_width, uint32_t src_height, int src_stride,
+                            const QRegion *clip)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+    pixman_image_t *src;
+    int32_t args[6];
+
+    src = pixman_image_create_bits(PIXMAN_x8r8g8b8, src_width, src_height,
+                                   (uint32_t *)src_data, src_stride);
+    args[0] = trace_add_whole_image(trace, src);
+    args[1] = dest->left;
+    args[2] = dest->top;
+    args[3] = dest->right;
+    args[4] = dest->bottom;
+    args[5] = clip != NULL;
+    pixman_image_unref(src);
+    if (clip) {
+        trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_PUT_IMAGE, (QRegion *)clip, args, 6);
+    } else {
+        trace_write_op(trace, SPICE_CANVAS_TRACE_OP_PUT_IMAGE, NULL, 0, args, 6);
+    }
+    trace->canvas_ops->put_image(canvas,
+#ifdef WIN32
+                                 dc,
+#endif
+                                 dest, src_data, src_width, src_height, src_stride, clip);
+}
+
+static void trace_put_yuv_image(SpiceCanvas *canvas, const SpiceRect *dest,
+                                SpiceYUVFormat format,
+                                const uint8_t *planes[3], const int strides[3],
+                                uint32_t src_width, uint32_t src_height,
+                                const QRegion *clip)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+
+    trace->canvas_ops->put_yuv_image(canvas, dest, format, planes, strides,
+                                     src_width, src_height, clip);
+    trace_put_pixels(trace, canvas, dest->left, dest->top, dest->right, dest->bottom);
+}
+
+static void trace_draw_text(SpiceCanvas *canvas, SpiceRect *bbox, SpiceClip *clip,
+                            SpiceText *text)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+
+    trace->canvas_ops->draw_text(canvas, bbox, clip, text);
+    trace_put_pixels(trace, canvas, bbox->left, bbox->top, bbox->right, bbox->bottom);
+}
+
+static void trace_clear(SpiceCanvas *canvas)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+
+    trace_write_op(trace, SPICE_CANVAS_TRACE_OP_CLEAR, NULL, 0, NULL, 0);
+    trace->canvas_ops->clear(canvas);
+}
+
+static void trace_group_start(SpiceCanvas *canvas, QRegion *region)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+
+    trace_write_region_op(trace, SPICE_CANVAS_TRACE_OP_GROUP_START, region, NULL, 0);
+    trace->canvas_ops->group_start(canvas, region);
+}
+
+static void trace_group_end(SpiceCanvas *canvas)
+{
+    SpiceCanvasTrace *trace = TRACE_FROM_CANVAS(canvas);
+
+    trace_write_op(trace, SPICE_CANVAS_TRACE_OP_GROUP_END, NULL, 0, NULL, 0);
+    trace->canvas_ops->group_end(canvas);
+}
+
+static void trace_destroy(SpiceCanvas *canvas)
+{
+    spice_canvas_trace_stop(TRACE_FROM_CANVAS(canvas));
+    canvas->ops->destroy(canvas);
+}
+
+SpiceCanvasTrace *spice_canvas_trace_start(SpiceCanvas *canvas, FILE *file)
+{
+    SpiceCanvasTrace *trace;
+    pixman_image_t *image;
+    uint32_t header[5];
+
+    spice_return_val_if_fail(canvas != NULL && file != NULL, NULL);
+
+    image = canvas->ops->get_image(canvas, FALSE);
+    header[0] = TRACE_MAGIC;
+    header[1] = TRACE_VERSION;
+    header[2] = pixman_image_get_width(image);
+    header[3] = pixman_image_get_height(image);
+    header[4] = surface_format_from_depth(pixman_image_get_depth(image));
+    pixman_image_unref(image);
+    spice_return_val_if_fail(header[4] != SPICE_SURFACE_FMT_INVALID, NULL);
+
+    trace = spice_new0(SpiceCanvasTrace, 1);
+    trace->canvas = canvas;
+    trace->canvas_ops = canvas->ops;
+    trace->file = file;
+    trace->images_size = 64;
+    trace->images = spice_new0(TraceImage, trace->images_size);
+    trace_write(trace, header, sizeof(header));
+
+    trace->ops = *canvas->ops;
+    trace->ops.fill_solid_spans = trace_fill_solid_spans;
+    trace->ops.fill_solid_rects = trace_fill_solid_rects;
+    trace->ops.fill_solid_rects_rop = trace_fill_solid_rects_rop;
+    trace->ops.fill_tiled_rects = trace_fill_tiled_rects;
+    trace->ops.fill_tiled_rects_from_surface = trace_fill_tiled_rects_from_surface;
+    trace->ops.fill_tiled_rects_rop = trace_fill_tiled_rects_rop;
+    trace->ops.fill_tiled_rects_rop_from_surface = trace_fill_tiled_rects_rop_from_surface;
+    trace->ops.blit_image = trace_blit_image;
+    trace->ops.blit_image_from_surface = trace_blit_image_from_surface;
+    trace->ops.blit_image_rop = trace_blit_image_rop;
+    trace->ops.blit_image_rop_from_surface = trace_blit_image_rop_from_surface;
+    trace->ops.scale_image = trace_scale_image;
+    trace->ops.scale_image_from_surface = trace_scale_image_from_surface;
+    trace->ops.scale_image_rop = trace_scale_image_rop;
+    trace->ops.scale_image_rop_from_surface = trace_scale_image_rop_from_surface;
+    trace->ops.blend_image = trace_blend_image;
+    trace->ops.blend_image_from_surface = trace_blend_image_from_surface;
+    trace->ops.blend_scale_image = trace_blend_scale_image;
+    trace->ops.blend_scale_image_from_surface = trace_blend_scale_image_from_surface;
+    trace->ops.colorkey_image = trace_colorkey_image;
+    trace->ops.colorkey_image_from_surface = trace_colorkey_image_from_surface;
+    trace->ops.colorkey_scale_image = trace_colorkey_scale_image;
+    trace->ops.colorkey_scale_image_from_surface = trace_colorkey_scale_image_from_surface;
+    trace->ops.copy_region = trace_copy_region;
+    trace->ops.put_image = trace_put_image;
+    trace->ops.draw_text = trace_draw_text;
+    trace->ops.clear = trace_clear;
+    trace->ops.group_start = trace_group_start;
+    trace->ops.group_end = trace_group_end;
+    trace->ops.destroy = trace_destroy;
+    trace->ops.put_yuv_image = trace_put_yuv_image;
+    canvas->ops = &trace->ops;
+
+    return trace;
+}
+
+void spice_canvas_trace_stop(SpiceCanvasTrace *trace)
+{
+    if (!trace) {
+        return;
+    }
+    trace->canvas->ops = trace->canvas_ops;
+    if (!trace->error && fflush(trace->file) != 0) {
+        spice_warning("failed to write canvas trace");
+    }
+    free(trace->images);
+    free(trace);
+}
+
+/* Replaying */
+
+typedef struct TraceReader {
+    FILE *file;
+    pixman_image_t **images;
+    uint32_t n_images;
+    uint32_t images_size;
+    pixman_box32_t *boxes;
+    int boxes_size;
+    int n_boxes;
+    SpiceCanvasTraceStats *stats;
+} TraceReader;
+
+static int read_data(TraceReader *reader, void *data, size_t size)
+{
+    return fread(data, 1, size, reader->file) == size;
+}
+
+static int read_ints(TraceReader *reader, int32_t *values, int n)
+{
+    return read_data(reader, values, n * sizeof(int32_t));
+}
+
+static int read_boxes(TraceReader *reader)
+{
+    int32_t n;
+
+    if (!read_ints(reader, &n, 1) || n < 0 || n > TRACE_MAX_BOXES) {
+        return FALSE;
+    }
+    if (n > reader->boxes_size) {
+        free(reader->boxes);
+        reader->boxes_size = MAX(n, reader->boxes_size * 2);
+        reader->boxes = spice_new(pixman_box32_t, reader->boxes_size);
+    }
+    reader->n_boxes = n;
+    return read_data(reader, reader->boxes, n * sizeof(pixman_box32_t));
+}
+
+static int read_region(TraceReader *reader, pixman_region32_t *region)
+{
+    if (!read_boxes(reader)) {
+        return FALSE;
+    }
+    return pixman_region32_init_rects(region, reader->boxes, reader->n_boxes);
+}
+
+static int read_image(TraceReader *reader)
+{
+    int32_t header[3];
+    pixman_image_t *image;
+    uint8_t *line;
+    int stride, row_bytes, y;
+
+    if (!read_ints(reader, header, 3)) {
+        return FALSE;
+    }
+    switch (header[0]) {
+    case PIXMAN_a8r8g8b8:
+    case PIXMAN_x8r8g8b8:
+    case PIXMAN_r5g6b5:
+    case PIXMAN_x1r5g5b5:
+    case PIXMAN_a8:
+    case PIXMAN_a1:
+        break;
+    default:
+        return FALSE;
+    }
+    if (header[1] <= 0 || header[1] > TRACE_MAX_IMAGE_SIZE ||
+        header[2] <= 0 || header[2] > TRACE_MAX_IMAGE_SIZE ||
+        (uint64_t)header[1] * header[2] > TRACE_MAX_IMAGE_PIXELS) {
+        return FALSE;
+    }
+
+#ifdef WIN32
+    image = surface_create(NULL, header[0], header[1], header[2], TRUE);
+#else
+    image = surface_create(header[0], header[1], header[2], TRUE);
+#endif
+    if (image == NULL) {
+        return FALSE;
+    }
+    line = (uint8_t *)pixman_image_get_data(image);
+    stride = pixman_image_get_stride(image);
+    row_bytes = (header[1] * PIXMAN_FORMAT_BPP(header[0]) + 7) / 8;
+    for (y = 0; y < header[2]; y++, line += stride) {
+        if (!read_data(reader, line, row_bytes)) {
+            pixman_image_unref(image);
+            return FALSE;
+        }
+    }
+
+    if (reader->n_images == reader->images_size) {
+        reader->images_size = MAX(64, reader->images_size * 2);
+        reader->images = spice_renew(pixman_image_t *, reader->images, reader->images_size);
+    }
+    reader->images[reader->n_images++] = image;
+    reader->stats->n_images++;
+    reader->stats->image_bytes += (uint64_t)row_bytes * header[2];
+    return TRUE;
+}
+
+static pixman_image_t *get_image(TraceReader *reader, int32_t index)
+{
+    if (index < 0 || (uint32_t)index >= reader->n_images) {
+        return NULL;
+    }
+    return reader->images[index];
+}
+
+/* Number of ints after the boxes or region of each op */
+static const int op_n_args[SPICE_CANVAS_TRACE_N_OPS] = {
+    [SPICE_CANVAS_TRACE_OP_FILL_SOLID_RECTS] = 1,
+    [SPICE_CANVAS_TRACE_OP_FILL_SOLID_RECTS_ROP] = 2,
+    [SPICE_CANVAS_TRACE_OP_FILL_TILED_RECTS] = 3,
+    [SPICE_CANVAS_TRACE_OP_FILL_TILED_RECTS_ROP] = 4,
+    [SPICE_CANVAS_TRACE_OP_BLIT_IMAGE] = 3,
+    [SPICE_CANVAS_TRACE_OP_BLIT_IMAGE_ROP] = 4,
+    [SPICE_CANVAS_TRACE_OP_SCALE_IMAGE] = 10,
+    [SPICE_CANVAS_TRACE_OP_SCALE_IMAGE_ROP] = 11,
+    [SPICE_CANVAS_TRACE_OP_BLEND_IMAGE] = 9,
+    [SPICE_CANVAS_TRACE_OP_BLEND_SCALE_IMAGE] = 12,
+    [SPICE_CANVAS_TRACE_OP_COLORKEY_IMAGE] = 4,
+    [SPICE_CANVAS_TRACE_OP_COLORKEY_SCALE_IMAGE] = 10,
+    [SPICE_CANVAS_TRACE_OP_COPY_REGION] = 2,
+    [SPICE_CANVAS_TRACE_OP_PUT_IMAGE] = 6,
+    [SPICE_CANVAS_TRACE_OP_PUT_PIXELS] = 3,
+};
+
+/* Only the ops that take a pixman_region32_t; the fills take an array of
+   rects and the others ignore the boxes */
+static const int op_has_region[SPICE_CANVAS_TRACE_N_OPS] = {
+    [SPICE_CANVAS_TRACE_OP_BLIT_IMAGE] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_BLIT_IMAGE_ROP] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_SCALE_IMAGE] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_SCALE_IMAGE_ROP] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_BLEND_IMAGE] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_BLEND_SCALE_IMAGE] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_COLORKEY_IMAGE] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_COLORKEY_SCALE_IMAGE] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_COPY_REGION] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_PUT_IMAGE] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_PUT_PIXELS] = TRUE,
+    [SPICE_CANVAS_TRACE_OP_GROUP_START] = TRUE,
+};
+
+/* An op read from the trace, ready to be drawn */
+typedef struct TraceOp {
+    SpiceCanvasTraceOp op;
+    pixman_region32_t region;
+    int32_t args[12];
+    pixman_image_t *image;
+    SpicePoint *points;
+    int *widths;
+    int n_spans;
+} TraceOp;
+
+static int read_spans(TraceReader *reader, TraceOp *op)
+{
+    int32_t n, span[3];
+    int i;
+
+    if (!read_ints(reader, &n, 1) || n < 0 || n > TRACE_MAX_BOXES) {
+        return FALSE;
+    }
+    op->points = spice_new(SpicePoint, MAX(n, 1));
+    op->widths = spice_new(int, MAX(n, 1));
+    op->n_spans = n;
+    for (i = 0; i < n; i++) {
+        if (!read_ints(reader, span, 3)) {
+            return FALSE;
+        }
+        op->points[i].x = span[0];
+        op->points[i].y = span[1];
+        op->widths[i] = span[2];
+    }
+    return read_ints(reader, op->args, 1);
+}
+
+/* Reads the arguments of op, they are released by free_op() even on failure */
+static int read_op(TraceReader *reader, TraceOp *op)
+{
+    if (op->op == SPICE_CANVAS_TRACE_OP_FILL_SOLID_SPANS) {
+        return read_spans(reader, op);
+    }
+
+    if (op_has_region[op->op]) {
+        pixman_region32_init(&op->region);
+        if (!read_region(reader, &op->region)) {
+            return FALSE;
+        }
+    } else if (!read_boxes(reader)) {
+        return FALSE;
+    }
+    if (!read_ints(reader, op->args, op_n_args[op->op])) {
+        return FALSE;
+    }
+
+    switch (op->op) {
+    case SPICE_CANVAS_TRACE_OP_FILL_SOLID_RECTS:
+    case SPICE_CANVAS_TRACE_OP_FILL_SOLID_RECTS_ROP:
+    case SPICE_CANVAS_TRACE_OP_COPY_REGION:
+    case SPICE_CANVAS_TRACE_OP_CLEAR:
+    case SPICE_CANVAS_TRACE_OP_GROUP_START:
+    case SPICE_CANVAS_TRACE_OP_GROUP_END:
+        return TRUE;
+    case SPICE_CANVAS_TRACE_OP_BLEND_IMAGE:
+    case SPICE_CANVAS_TRACE_OP_BLEND_SCALE_IMAGE:
+        op->image = get_image(reader, op->args[1]);
+        return op->image != NULL;
+    case SPICE_CANVAS_TRACE_OP_PUT_IMAGE:
+        op->image = get_image(reader, op->args[0]);
+        return op->image != NULL && (pixman_image_get_depth(op->image) == 24 ||
+                                     pixman_image_get_depth(op->image) == 32);
+    default:
+        op->image = get_image(reader, op->args[0]);
+        return op->image != NULL;
+    }
+}
+
+static void draw_op(TraceReader *reader, SpiceCanvas *canvas, TraceOp *op)
+{
+    int32_t *args = op->args;
+    pixman_image_t *image = op->image;
+
+    switch (op->op) {
+    case SPICE_CANVAS_TRACE_OP_FILL_SOLID_SPANS:
+        canvas->ops->fill_solid_spans(canvas, op->points, op->widths, op->n_spans, args[0]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_FILL_SOLID_RECTS:
+        canvas->ops->fill_solid_rects(canvas, reader->boxes, reader->n_boxes, args[0]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_FILL_SOLID_RECTS_ROP:
+        canvas->ops->fill_solid_rects_rop(canvas, reader->boxes, reader->n_boxes,
+                                          args[0], args[1]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_FILL_TILED_RECTS:
+        canvas->ops->fill_tiled_rects(canvas, reader->boxes, reader->n_boxes, image,
+                                      args[1], args[2]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_FILL_TILED_RECTS_ROP:
+        canvas->ops->fill_tiled_rects_rop(canvas, reader->boxes, reader->n_boxes, image,
+                                          args[1], args[2], args[3]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_BLIT_IMAGE:
+    case SPICE_CANVAS_TRACE_OP_PUT_PIXELS:
+        canvas->ops->blit_image(canvas, &op->region, image, args[1], args[2]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_BLIT_IMAGE_ROP:
+        canvas->ops->blit_image_rop(canvas, &op->region, image, args[1], args[2], args[3]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_SCALE_IMAGE:
+        canvas->ops->scale_image(canvas, &op->region, image,
+                                 args[1], args[2], args[3], args[4],
+                                 args[5], args[6], args[7], args[8], args[9]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_SCALE_IMAGE_ROP:
+        canvas->ops->scale_image_rop(canvas, &op->region, image,
+                                     args[1], args[2], args[3], args[4],
+                                     args[5], args[6], args[7], args[8], args[9], args[10]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_BLEND_IMAGE:
+        canvas->ops->blend_image(canvas, &op->region, args[0], image,
+                                 args[2], args[3], args[4], args[5], args[6], args[7],
+                                 args[8]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_BLEND_SCALE_IMAGE:
+        canvas->ops->blend_scale_image(canvas, &op->region, args[0], image,
+                                       args[2], args[3], args[4], args[5],
+                                       args[6], args[7], args[8], args[9],
+                                       args[10], args[11]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_COLORKEY_IMAGE:
+        canvas->ops->colorkey_image(canvas, &op->region, image, args[1], args[2], args[3]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_COLORKEY_SCALE_IMAGE:
+        canvas->ops->colorkey_scale_image(canvas, &op->region, image,
+                                          args[1], args[2], args[3], args[4],
+                                          args[5], args[6], args[7], args[8], args[9]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_COPY_REGION:
+        canvas->ops->copy_region(canvas, &op->region, args[0], args[1]);
+        break;
+    case SPICE_CANVAS_TRACE_OP_PUT_IMAGE: {
+        SpiceRect dest;
+
+        dest.left = args[1];
+        dest.top = args[2];
+        dest.right = args[3];
+        dest.bottom = args[4];
+        canvas->ops->put_image(canvas,
+#ifdef WIN32
+                               NULL,
+#endif
+                               &dest, (uint8_t *)pixman_image_get_data(image),
+                               pixman_image_get_width(image),
+                               pixman_image_get_height(image),
+                               pixman_image_get_stride(image),
+                               args[5] ? &op->region : NULL);
+        break;
+    }
+    case SPICE_CANVAS_TRACE_OP_CLEAR:
+        canvas->ops->clear(canvas);
+        break;
+    case SPICE_CANVAS_TRACE_OP_GROUP_START:
+        canvas->ops->group_start(canvas, &op->region);
+        break;
+    case SPICE_CANVAS_TRACE_OP_GROUP_END:
+        canvas->ops->group_end(canvas);
+        break;
+    default:
+        break;
+    }
+}
+
+static void free_op(TraceOp *op)
+{
+    if (op_has_region[op->op]) {
+        pixman_region32_fini(&op->region);
+    }
+    free(op->points);
+    free(op->widths);
+}
+
+int spice_canvas_trace_read_header(FILE *file, int *width, int *height, uint32_t *format)
+{
+    uint32_t header[5];
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        header[0] != TRACE_MAGIC || header[1] != TRACE_VERSION ||
+        header[2] == 0 || header[2] > TRACE_MAX_IMAGE_SIZE ||
+        header[3] == 0 || header[3] > TRACE_MAX_IMAGE_SIZE) {
+        return FALSE;
+    }
+    *width = header[2];
+    *height = header[3];
+    *format = header[4];
+    return TRUE;
+}
+
+int spice_canvas_trace_replay(FILE *file, SpiceCanvas *canvas, SpiceCanvasTraceStats *stats)
+{
+    TraceReader reader;
+    int ret = TRUE;
+    uint32_t i;
+    uint8_t tag;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&reader, 0, sizeof(reader));
+    reader.file = file;
+    reader.stats = stats;
+
+    while (ret && fread(&tag, 1, 1, file) == 1) {
+        TraceOp op;
+        uint64_t start;
+
+        if (tag == TRACE_RECORD_IMAGE) {
+            ret = read_image(&reader);
+            continue;
+        }
+        if (tag >= SPICE_CANVAS_TRACE_N_OPS) {
+            ret = FALSE;
+            break;
+        }
+        memset(&op, 0, sizeof(op));
+        op.op = tag;
+        ret = read_op(&reader, &op);
+        if (ret) {
+            /* only the drawing is timed, not reading the trace */
+            start = spice_message_stats_now();
+            draw_op(&reader, canvas, &op);
+            stats->ops[tag].time_ns += spice_message_stats_now() - start;
+            stats->ops[tag].count++;
+        }
+        free_op(&op);
+    }
+    if (ferror(file)) {
+        ret = FALSE;
+    }
+
+    for (i = 0; i < reader.n_images; i++) {
+        pixman_image_unref(reader.images[i]);
+    }
+    free(reader.images);
+    free(reader.boxes);
+    return ret;
+}
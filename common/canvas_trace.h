@@ -0,0 +1,105 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_CANVAS_TRACE
+#define _H_CANVAS_TRACE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <spice/macros.h>
+
+#include "canvas_base.h"
+
+SPICE_BEGIN_DECLS
+
+/* Recording of the drawing done on a canvas, to replay it offline.
+
+   The recorder hooks the ops of the canvas and writes the implementation
+   vfuncs (fill_solid_rects, blit_image, ...) that canvas_base.c turns every
+   draw command into, so images are stored decoded and replaying doesn't need
+   the caches, surfaces or decoders of the recording side. Images are stored
+   once per content, identified by a hash of their pixels.
+   _from_surface calls are recorded with a copy of the source surface, and
+   the ops drawing without the vfuncs (draw_text, put_yuv_image) with the
+   pixels they produced.
+
+   The file is written in host byte order and is only read back on a host of
+   the same endianness. */
+
+typedef enum {
+    SPICE_CANVAS_TRACE_OP_FILL_SOLID_SPANS,
+    SPICE_CANVAS_TRACE_OP_FILL_SOLID_RECTS,
+    SPICE_CANVAS_TRACE_OP_FILL_SOLID_RECTS_ROP,
+    SPICE_CANVAS_TRACE_OP_FILL_TILED_RECTS,
+    SPICE_CANVAS_TRACE_OP_FILL_TILED_RECTS_ROP,
+    SPICE_CANVAS_TRACE_OP_BLIT_IMAGE,
+    SPICE_CANVAS_TRACE_OP_BLIT_IMAGE_ROP,
+    SPICE_CANVAS_TRACE_OP_SCALE_IMAGE,
+    SPICE_CANVAS_TRACE_OP_SCALE_IMAGE_ROP,
+    SPICE_CANVAS_TRACE_OP_BLEND_IMAGE,
+    SPICE_CANVAS_TRACE_OP_BLEND_SCALE_IMAGE,
+    SPICE_CANVAS_TRACE_OP_COLORKEY_IMAGE,
+    SPICE_CANVAS_TRACE_OP_COLORKEY_SCALE_IMAGE,
+    SPICE_CANVAS_TRACE_OP_COPY_REGION,
+    SPICE_CANVAS_TRACE_OP_PUT_IMAGE,
+    SPICE_CANVAS_TRACE_OP_PUT_PIXELS,
+    SPICE_CANVAS_TRACE_OP_CLEAR,
+    SPICE_CANVAS_TRACE_OP_GROUP_START,
+    SPICE_CANVAS_TRACE_OP_GROUP_END,
+
+    SPICE_CANVAS_TRACE_N_OPS
+} SpiceCanvasTraceOp;
+
+typedef struct SpiceCanvasTrace SpiceCanvasTrace;
+
+/* Starts recording the drawing done on canvas to file, which must stay open
+   until the trace is stopped. Destroying the canvas stops the trace. */
+SpiceCanvasTrace *spice_canvas_trace_start(SpiceCanvas *canvas, FILE *file);
+void spice_canvas_trace_stop(SpiceCanvasTrace *trace);
+
+typedef struct SpiceCanvasTraceOpStats {
+    uint64_t count;
+    uint64_t time_ns;
+} SpiceCanvasTraceOpStats;
+
+typedef struct SpiceCanvasTraceStats {
+    SpiceCanvasTraceOpStats ops[SPICE_CANVAS_TRACE_N_OPS];
+    uint64_t n_images;
+    uint64_t image_bytes;
+} SpiceCanvasTraceStats;
+
+/* Reads the header of a trace, giving the size and SPICE_SURFACE_FMT of the
+   canvas to replay it on. Returns FALSE if file is not a trace. */
+int spice_canvas_trace_read_header(FILE *file, int *width, int *height, uint32_t *format);
+
+/* Replays the rest of the trace on canvas, timing each call. Returns FALSE
+   if the trace is truncated or corrupted. */
+int spice_canvas_trace_replay(FILE *file, SpiceCanvas *canvas, SpiceCanvasTraceStats *stats);
+
+const char *spice_canvas_trace_op_name(SpiceCanvasTraceOp op);
+
+/* 64 bit FNV-1a of the depth, width, height and pixel rows of image, not
+   looking at the padding at the end of the rows. Unlike
+   spice_pixman_image_hash(), it is stable across versions and platforms of
+   the same byte order, so the checksums of replays can be stored and
+   compared */
+uint64_t spice_canvas_trace_image_checksum(pixman_image_t *image);
+
+SPICE_END_DECLS
+
+#endif
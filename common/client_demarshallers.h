@@ -23,12 +23,48 @@
 SPICE_BEGIN_DECLS
 
 typedef void (*message_destructor_t)(uint8_t *message);
+
 typedef uint8_t * (*spice_parse_channel_func_t)(uint8_t *message_start, uint8_t *message_end, uint16_t message_type, int minor,
 						size_t *size_out, message_destructor_t *free_message);
 
 spice_parse_channel_func_t spice_get_server_channel_parser(uint32_t channel, unsigned int *max_message_type);
 spice_parse_channel_func_t spice_get_server_channel_parser1(uint32_t channel, unsigned int *max_message_type);
 
+/* Like the channel parsers, but the messages whose C struct has the wire
+ * layout are returned in place, with a free_message that does nothing,
+ * instead of being copied. The caller must then keep [message_start,
+ * message_end) alive and unmodified until it is done with the message. */
+uint8_t *spice_parse_msg_in_place(uint8_t *message_start, uint8_t *message_end, uint32_t channel, uint16_t message_type,
+                                  int minor, size_t *size_out, message_destructor_t *free_message);
+uint8_t *spice_parse_msg_in_place1(uint8_t *message_start, uint8_t *message_end, uint32_t channel, uint16_t message_type,
+                                   int minor, size_t *size_out, message_destructor_t *free_message);
+uint8_t *spice_parse_reply_in_place(uint8_t *message_start, uint8_t *message_end, uint32_t channel, uint16_t message_type,
+                                    int minor, size_t *size_out, message_destructor_t *free_message);
+
+typedef struct SpiceParsedMessage {
+    uint16_t type;
+    uint8_t *data; /* NULL if the message failed to parse */
+    size_t size;
+    message_destructor_t free_message;
+} SpiceParsedMessage;
+
+/* Parses all the complete messages at the start of [buffer, buffer_end),
+ * stopping before a truncated one or one with sub messages. Returns the
+ * number of messages, which share an allocation that has to be released
+ * with spice_parse_msg_batch_free(), or -1 if the channel is unknown. The
+ * end of the last parsed message is stored in consumed_out. */
+int spice_parse_msg_batch(uint8_t *buffer, uint8_t *buffer_end, uint32_t channel, int minor,
+                          int mini_header, SpiceParsedMessage **messages_out, uint8_t **consumed_out);
+int spice_parse_msg_batch1(uint8_t *buffer, uint8_t *buffer_end, uint32_t channel, int minor,
+                           int mini_header, SpiceParsedMessage **messages_out, uint8_t **consumed_out);
+void spice_parse_msg_batch_free(SpiceParsedMessage *messages, int n_messages);
+void spice_parse_msg_batch_free1(SpiceParsedMessage *messages, int n_messages);
+
+/* The same for the messages sent by the client, parsed by the server */
+int spice_parse_reply_batch(uint8_t *buffer, uint8_t *buffer_end, uint32_t channel, int minor,
+                            int mini_header, SpiceParsedMessage **messages_out, uint8_t **consumed_out);
+void spice_parse_reply_batch_free(SpiceParsedMessage *messages, int n_messages);
+
 SPICE_END_DECLS
 
 #endif
@@ -0,0 +1,418 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spice_common.h"
+#include "image_analysis.h"
+#include "bitops.h"
+
+#define ANALYSIS_MIN_ROWS 4
+#define ANALYSIS_MAX_ROWS 16
+#define ANALYSIS_SEGMENT 32
+#define ANALYSIS_MAX_SEGMENTS 8
+#define ANALYSIS_COLOR_SLOTS (SPICE_IMAGE_ANALYSIS_MAX_COLORS * 2)
+
+/* Printed by image_analysis_fit, see image_analysis.h. QUIC costs
+   QUIC_BITS_LITERAL bits per channel of the pixels it doesn't repeat, plus
+   QUIC_BITS_LOG per bit of their residuals, QUIC_BITS_RUN per run of
+   repeated pixels and QUIC_BITS_REPEAT per repeated pixel. LZ costs
+   LZ_BYTES_LITERAL per byte of the pixels it doesn't match, LZ_BYTES_RUN per
+   run of matches, LZ_BYTES_REPEAT per pixel repeating its left neighbour and
+   LZ_BYTES_MATCH per other matching pixel. The costs are in ns per pixel */
+#define QUIC_BITS_LITERAL 1.23
+#define QUIC_BITS_LOG 1.32
+#define QUIC_BITS_RUN 4.19
+#define QUIC_BITS_REPEAT 0.0051
+#define QUIC_HEADER_BYTES 128
+#define QUIC_COST_BASE 2.3
+#define QUIC_COST_LITERAL 26.6
+#define LZ_BYTES_LITERAL 1.00
+#define LZ_BYTES_RUN 0.00
+#define LZ_BYTES_REPEAT 0.0039
+#define LZ_BYTES_MATCH 0.0194
+#define LZ_HEADER_BYTES 47
+#define LZ_COST_BASE 0.8
+#define LZ_COST_LITERAL 8.7
+
+/* Above this much QUIC is recommended over LZ when it compresses better,
+   JPEG over QUIC when the image looks like a photo */
+#define QUIC_MIN_GAIN 1.15
+#define JPEG_MIN_NOISE 2.0
+#define JPEG_MAX_REPEAT 0.3
+#define JPEG_MIN_PIXELS (32 * 32)
+
+typedef struct AnalysisFormat {
+    int bpp;
+    int lz_bpp;                 // of the pixels LZ writes, it drops the unused byte
+    int n_channels;             // channels compared, 1 for the palette indexes
+    int quic;                   // QUIC can encode it
+} AnalysisFormat;
+
+typedef struct AnalysisState {
+    const AnalysisFormat *format;
+    uint32_t colors[ANALYSIS_COLOR_SLOTS];   // color + 1, 0 is free
+    uint32_t n_colors;
+    uint32_t n_samples;
+    uint32_t n_repeats;         // pixels equal to the left one, QUIC run mode
+    uint32_t n_repeat_runs;
+    uint32_t n_matches;         // pixels equal to the left or an upper one, LZ copies
+    uint32_t n_match_runs;
+    uint64_t gradient_sum;      // of the pixels QUIC doesn't repeat
+    uint64_t noise_sum;
+    uint64_t noise_bits;        // sum of the bit lengths of the residuals
+} AnalysisState;
+
+static const AnalysisFormat *analysis_get_format(int bitmap_format)
+{
+    static const AnalysisFormat formats[] = {
+        { 1, 1, 1, FALSE },     // SPICE_BITMAP_FMT_1BIT_LE, _BE
+        { 4, 4, 1, FALSE },     // SPICE_BITMAP_FMT_4BIT_LE, _BE
+        { 8, 8, 1, FALSE },     // SPICE_BITMAP_FMT_8BIT, _8BIT_A
+        { 16, 16, 3, TRUE },    // SPICE_BITMAP_FMT_16BIT
+        { 24, 24, 3, TRUE },    // SPICE_BITMAP_FMT_24BIT
+        { 32, 24, 3, TRUE },    // SPICE_BITMAP_FMT_32BIT
+        { 32, 32, 4, TRUE },    // SPICE_BITMAP_FMT_RGBA
+    };
+
+    switch (bitmap_format) {
+    case SPICE_BITMAP_FMT_1BIT_LE:
+    case SPICE_BITMAP_FMT_1BIT_BE:
+        return &formats[0];
+    case SPICE_BITMAP_FMT_4BIT_LE:
+    case SPICE_BITMAP_FMT_4BIT_BE:
+        return &formats[1];
+    case SPICE_BITMAP_FMT_8BIT:
+    case SPICE_BITMAP_FMT_8BIT_A:
+        return &formats[2];
+    case SPICE_BITMAP_FMT_16BIT:
+        return &formats[3];
+    case SPICE_BITMAP_FMT_24BIT:
+        return &formats[4];
+    case SPICE_BITMAP_FMT_32BIT:
+        return &formats[5];
+    case SPICE_BITMAP_FMT_RGBA:
+        return &formats[6];
+    default:
+        return NULL;
+    }
+}
+
+/* Reads the pixels [x, x + n) of line with one channel per byte of out,
+   keeping the precision of the format */
+static void analysis_read_pixels(int bitmap_format, const uint8_t *line, int x, int n,
+                                 uint32_t *out)
+{
+    int i;
+
+    switch (bitmap_format) {
+    case SPICE_BITMAP_FMT_1BIT_LE:
+        for (i = 0; i < n; i++, x++) {
+            out[i] = (line[x >> 3] >> (x & 7)) & 1;
+        }
+        break;
+    case SPICE_BITMAP_FMT_1BIT_BE:
+        for (i = 0; i < n; i++, x++) {
+            out[i] = (line[x >> 3] >> (7 - (x & 7))) & 1;
+        }
+        break;
+    case SPICE_BITMAP_FMT_4BIT_LE:
+        for (i = 0; i < n; i++, x++) {
+            out[i] = (line[x >> 1] >> ((x & 1) << 2)) & 0x0f;
+        }
+        break;
+    case SPICE_BITMAP_FMT_4BIT_BE:
+        for (i = 0; i < n; i++, x++) {
+            out[i] = (line[x >> 1] >> ((~x & 1) << 2)) & 0x0f;
+        }
+        break;
+    case SPICE_BITMAP_FMT_8BIT:
+    case SPICE_BITMAP_FMT_8BIT_A:
+        for (i = 0; i < n; i++) {
+            out[i] = line[x + i];
+        }
+        break;
+    case SPICE_BITMAP_FMT_16BIT:
+        for (i = 0; i < n; i++) {
+            uint32_t pixel = line[(x + i) * 2] | (line[(x + i) * 2 + 1] << 8);
+
+            out[i] = (pixel & 0x1f) | ((pixel & 0x3e0) << 3) | ((pixel & 0x7c00) << 6);
+        }
+        break;
+    case SPICE_BITMAP_FMT_24BIT:
+        line += x * 3;
+        for (i = 0; i < n; i++, line += 3) {
+            out[i] = line[0] | (line[1] << 8) | (line[2] << 16);
+        }
+        break;
+    case SPICE_BITMAP_FMT_32BIT:
+        /* the order of the channels doesn't matter, only the unused byte
+           must go */
+        memcpy(out, line + x * 4, n * 4);
+        for (i = 0; i < n; i++) {
+#ifdef WORDS_BIGENDIAN
+            out[i] >>= 8;
+#else
+            out[i] &= 0x00ffffff;
+#endif
+        }
+        break;
+    case SPICE_BITMAP_FMT_RGBA:
+        memcpy(out, line + x * 4, n * 4);
+        break;
+    }
+}
+
+static void analysis_add_color(AnalysisState *state, uint32_t color)
+{
+    uint32_t i = (color * 0x9e3779b1U) >> (32 - 9);
+
+    if (state->n_colors == SPICE_IMAGE_ANALYSIS_MAX_COLORS) {
+        return;
+    }
+    while (state->colors[i] != 0) {
+        if (state->colors[i] == color + 1) {
+            return;
+        }
+        i = (i + 1) & (ANALYSIS_COLOR_SLOTS - 1);
+    }
+    state->colors[i] = color + 1;
+    state->n_colors++;
+}
+
+/* prev is NULL for the first row of the bitmap. cur[-1] and prev[-1] are the
+   pixels before the segment if x > 0, prev[n] the one after it if x + n < width */
+static void analysis_add_segment(AnalysisState *state, const uint32_t *prev,
+                                 const uint32_t *cur, int x, int n, int width)
+{
+    int n_channels = state->format->n_channels;
+    uint32_t n_repeats = 0;
+    uint32_t n_repeat_runs = 0;
+    uint32_t n_matches = 0;
+    uint32_t n_match_runs = 0;
+    uint64_t gradient_sum = 0;
+    uint64_t noise_sum = 0;
+    uint64_t noise_bits = 0;
+    int repeating = TRUE;       // runs already started before the segment aren't counted
+    int matching = TRUE;
+    uint32_t left, up;
+    int i, c;
+
+    for (i = 0; i < n; i++, x++) {
+        uint32_t pixel = cur[i];
+
+        if (x > 0 && pixel == cur[i - 1]) {
+            n_repeats++;
+            n_repeat_runs += !repeating;
+            repeating = TRUE;
+            n_matches++;
+            n_match_runs += !matching;
+            matching = TRUE;
+            continue;
+        }
+        repeating = FALSE;
+        if (prev && (pixel == prev[i] || (x > 0 && pixel == prev[i - 1]) ||
+                     (x + 1 < width && pixel == prev[i + 1]))) {
+            n_matches++;
+            n_match_runs += !matching;
+            matching = TRUE;
+        } else {
+            matching = FALSE;
+        }
+        if (state->n_colors < SPICE_IMAGE_ANALYSIS_MAX_COLORS) {
+            analysis_add_color(state, pixel);
+        }
+
+        /* QUIC predicts (left + up) / 2, the missing one is replaced by the other */
+        left = x > 0 ? cur[i - 1] : (prev ? prev[i] : 0);
+        up = prev ? prev[i] : left;
+        for (c = 0; c < n_channels; c++) {
+            int value = (pixel >> (c * 8)) & 0xff;
+            int residual = abs(value - (int)((((left >> (c * 8)) & 0xff) +
+                                              ((up >> (c * 8)) & 0xff)) >> 1));
+
+            gradient_sum += abs(value - (int)((left >> (c * 8)) & 0xff));
+            noise_sum += residual;
+            noise_bits += spice_bit_find_msb(residual);
+        }
+    }
+
+    state->n_samples += n;
+    state->n_repeats += n_repeats;
+    state->n_repeat_runs += n_repeat_runs;
+    state->n_matches += n_matches;
+    state->n_match_runs += n_match_runs;
+    state->gradient_sum += gradient_sum;
+    state->noise_sum += noise_sum;
+    state->noise_bits += noise_bits;
+}
+
+static const uint8_t *analysis_get_line(const SpiceBitmap *bitmap, int y)
+{
+    SpiceChunks *chunks = bitmap->data;
+    uint32_t i;
+
+    for (i = 0; i < chunks->num_chunks; i++) {
+        int n_lines = chunks->chunk[i].len / bitmap->stride;
+
+        if (y < n_lines) {
+            return chunks->chunk[i].data + y * bitmap->stride;
+        }
+        y -= n_lines;
+    }
+    return NULL;
+}
+
+static void analysis_predict(const SpiceBitmap *bitmap, AnalysisState *state,
+                             SpiceImageAnalysis *analysis)
+{
+    const AnalysisFormat *format = state->format;
+    double n_pixels = (double)bitmap->x * bitmap->y;
+    double raw = n_pixels * format->bpp / 8;
+    double scale = n_pixels / state->n_samples;
+    double quic_literals = state->n_samples - state->n_repeats;
+    double lz_literals = state->n_samples - state->n_matches;
+    double bytes;
+
+    if (format->quic) {
+        bytes = (QUIC_BITS_LITERAL * quic_literals * format->n_channels +
+                 QUIC_BITS_LOG * state->noise_bits +
+                 QUIC_BITS_RUN * state->n_repeat_runs +
+                 QUIC_BITS_REPEAT * state->n_repeats) * scale / 8;
+        analysis->quic.ratio = raw / (bytes + QUIC_HEADER_BYTES);
+        analysis->quic.cost = QUIC_COST_BASE + QUIC_COST_LITERAL * quic_literals / state->n_samples;
+    }
+
+    bytes = (LZ_BYTES_LITERAL * lz_literals * format->lz_bpp / 8 +
+             LZ_BYTES_RUN * state->n_match_runs +
+             LZ_BYTES_REPEAT * state->n_repeats +
+             LZ_BYTES_MATCH * (state->n_matches - state->n_repeats)) * scale;
+    analysis->lz.ratio = raw / (bytes + LZ_HEADER_BYTES);
+    analysis->lz.cost = LZ_COST_BASE + LZ_COST_LITERAL * lz_literals / state->n_samples;
+}
+
+static void analysis_choose(const SpiceBitmap *bitmap, int flags, SpiceImageAnalysis *analysis)
+{
+    int photo = analysis->quic.ratio > 0 &&
+                analysis->noise >= JPEG_MIN_NOISE && analysis->repeat <= JPEG_MAX_REPEAT &&
+                (uint64_t)bitmap->x * bitmap->y >= JPEG_MIN_PIXELS;
+
+    if ((flags & SPICE_IMAGE_ANALYSIS_ALLOW_LOSSY) && photo) {
+        analysis->type = bitmap->format == SPICE_BITMAP_FMT_RGBA ?
+                         SPICE_IMAGE_TYPE_JPEG_ALPHA : SPICE_IMAGE_TYPE_JPEG;
+        /* placeholder, JPEG has no model, see image_analysis.h */
+        analysis->estimate = analysis->quic;
+    } else if (analysis->quic.ratio > analysis->lz.ratio * QUIC_MIN_GAIN) {
+        analysis->type = SPICE_IMAGE_TYPE_QUIC;
+        analysis->estimate = analysis->quic;
+    } else {
+        /* GLZ only codes RGB, palettized bitmaps stay LZ_PLT */
+        if (analysis_get_format(bitmap->format)->n_channels == 1 &&
+            bitmap->format != SPICE_BITMAP_FMT_8BIT_A) {
+            analysis->type = SPICE_IMAGE_TYPE_LZ_PLT;
+        } else if (flags & SPICE_IMAGE_ANALYSIS_HAVE_GLZ) {
+            analysis->type = SPICE_IMAGE_TYPE_GLZ_RGB;
+        } else {
+            analysis->type = SPICE_IMAGE_TYPE_LZ_RGB;
+        }
+        analysis->estimate = analysis->lz;
+    }
+}
+
+/* Gathers the counters of state from a sample of bitmap, whose format must
+   be known */
+static void analysis_sample(const SpiceBitmap *bitmap, AnalysisState *state)
+{
+    uint32_t prev_pixels[ANALYSIS_SEGMENT * ANALYSIS_MAX_SEGMENTS + 2];
+    uint32_t cur_pixels[ANALYSIS_SEGMENT * ANALYSIS_MAX_SEGMENTS + 1];
+    int width = bitmap->x;
+    int height = bitmap->y;
+    int n_rows, n_segments, segment;
+    int row, i;
+
+    memset(state, 0, sizeof(*state));
+    state->format = analysis_get_format(bitmap->format);
+
+    /* whole rows when they are short, else segments spread over the row */
+    if (width <= ANALYSIS_SEGMENT * ANALYSIS_MAX_SEGMENTS) {
+        n_segments = 1;
+        segment = width;
+    } else {
+        n_segments = ANALYSIS_MAX_SEGMENTS;
+        segment = ANALYSIS_SEGMENT;
+    }
+    /* a sixteenth of the rows of the small bitmaps, so that the analysis stays
+       well below the cost of compressing them */
+    n_rows = MIN(MAX(height / 16, ANALYSIS_MIN_ROWS), ANALYSIS_MAX_ROWS);
+    n_rows = MAX(MIN(n_rows, height - 1), 1);
+
+    for (row = 0; row < n_rows; row++) {
+        int y = height == 1 ? 0 : 1 + (int)((int64_t)row * (height - 1) / n_rows);
+        const uint8_t *line = analysis_get_line(bitmap, y);
+        const uint8_t *prev_line = y > 0 ? analysis_get_line(bitmap, y - 1) : NULL;
+
+        if (line == NULL) {
+            continue;
+        }
+        for (i = 0; i < n_segments; i++) {
+            int x = n_segments == 1 ? 0 : (int)((int64_t)i * (width - segment) / (n_segments - 1));
+            int before = x > 0;
+            int after = x + segment < width;
+
+            analysis_read_pixels(bitmap->format, line, x - before, segment + before, cur_pixels);
+            if (prev_line) {
+                analysis_read_pixels(bitmap->format, prev_line, x - before,
+                                     segment + before + after, prev_pixels);
+            }
+            analysis_add_segment(state, prev_line ? prev_pixels + before : NULL,
+                                 cur_pixels + before, x, segment, width);
+        }
+    }
+}
+
+int spice_bitmap_analyze(const SpiceBitmap *bitmap, int flags, SpiceImageAnalysis *analysis)
+{
+    AnalysisState state;
+
+    memset(analysis, 0, sizeof(*analysis));
+    spice_return_val_if_fail(bitmap->x > 0 && bitmap->y > 0, FALSE);
+    if (!analysis_get_format(bitmap->format)) {
+        return FALSE;
+    }
+    analysis_sample(bitmap, &state);
+    spice_return_val_if_fail(state.n_samples > 0, FALSE);
+
+    analysis->n_samples = state.n_samples;
+    analysis->n_colors = state.n_colors;
+    analysis->repeat = (double)state.n_matches / state.n_samples;
+    analysis->mean_run = state.n_match_runs ? (double)state.n_matches / state.n_match_runs : 0;
+    if (state.n_samples > state.n_repeats) {
+        double n_channels = (double)(state.n_samples - state.n_repeats) * state.format->n_channels;
+
+        analysis->gradient = state.gradient_sum / n_channels;
+        analysis->noise = state.noise_sum / n_channels;
+    }
+
+    analysis_predict(bitmap, &state, analysis);
+    analysis_choose(bitmap, flags, analysis);
+    return TRUE;
+}
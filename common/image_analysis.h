@@ -0,0 +1,85 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_IMAGE_ANALYSIS
+#define _H_IMAGE_ANALYSIS
+
+#include <stdint.h>
+#include <spice/macros.h>
+
+#include "draw.h"
+
+SPICE_BEGIN_DECLS
+
+/* Picks the compression of a bitmap from statistics of a sample of its
+   pixels, without trying the codecs.
+
+   The sample is made of short runs of pixels spread over up to 16 rows, so
+   the analysis looks at no more than 4096 pixels whatever the size of the
+   bitmap. The metrics follow what the codecs exploit: QUIC codes the
+   difference of each channel with the average of the left and upper
+   pixels and has a run mode for repeated pixels, LZ copies the pixels
+   that already appeared, mostly just left or just above.
+
+   The ratio and cost models are fitted by image_analysis_fit, on
+   quic_encode() and lz_encode() runs over the generated images it
+   describes (flat areas, windows, text, icons, gradients, photos and
+   noise); run it again to refit them after changing a codec. The cost is
+   in nanoseconds per pixel on the machine they were fitted on (x86_64, gcc
+   -O2) and is only meaningful to compare codecs or images. LZ matches with
+   pixels further than the row above are not seen, so LZ is underestimated
+   on repeated icons or glyphs.
+
+   There is no JPEG encoder in this library and no JPEG model: when JPEG is
+   recommended, estimate is a placeholder holding the QUIC prediction. */
+
+enum {
+    SPICE_IMAGE_ANALYSIS_ALLOW_LOSSY = (1 << 0),   /* JPEG may be recommended */
+    SPICE_IMAGE_ANALYSIS_HAVE_GLZ = (1 << 1),      /* recommend GLZ_RGB rather than LZ */
+};
+
+typedef struct SpiceImageCodecEstimate {
+    double ratio;           /* uncompressed size / compressed size */
+    double cost;            /* nanoseconds per pixel */
+} SpiceImageCodecEstimate;
+
+typedef struct SpiceImageAnalysis {
+    uint32_t n_samples;     /* pixels looked at */
+    uint32_t n_colors;      /* distinct colors in the sample, at most SPICE_IMAGE_ANALYSIS_MAX_COLORS */
+    /* means over the channels of the pixels that don't repeat a neighbour */
+    double gradient;        /* difference with the left pixel */
+    double noise;           /* difference with the QUIC prediction */
+    double repeat;          /* fraction of the pixels equal to the left or upper one */
+    double mean_run;        /* mean length of the runs of such pixels */
+
+    SpiceImageCodecEstimate quic;    /* ratio 0 if QUIC can't encode the format */
+    SpiceImageCodecEstimate lz;
+
+    uint8_t type;           /* the recommended SPICE_IMAGE_TYPE */
+    SpiceImageCodecEstimate estimate;  /* of the recommended type, the QUIC one for JPEG */
+} SpiceImageAnalysis;
+
+#define SPICE_IMAGE_ANALYSIS_MAX_COLORS 256
+
+/* Returns FALSE if the format of bitmap is unknown. The data chunks must hold
+   whole rows, as the ones the codecs are given */
+int spice_bitmap_analyze(const SpiceBitmap *bitmap, int flags, SpiceImageAnalysis *analysis);
+
+SPICE_END_DECLS
+
+#endif
@@ -0,0 +1,549 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Fits the ratio and cost models of image_analysis.c and prints the
+   constants to paste there.
+
+   The corpus is generated, so every run fits on the same images: 32bpp
+   bitmaps of 64x64, 256x256 and 640x480 pixels of each kind below, the
+   content a desktop session sends:
+     flat      a single color
+     ui        a window: flat panels, borders and a few buttons
+     text      black glyphs with gray edges on white, glyphs repeat; the
+               line pitch is not a multiple of the rows sampled apart,
+               else only the gaps between lines are sampled
+     icons     a grid of a few 16x16 icons of random pixels
+     gradient  a horizontal gradient
+     photo     smooth random shapes plus a little noise
+     noise     random pixels
+   Each bitmap is compressed with quic_encode() and lz_encode(), and the
+   sizes are fitted on the counters the analysis gathers, minimizing the
+   absolute error of the log of the ratios, see fit_solve(). The costs
+   are the best time of a few runs, fitted the same way; they depend on the
+   machine and the compiler flags. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <math.h>
+
+/* for AnalysisState and analysis_sample() */
+#include "image_analysis.c"
+#include "quic.h"
+#include "lz.h"
+#include "message_stats.h"
+
+#define FIT_RUNS 5
+#define FIT_MAX_TERMS 5
+#define FIT_PASSES 50
+#define FIT_MIN_ERROR 0.01
+
+typedef struct FitImage {
+    const char *kind;
+    int width;
+    int height;
+    uint32_t *pixels;
+    AnalysisState state;
+    double scale;
+    double quic_bytes;
+    double quic_cost;
+    double lz_bytes;
+    double lz_cost;
+    double quic_fit;            // of quic_bytes and lz_bytes by the fitted models
+    double lz_fit;
+} FitImage;
+
+static const char *fit_kinds[] = {
+    "flat", "ui", "text", "icons", "gradient", "photo", "noise"
+};
+
+/* LZ compresses the icons through matches with the previous icons, which
+   are further than the pixels the analysis compares, so it can't predict
+   them: they are left out of the LZ fit */
+#define FIT_KIND_ICONS 3
+
+static const int fit_sizes[][2] = {
+    { 64, 64 }, { 256, 256 }, { 640, 480 }
+};
+
+static uint32_t fit_seed;
+
+static uint32_t fit_random(void)
+{
+    fit_seed = fit_seed * 1103515245 + 12345;
+    return fit_seed >> 8;
+}
+
+static void fit_fill_rect(FitImage *image, int x, int y, int width, int height, uint32_t color)
+{
+    int i, j;
+
+    for (j = MAX(y, 0); j < MIN(y + height, image->height); j++) {
+        for (i = MAX(x, 0); i < MIN(x + width, image->width); i++) {
+            image->pixels[j * image->width + i] = color;
+        }
+    }
+}
+
+static void fit_draw(FitImage *image, int kind)
+{
+    int width = image->width;
+    int height = image->height;
+    uint8_t glyphs[8][8 * 12];
+    uint32_t icons[4][16 * 16];
+    int x, y, i, j;
+
+    fit_seed = kind * 7919 + width;
+    switch (kind) {
+    case 0:
+        fit_fill_rect(image, 0, 0, width, height, 0x3465a4);
+        break;
+    case 1:
+        fit_fill_rect(image, 0, 0, width, height, 0xedeceb);
+        fit_fill_rect(image, 0, 0, width, 24, 0x2e3436);
+        fit_fill_rect(image, 8, 32, width / 3, height - 40, 0xffffff);
+        fit_fill_rect(image, 8, 32, width / 3, 1, 0x888a85);
+        for (i = 0; i < 4; i++) {
+            fit_fill_rect(image, width / 3 + 16 + i * 40, height - 32, 32, 20, 0xd3d7cf);
+            fit_fill_rect(image, width / 3 + 16 + i * 40, height - 13, 32, 1, 0x555753);
+        }
+        break;
+    case 2:
+        for (i = 0; i < 8; i++) {
+            for (j = 0; j < 8 * 12; j++) {
+                uint32_t r = fit_random() & 7;
+
+                glyphs[i][j] = r < 4 ? 0xff : (r < 6 ? 0 : 0x80);
+            }
+        }
+        fit_fill_rect(image, 0, 0, width, height, 0xffffff);
+        for (y = 2; y + 12 <= height; y += 14) {
+            for (x = 2; x + 8 <= width; x += 8) {
+                const uint8_t *glyph = glyphs[fit_random() & 7];
+
+                if ((fit_random() & 7) == 0) {
+                    continue;
+                }
+                for (j = 0; j < 12; j++) {
+                    for (i = 0; i < 8; i++) {
+                        uint8_t v = glyph[j * 8 + i];
+
+                        image->pixels[(y + j) * width + x + i] = v | (v << 8) | (v << 16);
+                    }
+                }
+            }
+        }
+        break;
+    case 3:
+        for (i = 0; i < 4; i++) {
+            for (j = 0; j < 16 * 16; j++) {
+                icons[i][j] = fit_random() & 0xffffff;
+            }
+        }
+        fit_fill_rect(image, 0, 0, width, height, 0x729fcf);
+        for (y = 4; y + 16 <= height; y += 24) {
+            for (x = 4; x + 16 <= width; x += 24) {
+                const uint32_t *icon = icons[fit_random() & 3];
+
+                for (j = 0; j < 16; j++) {
+                    memcpy(&image->pixels[(y + j) * width + x], &icon[j * 16], 16 * 4);
+                }
+            }
+        }
+        break;
+    case 4:
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                uint32_t v = x * 255 / (width - 1);
+
+                image->pixels[y * width + x] = v | ((255 - v) << 8) | (0x80 << 16);
+            }
+        }
+        break;
+    case 5:
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                double v = sin(x * 0.05) * cos(y * 0.07) + sin((x + y) * 0.013);
+                int r = 128 + (int)(v * 50) + (int)(fit_random() % 9) - 4;
+                int g = 100 + (int)(v * 40) + (int)(fit_random() % 9) - 4;
+                int b = 80 + (int)(v * 30) + (int)(fit_random() % 9) - 4;
+
+                image->pixels[y * width + x] = r | (g << 8) | (b << 16);
+            }
+        }
+        break;
+    default:
+        for (i = 0; i < width * height; i++) {
+            image->pixels[i] = fit_random() & 0xffffff;
+        }
+        break;
+    }
+}
+
+static void fit_sample(FitImage *image)
+{
+    SpiceChunks *chunks;
+    SpiceBitmap bitmap;
+
+    chunks = spice_chunks_new_linear((uint8_t *)image->pixels, image->width * image->height * 4);
+    memset(&bitmap, 0, sizeof(bitmap));
+    bitmap.format = SPICE_BITMAP_FMT_32BIT;
+    bitmap.x = image->width;
+    bitmap.y = image->height;
+    bitmap.stride = image->width * 4;
+    bitmap.data = chunks;
+    analysis_sample(&bitmap, &image->state);
+    image->scale = (double)image->width * image->height / image->state.n_samples;
+    spice_chunks_destroy(chunks);
+}
+
+static void fit_quic_error(QuicUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(1);
+}
+
+static void fit_quic_warn(QuicUsrContext *usr, const char *fmt, ...)
+{
+}
+
+static void *fit_quic_malloc(QuicUsrContext *usr, int size)
+{
+    return spice_malloc(size);
+}
+
+static void fit_quic_free(QuicUsrContext *usr, void *ptr)
+{
+    free(ptr);
+}
+
+static int fit_quic_more_space(QuicUsrContext *usr, uint32_t **io_ptr, int rows_completed)
+{
+    return 0;
+}
+
+static int fit_quic_more_lines(QuicUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+static void fit_lz_error(LzUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(1);
+}
+
+static void fit_lz_warn(LzUsrContext *usr, const char *fmt, ...)
+{
+}
+
+static void *fit_lz_malloc(LzUsrContext *usr, int size)
+{
+    return spice_malloc(size);
+}
+
+static void fit_lz_free(LzUsrContext *usr, void *ptr)
+{
+    free(ptr);
+}
+
+static int fit_lz_more_space(LzUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+static int fit_lz_more_lines(LzUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+static void fit_compress(FitImage *image, QuicContext *quic, LzContext *lz)
+{
+    int n_pixels = image->width * image->height;
+    int size = n_pixels * 8 + 4096;
+    uint8_t *out = spice_malloc(size);
+    uint64_t start, best;
+    int run, len = 0;
+
+    best = UINT64_MAX;
+    for (run = 0; run < FIT_RUNS; run++) {
+        start = spice_message_stats_now();
+        len = quic_encode(quic, QUIC_IMAGE_TYPE_RGB32, image->width, image->height,
+                          (uint8_t *)image->pixels, image->height, image->width * 4,
+                          (uint32_t *)out, size / 4);
+        best = MIN(best, spice_message_stats_now() - start);
+    }
+    image->quic_bytes = len * 4.0;
+    image->quic_cost = (double)best / n_pixels;
+
+    best = UINT64_MAX;
+    for (run = 0; run < FIT_RUNS; run++) {
+        start = spice_message_stats_now();
+        len = lz_encode(lz, LZ_IMAGE_TYPE_RGB32, image->width, image->height, TRUE,
+                        (uint8_t *)image->pixels, image->height, image->width * 4,
+                        out, size);
+        best = MIN(best, spice_message_stats_now() - start);
+    }
+    image->lz_bytes = len;
+    image->lz_cost = (double)best / n_pixels;
+    free(out);
+}
+
+/* Minimizes the sum of ((terms . coefs - value) / weight)^2 over the used
+   images with the normal equations */
+static void fit_solve_weighted(int n_images, int n_terms, double terms[][FIT_MAX_TERMS],
+                               const double *values, const double *weights, const int *used,
+                               double *coefs)
+{
+    double a[FIT_MAX_TERMS][FIT_MAX_TERMS + 1];
+    int i, j, k;
+
+    memset(a, 0, sizeof(a));
+    for (k = 0; k < n_images; k++) {
+        double w = 1.0 / (weights[k] * weights[k]);
+
+        if (!used[k]) {
+            continue;
+        }
+        for (i = 0; i < n_terms; i++) {
+            for (j = 0; j < n_terms; j++) {
+                a[i][j] += w * terms[k][i] * terms[k][j];
+            }
+            a[i][n_terms] += w * terms[k][i] * values[k];
+        }
+    }
+    for (i = 0; i < n_terms; i++) {
+        int pivot = i;
+
+        for (j = i + 1; j < n_terms; j++) {
+            if (fabs(a[j][i]) > fabs(a[pivot][i])) {
+                pivot = j;
+            }
+        }
+        for (k = 0; k <= n_terms; k++) {
+            double t = a[i][k];
+
+            a[i][k] = a[pivot][k];
+            a[pivot][k] = t;
+        }
+        for (j = 0; j < n_terms; j++) {
+            double f;
+
+            if (j == i || a[i][i] == 0) {
+                continue;
+            }
+            f = a[j][i] / a[i][i];
+            for (k = i; k <= n_terms; k++) {
+                a[j][k] -= f * a[i][k];
+            }
+        }
+    }
+    for (i = 0; i < n_terms; i++) {
+        coefs[i] = a[i][i] != 0 ? a[i][n_terms] / a[i][i] : 0;
+    }
+}
+
+static double fit_predict(int n_terms, const double *terms, const double *coefs)
+{
+    double value = 0;
+    int i;
+
+    for (i = 0; i < n_terms; i++) {
+        value += terms[i] * coefs[i];
+    }
+    return value;
+}
+
+/* Fits the coefs so that the sum of the absolute errors of log(terms .
+   coefs) is minimal: in log space overestimating and underestimating count
+   the same, and the absolute error keeps the images the model fits worst
+   from pulling the others off. Each pass weights the least squares by the
+   errors of the previous one. The terms count bytes or nanoseconds, so the
+   one with the most negative coef is dropped and the fit redone until
+   there is none; terms[][0] is the constant and is always kept */
+static void fit_solve(int n_images, int n_terms, double terms[][FIT_MAX_TERMS],
+                      const double *values, const int *used, double *coefs)
+{
+    double kept[n_images][FIT_MAX_TERMS];
+    double weights[n_images];
+    int i, j, pass, drop;
+
+    memcpy(kept, terms, sizeof(kept));
+    do {
+        for (i = 0; i < n_images; i++) {
+            weights[i] = values[i];
+        }
+        for (pass = 0; pass < FIT_PASSES; pass++) {
+            fit_solve_weighted(n_images, n_terms, kept, values, weights, used, coefs);
+            for (i = 0; i < n_images; i++) {
+                double prediction = MAX(fit_predict(n_terms, kept[i], coefs), values[i] / 100);
+                double error = fabs(log(prediction / values[i]));
+
+                weights[i] = sqrt(values[i] * prediction * MAX(error, FIT_MIN_ERROR));
+            }
+        }
+        drop = 0;
+        for (j = 1; j < n_terms; j++) {
+            if (coefs[j] < 0 && (drop == 0 || coefs[j] < coefs[drop])) {
+                drop = j;
+            }
+        }
+        for (i = 0; i < n_images && drop != 0; i++) {
+            kept[i][drop] = 0;
+        }
+    } while (drop != 0);
+}
+
+int main(int argc, char **argv)
+{
+    QuicUsrContext quic_usr = {
+        fit_quic_error, fit_quic_warn, fit_quic_warn,
+        fit_quic_malloc, fit_quic_free, fit_quic_more_space, fit_quic_more_lines
+    };
+    LzUsrContext lz_usr = {
+        fit_lz_error, fit_lz_warn, fit_lz_warn,
+        fit_lz_malloc, fit_lz_free, fit_lz_more_space, fit_lz_more_lines
+    };
+    int n_kinds = SPICE_N_ELEMENTS(fit_kinds);
+    int n_sizes = SPICE_N_ELEMENTS(fit_sizes);
+    int n_images = n_kinds * n_sizes;
+    FitImage images[SPICE_N_ELEMENTS(fit_kinds) * SPICE_N_ELEMENTS(fit_sizes)];
+    double terms[SPICE_N_ELEMENTS(images)][FIT_MAX_TERMS];
+    double values[SPICE_N_ELEMENTS(images)];
+    int used[SPICE_N_ELEMENTS(images)];
+    double quic[5], lz[5], quic_cost[2], lz_cost[2];
+    QuicContext *quic_context;
+    LzContext *lz_context;
+    int i;
+
+    quic_init();
+    quic_context = quic_create(&quic_usr);
+    lz_context = lz_create(&lz_usr);
+    if (quic_context == NULL || lz_context == NULL) {
+        fprintf(stderr, "failed to create the codecs\n");
+        return 1;
+    }
+
+    for (i = 0; i < n_images; i++) {
+        FitImage *image = &images[i];
+
+        image->kind = fit_kinds[i % n_kinds];
+        image->width = fit_sizes[i / n_kinds][0];
+        image->height = fit_sizes[i / n_kinds][1];
+        image->pixels = spice_malloc_n(image->width * image->height, sizeof(uint32_t));
+        fit_draw(image, i % n_kinds);
+        fit_sample(image);
+        fit_compress(image, quic_context, lz_context);
+        used[i] = TRUE;
+    }
+
+    /* see analysis_predict() for the terms */
+    for (i = 0; i < n_images; i++) {
+        AnalysisState *s = &images[i].state;
+        double scale = images[i].scale / 8;
+
+        terms[i][0] = 1;
+        terms[i][1] = (double)(s->n_samples - s->n_repeats) * s->format->n_channels * scale;
+        terms[i][2] = (double)s->noise_bits * scale;
+        terms[i][3] = (double)s->n_repeat_runs * scale;
+        terms[i][4] = (double)s->n_repeats * scale;
+        values[i] = images[i].quic_bytes;
+    }
+    fit_solve(n_images, 5, terms, values, used, quic);
+    for (i = 0; i < n_images; i++) {
+        images[i].quic_fit = fit_predict(5, terms[i], quic);
+    }
+
+    for (i = 0; i < n_images; i++) {
+        AnalysisState *s = &images[i].state;
+        double scale = images[i].scale;
+
+        terms[i][0] = 1;
+        terms[i][1] = (double)(s->n_samples - s->n_matches) * s->format->lz_bpp / 8 * scale;
+        terms[i][2] = (double)s->n_match_runs * scale;
+        terms[i][3] = (double)s->n_repeats * scale;
+        terms[i][4] = (double)(s->n_matches - s->n_repeats) * scale;
+        values[i] = images[i].lz_bytes;
+        used[i] = i % n_kinds != FIT_KIND_ICONS;
+    }
+    fit_solve(n_images, 5, terms, values, used, lz);
+    for (i = 0; i < n_images; i++) {
+        images[i].lz_fit = fit_predict(5, terms[i], lz);
+        used[i] = TRUE;
+    }
+
+    for (i = 0; i < n_images; i++) {
+        AnalysisState *s = &images[i].state;
+
+        terms[i][0] = 1;
+        terms[i][1] = (double)(s->n_samples - s->n_repeats) / s->n_samples;
+        values[i] = images[i].quic_cost;
+    }
+    fit_solve(n_images, 2, terms, values, used, quic_cost);
+
+    for (i = 0; i < n_images; i++) {
+        AnalysisState *s = &images[i].state;
+
+        terms[i][1] = (double)(s->n_samples - s->n_matches) / s->n_samples;
+        values[i] = images[i].lz_cost;
+    }
+    fit_solve(n_images, 2, terms, values, used, lz_cost);
+
+    printf("%-9s %7s %17s %17s %9s %9s\n", "image", "size", "quic ratio (fit)",
+           "lz ratio (fit)", "quic ns", "lz ns");
+    for (i = 0; i < n_images; i++) {
+        FitImage *image = &images[i];
+        double raw = image->width * image->height * 4.0;
+
+        printf("%-9s %3dx%-3d %8.2f (%6.2f) %8.2f (%6.2f) %9.2f %9.2f\n", image->kind,
+               image->width, image->height, raw / image->quic_bytes, raw / image->quic_fit,
+               raw / image->lz_bytes, raw / image->lz_fit, image->quic_cost, image->lz_cost);
+    }
+
+    printf("\n#define QUIC_BITS_LITERAL %.2f\n", quic[1]);
+    printf("#define QUIC_BITS_LOG %.2f\n", quic[2]);
+    printf("#define QUIC_BITS_RUN %.2f\n", quic[3]);
+    printf("#define QUIC_BITS_REPEAT %.4f\n", quic[4]);
+    printf("#define QUIC_HEADER_BYTES %.0f\n", quic[0]);
+    printf("#define QUIC_COST_BASE %.1f\n", quic_cost[0]);
+    printf("#define QUIC_COST_LITERAL %.1f\n", quic_cost[1]);
+    printf("#define LZ_BYTES_LITERAL %.2f\n", lz[1]);
+    printf("#define LZ_BYTES_RUN %.2f\n", lz[2]);
+    printf("#define LZ_BYTES_REPEAT %.4f\n", lz[3]);
+    printf("#define LZ_BYTES_MATCH %.4f\n", lz[4]);
+    printf("#define LZ_HEADER_BYTES %.0f\n", lz[0]);
+    printf("#define LZ_COST_BASE %.1f\n", lz_cost[0]);
+    printf("#define LZ_COST_LITERAL %.1f\n", lz_cost[1]);
+
+    for (i = 0; i < n_images; i++) {
+        free(images[i].pixels);
+    }
+    lz_destroy(lz_context);
+    quic_destroy(quic_context);
+    return 0;
+}
@@ -0,0 +1,175 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spice_common.h"
+#include "image_cache.h"
+#include "image_table.h"
+#include "mem.h"
+
+#define IMAGE_CACHE_SHARDS_LOG 4
+#define IMAGE_CACHE_SHARDS (1 << IMAGE_CACHE_SHARDS_LOG)
+
+#define IMAGE_CACHE_LOSSY (1 << 0)
+
+typedef struct ImageCache {
+    SpiceImageCache base;
+    ImageTable shards[IMAGE_CACHE_SHARDS];
+} ImageCache;
+
+static INLINE ImageTable *image_cache_get_shard(ImageCache *cache, uint64_t id)
+{
+    return &cache->shards[(id * 0x9e3779b97f4a7c15ULL) >> (64 - IMAGE_CACHE_SHARDS_LOG)];
+}
+
+static void image_cache_insert(ImageCache *cache, uint64_t id, pixman_image_t *image, int lossy)
+{
+    image_table_put_shared(image_cache_get_shard(cache, id), id, image,
+                           lossy ? IMAGE_CACHE_LOSSY : 0, TRUE);
+}
+
+static pixman_image_t *image_cache_lookup(ImageCache *cache, uint64_t id, int want_lossless)
+{
+    pixman_image_t *image;
+    uint32_t flags;
+
+    image = image_table_get(image_cache_get_shard(cache, id), id, NULL, NULL, &flags);
+    if (image && want_lossless && (flags & IMAGE_CACHE_LOSSY)) {
+        spice_warning("image 0x%llx is lossy", (unsigned long long)id);
+    }
+    return image;
+}
+
+static void image_cache_put(SpiceImageCache *spice_cache, uint64_t id, pixman_image_t *image)
+{
+    image_cache_insert((ImageCache *)spice_cache, id, image, FALSE);
+}
+
+static pixman_image_t *image_cache_get(SpiceImageCache *spice_cache, uint64_t id)
+{
+    return image_cache_lookup((ImageCache *)spice_cache, id, FALSE);
+}
+
+#ifdef SW_CANVAS_CACHE
+static void image_cache_put_lossy(SpiceImageCache *spice_cache, uint64_t id,
+                                  pixman_image_t *image)
+{
+    image_cache_insert((ImageCache *)spice_cache, id, image, TRUE);
+}
+
+static void image_cache_replace_lossy(SpiceImageCache *spice_cache, uint64_t id,
+                                      pixman_image_t *image)
+{
+    image_cache_insert((ImageCache *)spice_cache, id, image, FALSE);
+}
+
+static pixman_image_t *image_cache_get_lossless(SpiceImageCache *spice_cache, uint64_t id)
+{
+    return image_cache_lookup((ImageCache *)spice_cache, id, TRUE);
+}
+#endif
+
+static SpiceImageCacheOps image_cache_ops = {
+    image_cache_put,
+    image_cache_get,
+#ifdef SW_CANVAS_CACHE
+    image_cache_put_lossy,
+    image_cache_replace_lossy,
+    image_cache_get_lossless,
+#endif
+};
+
+SpiceImageCache *image_cache_create(uint64_t max_bytes)
+{
+    ImageCache *cache = spice_new0(ImageCache, 1);
+    int i;
+
+    cache->base.ops = &image_cache_ops;
+    max_bytes = (max_bytes + IMAGE_CACHE_SHARDS - 1) / IMAGE_CACHE_SHARDS;
+    for (i = 0; i < IMAGE_CACHE_SHARDS; i++) {
+        image_table_init(&cache->shards[i], max_bytes);
+    }
+    return &cache->base;
+}
+
+void image_cache_clear(SpiceImageCache *spice_cache)
+{
+    ImageCache *cache = (ImageCache *)spice_cache;
+    int i;
+
+    for (i = 0; i < IMAGE_CACHE_SHARDS; i++) {
+        image_table_clear(&cache->shards[i]);
+    }
+}
+
+void image_cache_destroy(SpiceImageCache *spice_cache)
+{
+    ImageCache *cache = (ImageCache *)spice_cache;
+    int i;
+
+    if (!cache) {
+        return;
+    }
+    image_cache_clear(spice_cache);
+    for (i = 0; i < IMAGE_CACHE_SHARDS; i++) {
+        /* the images still referenced would release their entry in a freed shard */
+        spice_return_if_fail(!image_table_in_use(&cache->shards[i]));
+    }
+    for (i = 0; i < IMAGE_CACHE_SHARDS; i++) {
+        image_table_destroy(&cache->shards[i]);
+    }
+    free(cache);
+}
+
+void image_cache_remove(SpiceImageCache *spice_cache, uint64_t id)
+{
+    image_table_remove(image_cache_get_shard((ImageCache *)spice_cache, id), id);
+}
+
+void image_cache_get_stats(SpiceImageCache *spice_cache, SpiceImageCacheStats *stats)
+{
+    ImageCache *cache = (ImageCache *)spice_cache;
+    ImageTableStats table_stats;
+    int i;
+
+    memset(&table_stats, 0, sizeof(table_stats));
+    for (i = 0; i < IMAGE_CACHE_SHARDS; i++) {
+        image_table_get_stats(&cache->shards[i], &table_stats);
+    }
+    stats->hits = table_stats.hits;
+    stats->misses = table_stats.misses;
+    stats->evictions = table_stats.evictions;
+    stats->n_images = table_stats.n_images;
+    stats->bytes = table_stats.bytes;
+    stats->shared_bytes = table_stats.shared_bytes;
+}
+
+void image_cache_reset_stats(SpiceImageCache *spice_cache)
+{
+    ImageCache *cache = (ImageCache *)spice_cache;
+    int i;
+
+    for (i = 0; i < IMAGE_CACHE_SHARDS; i++) {
+        image_table_reset_stats(&cache->shards[i]);
+    }
+}
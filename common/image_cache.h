@@ -0,0 +1,72 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_IMAGE_CACHE
+#define _H_IMAGE_CACHE
+
+#include <stdint.h>
+#include <spice/macros.h>
+
+#include "canvas_base.h"
+
+SPICE_BEGIN_DECLS
+
+/* An implementation of SpiceImageCache that can be shared by the canvases of
+   several display channels running on different threads.
+
+   The images are spread over independently locked shards by id. get() returns
+   a new pixman image using the bits of the cached one, so the caller can
+   unref it while other threads use the same entry; the cached image is
+   released once it left the cache and all the images returned for it were
+   unreferenced. put() doesn't copy the image, the cache shares its bits: the
+   image, which stays the caller's, becomes one of the images returned for the
+   entry, or if it was returned by an image dedup (see image_dedup.h), the entry
+   references the one of the dedup, which must then be destroyed after the
+   cache. Either way the image must only be used by the thread that put it.
+
+   All the images given to put() and returned by get() must be unreferenced
+   before the cache is destroyed, image_cache_destroy() leaks the cache
+   otherwise.
+
+   The server keeps track of the images the client has, so evicting an image it
+   may still refer to breaks the display: max_bytes is a safety limit that
+   should be larger than what the client announced, or 0 for no limit. The
+   limit is split evenly between the shards. */
+
+typedef struct SpiceImageCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t n_images;
+    uint64_t bytes;
+    uint64_t shared_bytes;  /* of the images sharing the bits of an image dedup entry */
+} SpiceImageCacheStats;
+
+SpiceImageCache *image_cache_create(uint64_t max_bytes);
+void image_cache_destroy(SpiceImageCache *cache);
+
+/* For SPICE_MSG_DISPLAY_INVAL_LIST and SPICE_MSG_DISPLAY_INVAL_ALL_PIXMAPS */
+void image_cache_remove(SpiceImageCache *cache, uint64_t id);
+void image_cache_clear(SpiceImageCache *cache);
+
+void image_cache_get_stats(SpiceImageCache *cache, SpiceImageCacheStats *stats);
+void image_cache_reset_stats(SpiceImageCache *cache);
+
+SPICE_END_DECLS
+
+#endif
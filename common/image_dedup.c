@@ -0,0 +1,130 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spice_common.h"
+#include "image_dedup.h"
+#include "image_table.h"
+#include "canvas_utils.h"
+#include "mem.h"
+
+struct SpiceImageDedup {
+    ImageTable table;                   // by hash of the pixels
+};
+
+static int image_dedup_match(pixman_image_t *image, pixman_image_t *entry_image)
+{
+    pixman_format_code_t format, entry_format;
+    int width = pixman_image_get_width(image);
+    int height = pixman_image_get_height(image);
+    int stride = pixman_image_get_stride(image);
+    int entry_stride = pixman_image_get_stride(entry_image);
+    uint8_t *line = (uint8_t *)pixman_image_get_data(image);
+    uint8_t *entry_line = (uint8_t *)pixman_image_get_data(entry_image);
+    int row_bytes;
+
+    if (!spice_pixman_image_get_format(image, &format) ||
+        !spice_pixman_image_get_format(entry_image, &entry_format) ||
+        entry_format != format ||
+        pixman_image_get_width(entry_image) != width ||
+        pixman_image_get_height(entry_image) != height) {
+        return FALSE;
+    }
+    row_bytes = (width * PIXMAN_FORMAT_BPP(format) + 7) / 8;
+    for (; height > 0; height--, line += stride, entry_line += entry_stride) {
+        if (memcmp(line, entry_line, row_bytes) != 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+pixman_image_t *image_dedup_share(SpiceImageDedup *dedup, pixman_image_t *image)
+{
+    pixman_format_code_t format;
+    pixman_image_t *shared;
+    uint64_t hash, size;
+
+    if (!spice_pixman_image_get_format(image, &format)) {
+        return image;
+    }
+    size = (uint64_t)abs(pixman_image_get_stride(image)) * pixman_image_get_height(image);
+    if (size > dedup->table.max_bytes) {
+        return image;
+    }
+    hash = spice_pixman_image_hash(image);
+
+    if ((shared = image_table_get(&dedup->table, hash, image_dedup_match, image, NULL))) {
+        pixman_image_unref(image);
+        return shared;
+    }
+    shared = image_table_put(&dedup->table, hash, image, 0, FALSE);
+    return shared ? shared : image;
+}
+
+SpiceImageDedup *image_dedup_create(uint64_t max_bytes)
+{
+    SpiceImageDedup *dedup;
+
+    spice_return_val_if_fail(max_bytes > 0, NULL);
+
+    dedup = spice_new0(SpiceImageDedup, 1);
+    image_table_init(&dedup->table, max_bytes);
+    return dedup;
+}
+
+void image_dedup_clear(SpiceImageDedup *dedup)
+{
+    image_table_clear(&dedup->table);
+}
+
+/* All the images returned by share() must have been unreferenced */
+void image_dedup_destroy(SpiceImageDedup *dedup)
+{
+    if (!dedup) {
+        return;
+    }
+    image_table_clear(&dedup->table);
+    spice_return_if_fail(!image_table_in_use(&dedup->table));
+    image_table_destroy(&dedup->table);
+    free(dedup);
+}
+
+void image_dedup_get_stats(SpiceImageDedup *dedup, SpiceImageDedupStats *stats)
+{
+    ImageTableStats table_stats;
+
+    memset(&table_stats, 0, sizeof(table_stats));
+    image_table_get_stats(&dedup->table, &table_stats);
+    stats->hits = table_stats.hits;
+    stats->misses = table_stats.misses;
+    stats->evictions = table_stats.evictions;
+    stats->n_images = table_stats.n_images;
+    stats->bytes = table_stats.bytes;
+    stats->saved_bytes = table_stats.hit_bytes;
+}
+
+void image_dedup_reset_stats(SpiceImageDedup *dedup)
+{
+    image_table_reset_stats(&dedup->table);
+}
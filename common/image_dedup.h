@@ -0,0 +1,69 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_IMAGE_DEDUP
+#define _H_IMAGE_DEDUP
+
+#include <stdint.h>
+#include <spice/macros.h>
+
+#include "canvas_base.h"
+
+SPICE_BEGIN_DECLS
+
+/* A table of decoded images by content, so that identical images sent under
+   different ids (icons, toolbars, ...) share their pixels.
+
+   image_dedup_share() looks for an image with the same format, size and
+   pixels as the given one, remembering the given one if there is none, and
+   returns a new pixman image using the bits of the remembered one. The bits
+   are shared by all the images returned for the same content and must not be
+   modified. The remembered image is released once it left the table and all
+   the images returned for it were unreferenced, so the returned images can be
+   unreferenced on any thread and the table can be shared by the canvases of
+   several display channels. They must all be unreferenced before the table
+   is destroyed.
+
+   max_bytes bounds the memory of the images remembered by the table, the
+   least recently shared ones are forgotten first. The table outlives the
+   images it is given, so it must be bounded: image_dedup_create() returns
+   NULL if max_bytes is 0. */
+
+typedef struct SpiceImageDedupStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t n_images;
+    uint64_t bytes;
+    uint64_t saved_bytes;   /* pixels of the images that got shared instead */
+} SpiceImageDedupStats;
+
+SpiceImageDedup *image_dedup_create(uint64_t max_bytes);
+void image_dedup_destroy(SpiceImageDedup *dedup);
+
+/* Takes the reference of the caller on image and returns an image with the
+   same content, or image itself if it can't be shared */
+pixman_image_t *image_dedup_share(SpiceImageDedup *dedup, pixman_image_t *image);
+void image_dedup_clear(SpiceImageDedup *dedup);
+
+void image_dedup_get_stats(SpiceImageDedup *dedup, SpiceImageDedupStats *stats);
+void image_dedup_reset_stats(SpiceImageDedup *dedup);
+
+SPICE_END_DECLS
+
+#endif
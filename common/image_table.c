@@ -0,0 +1,430 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spice_common.h"
+#include "image_table.h"
+#include "canvas_utils.h"
+#include "mem.h"
+
+#define IMAGE_TABLE_MIN_BUCKETS 64
+
+struct ImageTableEntry {
+    RingItem lru_link;                  // must be first
+    ImageTableEntry *next;              // in the hash bucket
+    ImageTable *table;
+    uint64_t key;
+    pixman_image_t *image;
+    pixman_format_code_t format;
+    uint64_t size;
+    uint32_t flags;
+    int shared;                         // the image is one returned for an entry of another table
+    int refs;                           // the table and the images returned for the entry,
+                                        // protected by the table lock
+};
+
+/* destroy data of the images returned for an entry, it starts with the PixmanData of the
+   image of the entry so that spice_pixman_image_get_format() works on them. Its data
+   points to the ImageTableRef itself, which tells these images apart from the others */
+typedef struct ImageTableRef {
+    PixmanData pixman_data;
+    ImageTableEntry *entry;
+} ImageTableRef;
+
+static INLINE ImageTableEntry **image_table_get_bucket(ImageTable *table, uint64_t key)
+{
+    return &table->buckets[(key * 0x9e3779b97f4a7c15ULL) >> 32 & (table->n_buckets - 1)];
+}
+
+static ImageTableRef *image_table_get_ref(pixman_image_t *image)
+{
+    PixmanData *data = (PixmanData *)pixman_image_get_destroy_data(image);
+
+    if (data == NULL || data->data != (uint8_t *)data) {
+        return NULL;
+    }
+    return (ImageTableRef *)data;
+}
+
+static void image_table_entry_free(ImageTableEntry *entry)
+{
+    pixman_image_unref(entry->image);
+    free(entry);
+}
+
+static ImageTableEntry *image_table_find(ImageTable *table, uint64_t key,
+                                         ImageTableMatchFunc match, pixman_image_t *image)
+{
+    ImageTableEntry *entry = *image_table_get_bucket(table, key);
+
+    while (entry && (entry->key != key || (match && !match(image, entry->image)))) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+static void image_table_grow(ImageTable *table)
+{
+    ImageTableEntry **old_buckets = table->buckets;
+    uint32_t old_n_buckets = table->n_buckets;
+    uint32_t i;
+
+    table->n_buckets *= 2;
+    table->buckets = spice_new0(ImageTableEntry *, table->n_buckets);
+    for (i = 0; i < old_n_buckets; i++) {
+        ImageTableEntry *entry = old_buckets[i];
+
+        while (entry) {
+            ImageTableEntry *next = entry->next;
+            ImageTableEntry **bucket = image_table_get_bucket(table, entry->key);
+
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(old_buckets);
+}
+
+static void image_table_free_unlinked(Ring *unlinked)
+{
+    RingItem *item;
+
+    while ((item = ring_get_head(unlinked))) {
+        ring_remove(item);
+        image_table_entry_free((ImageTableEntry *)item);
+    }
+}
+
+/* Takes the entry out of the table, and puts it in unlinked if it isn't used anymore. The
+   entries are freed outside of the lock by image_table_free_unlinked() */
+static void image_table_unlink(ImageTable *table, ImageTableEntry *entry, Ring *unlinked)
+{
+    ImageTableEntry **link = image_table_get_bucket(table, entry->key);
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    ring_remove(&entry->lru_link);
+    table->n_entries--;
+    table->bytes -= entry->size;
+    if (entry->shared) {
+        table->shared_bytes -= entry->size;
+    }
+    if (--entry->refs == 0) {
+        table->n_live--;
+        ring_add(unlinked, &entry->lru_link);
+    }
+}
+
+static void image_table_release_ref(pixman_image_t *image, void *data)
+{
+    ImageTableRef *ref = (ImageTableRef *)data;
+    ImageTableEntry *entry = ref->entry;
+    ImageTable *table = entry->table;
+    int last;
+
+    MUTEX_LOCK(table->lock);
+    if ((last = --entry->refs == 0)) {
+        table->n_live--;
+    }
+    MUTEX_UNLOCK(table->lock);
+    if (last) {
+        image_table_entry_free(entry);
+    }
+    free(ref);
+}
+
+/* entry->refs must already account for the returned image */
+static pixman_image_t *image_table_new_ref(ImageTableEntry *entry)
+{
+    ImageTableRef *ref;
+    pixman_image_t *image;
+
+    image = pixman_image_create_bits(entry->format,
+                                     pixman_image_get_width(entry->image),
+                                     pixman_image_get_height(entry->image),
+                                     pixman_image_get_data(entry->image),
+                                     pixman_image_get_stride(entry->image));
+    if (image == NULL) {
+        spice_error("create surface failed, out of memory");
+    }
+    ref = spice_new0(ImageTableRef, 1);
+    ref->pixman_data = *(PixmanData *)pixman_image_get_destroy_data(entry->image);
+    ref->pixman_data.data = (uint8_t *)ref;
+    ref->entry = entry;
+    pixman_image_set_destroy_function(image, image_table_release_ref, ref);
+
+    return image;
+}
+
+/* A copy of image only referenced by the caller */
+static pixman_image_t *image_table_copy(pixman_image_t *image, pixman_format_code_t format)
+{
+    int width = pixman_image_get_width(image);
+    int height = pixman_image_get_height(image);
+    int src_stride = pixman_image_get_stride(image);
+    int stride = abs(src_stride);
+    uint8_t *src = (uint8_t *)pixman_image_get_data(image);
+    uint8_t *data = (uint8_t *)spice_malloc_n(stride, height);
+    pixman_image_t *copy;
+    int y;
+
+    for (y = 0; y < height; y++) {
+        memcpy(data + y * stride, src + y * src_stride, stride);
+    }
+    copy = pixman_image_create_bits(format, width, height, (uint32_t *)data, stride);
+    if (copy == NULL) {
+        spice_error("create surface failed, out of memory");
+    }
+    spice_pixman_image_set_format(copy, format);
+    ((PixmanData *)pixman_image_get_destroy_data(copy))->data = data;
+    return copy;
+}
+
+void image_table_init(ImageTable *table, uint64_t max_bytes)
+{
+    memset(table, 0, sizeof(*table));
+    MUTEX_INIT(table->lock);
+    table->n_buckets = IMAGE_TABLE_MIN_BUCKETS;
+    table->buckets = spice_new0(ImageTableEntry *, table->n_buckets);
+    ring_init(&table->lru);
+    table->max_bytes = max_bytes;
+}
+
+void image_table_destroy(ImageTable *table)
+{
+    image_table_clear(table);
+    MUTEX_DESTROY(table->lock);
+    free(table->buckets);
+}
+
+pixman_image_t *image_table_get(ImageTable *table, uint64_t key,
+                                ImageTableMatchFunc match, pixman_image_t *image,
+                                uint32_t *flags)
+{
+    ImageTableEntry *entry;
+
+    MUTEX_LOCK(table->lock);
+    if (!(entry = image_table_find(table, key, match, image))) {
+        table->misses++;
+        MUTEX_UNLOCK(table->lock);
+        return NULL;
+    }
+    table->hits++;
+    table->hit_bytes += entry->size;
+    ring_remove(&entry->lru_link);
+    ring_add(&table->lru, &entry->lru_link);
+    entry->refs++;
+    if (flags) {
+        *flags = entry->flags;
+    }
+    MUTEX_UNLOCK(table->lock);
+
+    return image_table_new_ref(entry);
+}
+
+/* Adds an entry for image, which only the table references. refs counts the table
+   and the images the caller will have for the entry */
+static ImageTableEntry *image_table_insert(ImageTable *table, uint64_t key,
+                                           pixman_image_t *image, pixman_format_code_t format,
+                                           uint32_t flags, int replace, int shared, int refs)
+{
+    ImageTableEntry *entry;
+    ImageTableEntry *old;
+    ImageTableEntry **bucket;
+    Ring unlinked;
+
+    entry = spice_new0(ImageTableEntry, 1);
+    entry->table = table;
+    entry->key = key;
+    entry->image = image;
+    entry->format = format;
+    entry->size = (uint64_t)abs(pixman_image_get_stride(image)) * pixman_image_get_height(image);
+    entry->flags = flags;
+    entry->shared = shared;
+    entry->refs = refs;
+
+    ring_init(&unlinked);
+    MUTEX_LOCK(table->lock);
+    if (replace && (old = image_table_find(table, key, NULL, NULL))) {
+        image_table_unlink(table, old, &unlinked);
+    }
+    if (table->n_entries >= table->n_buckets) {
+        image_table_grow(table);
+    }
+    bucket = image_table_get_bucket(table, key);
+    entry->next = *bucket;
+    *bucket = entry;
+    ring_add(&table->lru, &entry->lru_link);
+    table->n_entries++;
+    table->n_live++;
+    table->bytes += entry->size;
+    if (shared) {
+        table->shared_bytes += entry->size;
+    }
+
+    while (table->max_bytes && table->bytes > table->max_bytes) {
+        ImageTableEntry *lru = (ImageTableEntry *)ring_get_tail(&table->lru);
+
+        if (lru == entry) {
+            break;
+        }
+        table->evictions++;
+        image_table_unlink(table, lru, &unlinked);
+    }
+    MUTEX_UNLOCK(table->lock);
+
+    image_table_free_unlinked(&unlinked);
+    return entry;
+}
+
+pixman_image_t *image_table_put(ImageTable *table, uint64_t key, pixman_image_t *image,
+                                uint32_t flags, int replace)
+{
+    pixman_format_code_t format;
+    ImageTableEntry *entry;
+
+    if (!spice_pixman_image_get_format(image, &format)) {
+        return NULL;
+    }
+    entry = image_table_insert(table, key, image, format, flags, replace, FALSE, 2);
+    return image_table_new_ref(entry);
+}
+
+void image_table_put_shared(ImageTable *table, uint64_t key, pixman_image_t *image,
+                            uint32_t flags, int replace)
+{
+    pixman_format_code_t format;
+    pixman_image_t *entry_image;
+    PixmanData *data;
+    ImageTableRef *ref;
+
+    if (!spice_pixman_image_get_format(image, &format)) {
+        return;
+    }
+    data = (PixmanData *)pixman_image_get_destroy_data(image);
+
+    if ((ref = image_table_get_ref(image))) {
+        /* image comes from a table, the entry gets another image of that entry */
+        ImageTableEntry *shared = ref->entry;
+
+        MUTEX_LOCK(shared->table->lock);
+        shared->refs++;
+        MUTEX_UNLOCK(shared->table->lock);
+        image_table_insert(table, key, image_table_new_ref(shared), format, flags, replace,
+                           TRUE, 1);
+    } else if (data->data != NULL
+#ifdef WIN32
+               && data->bitmap == NULL
+#endif
+               ) {
+        /* the bits image owns are handed over to the image of the entry, and image
+           becomes one of the images returned for the entry */
+        entry_image = pixman_image_create_bits(format,
+                                               pixman_image_get_width(image),
+                                               pixman_image_get_height(image),
+                                               pixman_image_get_data(image),
+                                               pixman_image_get_stride(image));
+        if (entry_image == NULL) {
+            spice_error("create surface failed, out of memory");
+        }
+        spice_pixman_image_set_format(entry_image, format);
+        ((PixmanData *)pixman_image_get_destroy_data(entry_image))->data = data->data;
+
+        ref = spice_new0(ImageTableRef, 1);
+        ref->pixman_data = *data;
+        ref->pixman_data.data = (uint8_t *)ref;
+        pixman_image_set_destroy_function(image, image_table_release_ref, ref);
+        free(data);
+        ref->entry = image_table_insert(table, key, entry_image, format, flags, replace,
+                                        FALSE, 2);
+    } else {
+        image_table_insert(table, key, image_table_copy(image, format), format, flags,
+                           replace, FALSE, 1);
+    }
+}
+
+void image_table_remove(ImageTable *table, uint64_t key)
+{
+    ImageTableEntry *entry;
+    Ring unlinked;
+
+    ring_init(&unlinked);
+    MUTEX_LOCK(table->lock);
+    if ((entry = image_table_find(table, key, NULL, NULL))) {
+        image_table_unlink(table, entry, &unlinked);
+    }
+    MUTEX_UNLOCK(table->lock);
+
+    image_table_free_unlinked(&unlinked);
+}
+
+void image_table_clear(ImageTable *table)
+{
+    Ring unlinked;
+    RingItem *item;
+
+    ring_init(&unlinked);
+    MUTEX_LOCK(table->lock);
+    while ((item = ring_get_head(&table->lru))) {
+        image_table_unlink(table, (ImageTableEntry *)item, &unlinked);
+    }
+    MUTEX_UNLOCK(table->lock);
+
+    image_table_free_unlinked(&unlinked);
+}
+
+int image_table_in_use(ImageTable *table)
+{
+    int in_use;
+
+    MUTEX_LOCK(table->lock);
+    in_use = table->n_live != 0;
+    MUTEX_UNLOCK(table->lock);
+    return in_use;
+}
+
+void image_table_get_stats(ImageTable *table, ImageTableStats *stats)
+{
+    MUTEX_LOCK(table->lock);
+    stats->hits += table->hits;
+    stats->hit_bytes += table->hit_bytes;
+    stats->misses += table->misses;
+    stats->evictions += table->evictions;
+    stats->n_images += table->n_entries;
+    stats->bytes += table->bytes;
+    stats->shared_bytes += table->shared_bytes;
+    MUTEX_UNLOCK(table->lock);
+}
+
+void image_table_reset_stats(ImageTable *table)
+{
+    MUTEX_LOCK(table->lock);
+    table->hits = 0;
+    table->hit_bytes = 0;
+    table->misses = 0;
+    table->evictions = 0;
+    MUTEX_UNLOCK(table->lock);
+}
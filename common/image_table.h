@@ -0,0 +1,114 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_IMAGE_TABLE
+#define _H_IMAGE_TABLE
+
+#include <stdint.h>
+#include <pixman.h>
+#include <spice/macros.h>
+
+#include "mutex.h"
+#include "ring.h"
+
+SPICE_BEGIN_DECLS
+
+/* A locked table of pixman images used by several threads, behind image_cache.c
+   and image_dedup.c.
+
+   Entries are found by a 64 bit key, and optionally by comparing their image
+   with a given one. pixman reference counts aren't atomic, so the image of an
+   entry is only referenced by the table: get() and put() return a new pixman
+   image using its bits, that the caller can unref on any thread, and the image
+   of the entry is released once the entry left the table and all the images
+   returned for it were unreferenced. Entries are never modified, replacing one
+   inserts a new entry.
+
+   max_bytes bounds the size of the images of the table, the least recently
+   used ones are evicted first. 0 is no limit. */
+
+typedef struct ImageTableEntry ImageTableEntry;
+
+typedef struct ImageTable {
+    mutex_t lock;
+    ImageTableEntry **buckets;
+    uint32_t n_buckets;                 // power of 2
+    uint32_t n_entries;
+    uint32_t n_live;                    // entries not freed yet, in the table or not
+    Ring lru;                           // most recently used first
+    uint64_t bytes;
+    uint64_t shared_bytes;
+    uint64_t max_bytes;
+    uint64_t hits;
+    uint64_t hit_bytes;
+    uint64_t misses;
+    uint64_t evictions;
+} ImageTable;
+
+typedef struct ImageTableStats {
+    uint64_t hits;
+    uint64_t hit_bytes;                 // size of the images found by get()
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t n_images;
+    uint64_t bytes;
+    uint64_t shared_bytes;              // of the entries put with the image of another table
+} ImageTableStats;
+
+/* Returns TRUE if the image given to image_table_get() matches the image of
+   an entry with the same key. Called with the table locked */
+typedef int (*ImageTableMatchFunc)(pixman_image_t *image, pixman_image_t *entry_image);
+
+void image_table_init(ImageTable *table, uint64_t max_bytes);
+void image_table_destroy(ImageTable *table);
+
+/* Returns an image using the bits of the entry of key, or NULL. match and
+   image may be NULL to only compare the keys. flags, if not NULL, gets the
+   flags the entry was put with */
+pixman_image_t *image_table_get(ImageTable *table, uint64_t key,
+                                ImageTableMatchFunc match, pixman_image_t *image,
+                                uint32_t *flags);
+
+/* Takes over image, whose only reference must be the caller's, and returns an
+   image using its bits. With replace, the entry of key is removed first.
+   Returns NULL, leaving image to the caller, if its format is unknown */
+pixman_image_t *image_table_put(ImageTable *table, uint64_t key, pixman_image_t *image,
+                                uint32_t flags, int replace);
+
+/* Like image_table_put(), but image stays the caller's and must only be used by
+   the calling thread. The entry shares the bits of image: if image was returned by
+   an image table, the entry references the entry of image, which must outlive
+   table. Else if image owns its bits, they are handed over to the entry and image
+   becomes one of the images returned for it. Else the entry gets a copy */
+void image_table_put_shared(ImageTable *table, uint64_t key, pixman_image_t *image,
+                            uint32_t flags, int replace);
+
+void image_table_remove(ImageTable *table, uint64_t key);
+void image_table_clear(ImageTable *table);
+
+/* Returns TRUE while an image put in or returned by table is referenced, in which
+   case table must not be destroyed */
+int image_table_in_use(ImageTable *table);
+
+/* Adds the counters of table to stats */
+void image_table_get_stats(ImageTable *table, ImageTableStats *stats);
+void image_table_reset_stats(ImageTable *table);
+
+SPICE_END_DECLS
+
+#endif
@@ -21,17 +21,46 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/time.h>
+#define SPICE_LOG_HAVE_ASYNC
+#endif
 
 #include "log.h"
 #include "backtrace.h"
 
+/* Records longer than this are truncated */
+#define SPICE_LOG_RECORD_SIZE 1024
+/* Maximum number of domains that can have a level of their own */
+#define SPICE_LOG_MAX_DOMAINS 32
+
+typedef struct SpiceLogDomain {
+    const char *name;
+    int level;
+} SpiceLogDomain;
+
+/* Highest level enabled for any domain, checked by the logging macros before
+ * calling into spice_log(). Everything goes through until the levels have
+ * been read from the environment. */
+int spice_log_max_level = SPICE_LOG_LEVEL_DEBUG;
+
 static int debug_level = -1;
 static int abort_level = -1;
 
+/* Domains are only ever appended, and an entry is complete before
+ * n_log_domains is bumped, so lookups don't need to take a lock */
+static SpiceLogDomain log_domains[SPICE_LOG_MAX_DOMAINS];
+static volatile int n_log_domains;
+
+/* "(prog:pid): ", computed once instead of for every message */
+static char log_prefix[128];
+
 static const char * spice_log_level_to_string(SpiceLogLevel level)
 {
 #ifdef _MSC_VER
@@ -68,6 +97,364 @@ static const char * spice_log_level_to_string(SpiceLogLevel level)
 #endif
 #endif
 
+static void log_write(const char *buf, int len)
+{
+    /* stderr is unbuffered, a single call keeps lines from different
+     * threads from being interleaved */
+    fwrite(buf, 1, len, stderr);
+}
+
+#ifdef SPICE_LOG_HAVE_ASYNC
+
+/* Asynchronous mode: records are formatted by the calling thread and pushed
+ * to a bounded multi-producer ring, a writer thread drains it to stderr.
+ * Producers never take a lock, the writer only has to be woken up when it
+ * went idle. When the ring is full, the record is written synchronously. */
+
+#define SPICE_LOG_RING_SIZE 256 /* must be a power of 2 */
+#define SPICE_LOG_RING_MASK (SPICE_LOG_RING_SIZE - 1)
+#define SPICE_LOG_IDLE_TIMEOUT_MS 100
+
+typedef struct SpiceLogRecord {
+    /* == position: free for the producer reserving position,
+     * == position + 1: filled, ready to be written */
+    volatile unsigned int seq;
+    int len;
+    char data[SPICE_LOG_RECORD_SIZE];
+} SpiceLogRecord;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+static SpiceLogRecord *log_ring;
+static volatile unsigned int log_ring_head;
+static unsigned int log_ring_tail;
+static volatile int log_async;
+static volatile int log_writer_idle;
+static int log_writer_running;
+static pthread_t log_writer;
+
+static int log_ring_push(const char *buf, int len)
+{
+    SpiceLogRecord *record;
+    unsigned int pos;
+    int diff;
+
+    if (len > SPICE_LOG_RECORD_SIZE) {
+        return FALSE;
+    }
+
+    for (;;) {
+        pos = log_ring_head;
+        record = &log_ring[pos & SPICE_LOG_RING_MASK];
+        diff = (int)(record->seq - pos);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&log_ring_head, pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* full */
+            return FALSE;
+        }
+    }
+
+    memcpy(record->data, buf, len);
+    record->len = len;
+    __sync_synchronize();
+    record->seq = pos + 1;
+    __sync_synchronize();
+
+    if (log_writer_idle) {
+        pthread_mutex_lock(&log_wake_lock);
+        pthread_cond_signal(&log_wake_cond);
+        pthread_mutex_unlock(&log_wake_lock);
+    }
+    return TRUE;
+}
+
+/* Writes out all the complete records, returns the number of records
+ * written. Records are batched so a burst costs a few write()s only. */
+static int log_ring_drain(void)
+{
+    char batch[8 * SPICE_LOG_RECORD_SIZE];
+    int batch_len = 0;
+    int n = 0;
+
+    pthread_mutex_lock(&log_drain_lock);
+    for (;;) {
+        SpiceLogRecord *record = &log_ring[log_ring_tail & SPICE_LOG_RING_MASK];
+
+        if (record->seq != log_ring_tail + 1) {
+            break;
+        }
+        __sync_synchronize();
+        if (batch_len + record->len > (int)sizeof(batch)) {
+            log_write(batch, batch_len);
+            batch_len = 0;
+        }
+        memcpy(batch + batch_len, record->data, record->len);
+        batch_len += record->len;
+        __sync_synchronize();
+        record->seq = log_ring_tail + SPICE_LOG_RING_SIZE;
+        log_ring_tail++;
+        n++;
+    }
+    if (batch_len) {
+        log_write(batch, batch_len);
+    }
+    pthread_mutex_unlock(&log_drain_lock);
+
+    return n;
+}
+
+static void *log_writer_thread(void *opaque)
+{
+    for (;;) {
+        struct timeval now;
+        struct timespec timeout;
+
+        if (log_ring_drain()) {
+            continue;
+        }
+
+        pthread_mutex_lock(&log_wake_lock);
+        log_writer_idle = TRUE;
+        __sync_synchronize();
+        if (log_ring[log_ring_tail & SPICE_LOG_RING_MASK].seq != log_ring_tail + 1) {
+            /* the timeout covers a producer missing log_writer_idle */
+            gettimeofday(&now, NULL);
+            timeout.tv_sec = now.tv_sec;
+            timeout.tv_nsec = now.tv_usec * 1000 + SPICE_LOG_IDLE_TIMEOUT_MS * 1000000;
+            if (timeout.tv_nsec >= 1000000000) {
+                timeout.tv_sec++;
+                timeout.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&log_wake_cond, &log_wake_lock, &timeout);
+        }
+        log_writer_idle = FALSE;
+        pthread_mutex_unlock(&log_wake_lock);
+    }
+
+    return NULL;
+}
+
+static void log_async_start(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&log_lock);
+    if (!log_ring) {
+        log_ring = calloc(SPICE_LOG_RING_SIZE, sizeof(*log_ring));
+        if (!log_ring) {
+            pthread_mutex_unlock(&log_lock);
+            return;
+        }
+        for (i = 0; i < SPICE_LOG_RING_SIZE; i++) {
+            log_ring[i].seq = i;
+        }
+    }
+    if (!log_writer_running) {
+        log_writer_running = pthread_create(&log_writer, NULL,
+                                            log_writer_thread, NULL) == 0;
+        if (log_writer_running) {
+            pthread_detach(log_writer);
+        }
+    }
+    log_async = log_writer_running;
+    pthread_mutex_unlock(&log_lock);
+}
+
+#endif /* SPICE_LOG_HAVE_ASYNC */
+
+static void log_update_prefix(void)
+{
+    snprintf(log_prefix, sizeof(log_prefix), "(%s:%d): ", getenv("_"), getpid());
+}
+
+static void log_update_max_level(void)
+{
+    int max_level = debug_level;
+    int i;
+
+    for (i = 0; i < n_log_domains; i++) {
+        max_level = MAX(max_level, log_domains[i].level);
+    }
+    spice_log_max_level = max_level;
+}
+
+static SpiceLogDomain *log_find_domain(const char *log_domain)
+{
+    int i;
+
+    for (i = 0; i < n_log_domains; i++) {
+        if (strcmp(log_domains[i].name, log_domain) == 0) {
+            return &log_domains[i];
+        }
+    }
+    return NULL;
+}
+
+static void log_set_domain_level(const char *log_domain, int level)
+{
+    SpiceLogDomain *domain = log_find_domain(log_domain);
+
+    if (!domain) {
+        if (n_log_domains == SPICE_LOG_MAX_DOMAINS) {
+            return;
+        }
+        domain = &log_domains[n_log_domains];
+        domain->name = strdup(log_domain);
+        if (!domain->name) {
+            return;
+        }
+        domain->level = level;
+        __sync_synchronize();
+        n_log_domains++;
+    } else {
+        domain->level = level;
+    }
+}
+
+/* SPICE_LOG_LEVELS is a comma separated list of domain=level entries */
+static void log_parse_domain_levels(const char *levels)
+{
+    char *str, *entry, *next, *eq;
+
+    str = strdup(levels);
+    if (!str) {
+        return;
+    }
+    for (entry = str; entry; entry = next) {
+        next = strchr(entry, ',');
+        if (next) {
+            *next++ = '\0';
+        }
+        eq = strchr(entry, '=');
+        if (!eq || eq == entry) {
+            continue;
+        }
+        *eq = '\0';
+        log_set_domain_level(entry, atoi(eq + 1));
+    }
+    free(str);
+}
+
+#ifdef SPICE_LOG_HAVE_ASYNC
+static void log_atfork_child(void)
+{
+    unsigned int i;
+
+    /* the writer thread is gone, and the locks might be held by it */
+    pthread_mutex_init(&log_lock, NULL);
+    pthread_mutex_init(&log_drain_lock, NULL);
+    pthread_mutex_init(&log_wake_lock, NULL);
+    pthread_cond_init(&log_wake_cond, NULL);
+    log_writer_running = FALSE;
+    log_writer_idle = FALSE;
+    if (log_ring) {
+        log_ring_head = log_ring_tail = 0;
+        for (i = 0; i < SPICE_LOG_RING_SIZE; i++) {
+            log_ring[i].seq = i;
+        }
+    }
+    log_update_prefix();
+    if (log_async) {
+        log_async_start();
+    }
+}
+#endif
+
+static void log_init(void)
+{
+    const char *env;
+
+    debug_level = getenv("SPICE_DEBUG_LEVEL") ? atoi(getenv("SPICE_DEBUG_LEVEL")) : SPICE_LOG_LEVEL_WARNING;
+    abort_level = getenv("SPICE_ABORT_LEVEL") ? atoi(getenv("SPICE_ABORT_LEVEL")) : SPICE_ABORT_LEVEL_DEFAULT;
+    env = getenv("SPICE_LOG_LEVELS");
+    if (env) {
+        log_parse_domain_levels(env);
+    }
+    log_update_prefix();
+    log_update_max_level();
+
+#ifdef SPICE_LOG_HAVE_ASYNC
+    pthread_atfork(NULL, NULL, log_atfork_child);
+    atexit(spice_log_flush);
+    env = getenv("SPICE_LOG_ASYNC");
+    if (env && atoi(env)) {
+        log_async_start();
+    }
+#endif
+}
+
+static void log_ensure_init(void)
+{
+#ifdef SPICE_LOG_HAVE_ASYNC
+    pthread_once(&log_once, log_init);
+#else
+    if (debug_level == -1) {
+        log_init();
+    }
+#endif
+}
+
+void spice_log_set_level(const char *log_domain, SpiceLogLevel log_level)
+{
+    log_ensure_init();
+
+#ifdef SPICE_LOG_HAVE_ASYNC
+    pthread_mutex_lock(&log_lock);
+#endif
+    if (log_domain) {
+        log_set_domain_level(log_domain, log_level);
+    } else {
+        debug_level = log_level;
+    }
+    log_update_max_level();
+#ifdef SPICE_LOG_HAVE_ASYNC
+    pthread_mutex_unlock(&log_lock);
+#endif
+}
+
+void spice_log_set_async(int async)
+{
+    log_ensure_init();
+
+#ifdef SPICE_LOG_HAVE_ASYNC
+    if (async) {
+        log_async_start();
+    } else {
+        log_async = FALSE;
+        spice_log_flush();
+    }
+#endif
+}
+
+void spice_log_flush(void)
+{
+#ifdef SPICE_LOG_HAVE_ASYNC
+    if (log_ring) {
+        log_ring_drain();
+    }
+#endif
+}
+
+static int log_domain_level(const char *log_domain)
+{
+    SpiceLogDomain *domain;
+
+    if (log_domain && n_log_domains) {
+        domain = log_find_domain(log_domain);
+        if (domain) {
+            return domain->level;
+        }
+    }
+    return debug_level;
+}
+
 void spice_logv(const char *log_domain,
                 SpiceLogLevel log_level,
                 const char *strloc,
@@ -76,38 +463,51 @@ void spice_logv(const char *log_domain,
                 va_list args)
 {
     const char *level = spice_log_level_to_string(log_level);
-    
-    if (debug_level == -1) {
-        debug_level = getenv("SPICE_DEBUG_LEVEL") ? atoi(getenv("SPICE_DEBUG_LEVEL")) : SPICE_LOG_LEVEL_WARNING;
-    }
-    if (abort_level == -1) {
-        abort_level = getenv("SPICE_ABORT_LEVEL") ? atoi(getenv("SPICE_ABORT_LEVEL")) : SPICE_ABORT_LEVEL_DEFAULT;
-    }
+    char buf[SPICE_LOG_RECORD_SIZE];
+    int len, n;
 
-    if (debug_level < log_level)
-        return;
+    log_ensure_init();
 
-    fprintf(stderr, "(%s:%d): ", getenv("_"), getpid());
+    if (log_domain_level(log_domain) < (int)log_level)
+        return;
 
-    if (log_domain) {
-        fprintf(stderr, "%s-", log_domain);
-    }
-    if (level) {
-        fprintf(stderr, "%s **: ", level);
+    len = snprintf(buf, sizeof(buf), "%s%s%s%s%s%s%s%s",
+                   log_prefix,
+                   log_domain ? log_domain : "", log_domain ? "-" : "",
+                   level ? level : "", level ? " **: " : "",
+                   strloc && function ? strloc : "",
+                   strloc && function ? ":" : "",
+                   strloc && function ? function : "");
+    if (len >= 0 && strloc && function && len < (int)sizeof(buf)) {
+        len += snprintf(buf + len, sizeof(buf) - len, ": ");
     }
-    if (strloc && function) {
-        fprintf(stderr, "%s:%s: ", strloc, function);
+    if (len >= 0 && format && len < (int)sizeof(buf)) {
+        n = vsnprintf(buf + len, sizeof(buf) - len, format, args);
+        if (n > 0) {
+            len += n;
+        }
     }
-    if (format) {
-        vfprintf(stderr, format, args);
+    if (len < 0) {
+        return;
     }
-
-    fprintf(stderr, "\n");
+    /* truncate, keeping room for the newline */
+    len = MIN(len, (int)sizeof(buf) - 1);
+    buf[len++] = '\n';
 
     if (abort_level != -1 && abort_level >= log_level) {
+        /* make sure everything logged before the fatal message is out */
+        spice_log_flush();
+        log_write(buf, len);
         spice_backtrace();
         abort();
     }
+
+#ifdef SPICE_LOG_HAVE_ASYNC
+    if (log_async && log_ring_push(buf, len)) {
+        return;
+    }
+#endif
+    log_write(buf, len);
 }
 
 void spice_log(const char *log_domain,
@@ -123,3 +523,17 @@ void spice_log(const char *log_domain,
     spice_logv (log_domain, log_level, strloc, function, format, args);
     va_end (args);
 }
+
+void spice_log_failure(const char *log_domain,
+                       SpiceLogLevel log_level,
+                       const char *strloc,
+                       const char *function,
+                       const char *format,
+                       ...)
+{
+    va_list args;
+
+    va_start (args, format);
+    spice_logv (log_domain, log_level, strloc, function, format, args);
+    va_end (args);
+}
@@ -55,10 +55,51 @@ void spice_log(const char *log_domain,
                const char *format,
                ...) SPICE_ATTR_PRINTF(5, 6);
 
+/* Same as spice_log(), for the failure branch of the checks below. It is
+ * cold so that the checks cost no more than a predicted branch. */
+void spice_log_failure(const char *log_domain,
+                       SpiceLogLevel log_level,
+                       const char *strloc,
+                       const char *function,
+                       const char *format,
+                       ...) SPICE_ATTR_PRINTF(5, 6) SPICE_ATTR_COLD;
+
+/* Messages less severe than SPICE_LOG_MIN_LEVEL are compiled out, eg build
+ * with -DSPICE_LOG_MIN_LEVEL=SPICE_LOG_LEVEL_WARNING to drop the debug and
+ * info ones. The statements are still parsed so their arguments don't end
+ * up unused. */
+#ifndef SPICE_LOG_MIN_LEVEL
+#define SPICE_LOG_MIN_LEVEL SPICE_LOG_LEVEL_DEBUG
+#endif
+
+/* Highest level enabled in any domain, maintained by log.c. The logging
+ * macros compare against it so that disabled messages don't cost a call. */
+extern int spice_log_max_level;
+
+#define spice_log_compiled(level)                               \
+    ((int)(level) <= (int)(SPICE_LOG_MIN_LEVEL))
+
+#define spice_log_enabled(level)                                \
+    (spice_log_compiled(level) && (int)(level) <= spice_log_max_level)
+
+/* Sets the level of @log_domain, or the default level if it's NULL. The
+ * initial levels come from SPICE_DEBUG_LEVEL and from SPICE_LOG_LEVELS, a
+ * comma separated list of domain=level pairs. */
+void spice_log_set_level(const char *log_domain, SpiceLogLevel log_level);
+
+/* When enabled, records are written to stderr by a background thread instead
+ * of the logging one. Also enabled by setting SPICE_LOG_ASYNC=1. */
+void spice_log_set_async(int async);
+
+/* Writes out all the records queued so far */
+void spice_log_flush(void);
+
+/* Failed checks may abort, so they are kept whatever SPICE_LOG_MIN_LEVEL */
 #ifndef spice_return_if_fail
 #define spice_return_if_fail(x) SPICE_STMT_START {                      \
     if SPICE_LIKELY(x) { } else {                                       \
-        spice_log(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_CRITICAL, SPICE_STRLOC, __FUNCTION__, "condition `%s' failed", #x); \
+        spice_log_failure(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_CRITICAL, SPICE_STRLOC, __FUNCTION__, \
+                          "condition `%s' failed", #x);                 \
         return;                                                         \
     }                                                                   \
 } SPICE_STMT_END
@@ -67,7 +108,8 @@ void spice_log(const char *log_domain,
 #ifndef spice_return_val_if_fail
 #define spice_return_val_if_fail(x, val) SPICE_STMT_START {             \
     if SPICE_LIKELY(x) { } else {                                       \
-        spice_log(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_CRITICAL, SPICE_STRLOC, __FUNCTION__, "condition `%s' failed", #x); \
+        spice_log_failure(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_CRITICAL, SPICE_STRLOC, __FUNCTION__, \
+                          "condition `%s' failed", #x);                 \
         return (val);                                                   \
     }                                                                   \
 } SPICE_STMT_END
@@ -75,7 +117,10 @@ void spice_log(const char *log_domain,
 
 #ifndef spice_warn_if_reached
 #define spice_warn_if_reached() SPICE_STMT_START {                      \
-    spice_log(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_WARNING, SPICE_STRLOC, __FUNCTION__, "should not be reached"); \
+    if (spice_log_compiled(SPICE_LOG_LEVEL_WARNING)) {                  \
+        spice_log_failure(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_WARNING, SPICE_STRLOC, __FUNCTION__, \
+                          "should not be reached");                     \
+    }                                                                   \
 } SPICE_STMT_END
 #endif
 
@@ -87,19 +132,25 @@ void spice_log(const char *log_domain,
 
 #ifndef spice_info
 #define spice_info(format, ...) SPICE_STMT_START {                     \
-    spice_log(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_INFO, SPICE_STRLOC, __FUNCTION__, format, ## __VA_ARGS__); \
+    if (spice_log_enabled(SPICE_LOG_LEVEL_INFO)) {                      \
+        spice_log(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_INFO, SPICE_STRLOC, __FUNCTION__, format, ## __VA_ARGS__); \
+    }                                                                   \
 } SPICE_STMT_END
 #endif
 
 #ifndef spice_debug
 #define spice_debug(format, ...) SPICE_STMT_START {                     \
-    spice_log(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_DEBUG, SPICE_STRLOC, __FUNCTION__, format, ## __VA_ARGS__); \
+    if (spice_log_enabled(SPICE_LOG_LEVEL_DEBUG)) {                     \
+        spice_log(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_DEBUG, SPICE_STRLOC, __FUNCTION__, format, ## __VA_ARGS__); \
+    }                                                                   \
 } SPICE_STMT_END
 #endif
 
 #ifndef spice_warning
 #define spice_warning(format, ...) SPICE_STMT_START {                   \
-    spice_log(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_WARNING, SPICE_STRLOC, __FUNCTION__, format, ## __VA_ARGS__); \
+    if (spice_log_enabled(SPICE_LOG_LEVEL_WARNING)) {                   \
+        spice_log(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_WARNING, SPICE_STRLOC, __FUNCTION__, format, ## __VA_ARGS__); \
+    }                                                                   \
 } SPICE_STMT_END
 #endif
 
@@ -116,26 +167,33 @@ void spice_log(const char *log_domain,
 #endif
 
 #ifndef spice_warn_if_fail
-#define spice_warn_if_fail(x) SPICE_STMT_START {        \
-    if SPICE_LIKELY(x) { } else {                       \
-        spice_warning("condition `%s' failed", #x);     \
-    }                                                   \
+#define spice_warn_if_fail(x) SPICE_STMT_START {                        \
+    if SPICE_LIKELY(x) { } else {                                       \
+        if (spice_log_compiled(SPICE_LOG_LEVEL_WARNING)) {              \
+            spice_log_failure(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_WARNING, SPICE_STRLOC, __FUNCTION__, \
+                              "condition `%s' failed", #x);             \
+        }                                                               \
+    }                                                                   \
 } SPICE_STMT_END
 #endif
 
 #ifndef spice_warn_if
-#define spice_warn_if(x) SPICE_STMT_START {             \
-    if SPICE_UNLIKELY(x) {                              \
-        spice_warning("condition `%s' reached", #x);    \
-    }                                                   \
+#define spice_warn_if(x) SPICE_STMT_START {                             \
+    if SPICE_UNLIKELY(x) {                                              \
+        if (spice_log_compiled(SPICE_LOG_LEVEL_WARNING)) {              \
+            spice_log_failure(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_WARNING, SPICE_STRLOC, __FUNCTION__, \
+                              "condition `%s' reached", #x);            \
+        }                                                               \
+    }                                                                   \
 } SPICE_STMT_END
 #endif
 
 #ifndef spice_assert
-#define spice_assert(x) SPICE_STMT_START {              \
-    if SPICE_LIKELY(x) { } else {                       \
-        spice_error("assertion `%s' failed", #x);       \
-    }                                                   \
+#define spice_assert(x) SPICE_STMT_START {                              \
+    if SPICE_LIKELY(x) { } else {                                       \
+        spice_log_failure(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_ERROR, SPICE_STRLOC, __FUNCTION__, \
+                          "assertion `%s' failed", #x);                 \
+    }                                                                   \
 } SPICE_STMT_END
 #endif
 
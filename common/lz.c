@@ -47,9 +47,18 @@
 #include <config.h>
 #endif
 
+#include <setjmp.h>
+#include <limits.h>
+
 #include "spice_common.h"
 #include "lz.h"
 
+#if defined(LZ_BANDS_THREADED) && !defined(WIN32)
+#include <pthread.h>
+#else
+#undef LZ_BANDS_THREADED
+#endif
+
 #define HASH_LOG 13
 #define HASH_SIZE (1 << HASH_LOG)
 #define HASH_MASK (HASH_SIZE - 1)
@@ -64,13 +73,50 @@ struct LzImageSegment {
     LzImageSegment    *next;
 };
 
+typedef struct Encoder Encoder;
+
+// usr context of the encoders compressing/decompressing the bands of a banded stream
+typedef struct LzBandUsrContext {
+    LzUsrContext base;
+    uint8_t *buf;
+    int buf_size;
+} LzBandUsrContext;
+
+typedef struct LzBand {
+    LzBandUsrContext usr;   // first, band_usr_error gets the band from it
+    LzContext *lz;
+    Encoder *parent;
+    uint8_t *lines;         // encoding: the lines of the band
+    int num_lines;
+    uint8_t *data;          // the compressed band
+    int data_size;
+    LzImageType to_type;    // decoding: output type and buffer
+    uint8_t *out;
+
+    // errors stop the band and are raised on the calling thread once all
+    // the bands are done
+    jmp_buf jmp;
+    int failed;
+    char error[128];
+
+#ifdef LZ_BANDS_THREADED
+    // worker thread of the band, started on first use and kept until lz_destroy
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int thread_running;
+    int busy;               // the band was handed to the thread and isn't done
+    int quit;
+#endif
+} LzBand;
+
 //    TODO: pack?
 typedef struct HashEntry {
     LzImageSegment    *image_seg;
     uint8_t            *ref;
 } HashEntry;
 
-typedef struct Encoder {
+struct Encoder {
     LzUsrContext    *usr;
 
     LzImageType type;
@@ -96,7 +142,13 @@ typedef struct Encoder {
     size_t io_bytes_count;
 
     uint8_t            *io_last_copy;  // pointer to the last byte in which copy count was written
-} Encoder;
+
+    // banded streams. Bands are allocated on first use and kept for the next images
+    LzBand *bands[LZ_MAX_BANDS];
+    int n_bands;                      // number of bands of the stream being decoded, 0 if
+                                      // it isn't banded
+    int top_down;
+};
 
 /****************************************************/
 /* functions for managing the pool of image segments*/
@@ -105,6 +157,9 @@ static INLINE LzImageSegment *lz_alloc_image_seg(Encoder *encoder);
 static void lz_reset_image_seg(Encoder *encoder);
 static int lz_read_image_segments(Encoder *encoder, uint8_t *first_lines,
                                   unsigned int num_first_lines);
+static void lz_free_band(LzBand *band);
+static uint32_t lz_decode_header(Encoder *encoder, uint8_t *io_ptr, unsigned int num_io_bytes,
+                                 int *out_top_down);
 
 
 // return a free image segment if one exists. Make allocation if needed. adds it to the
@@ -327,6 +382,8 @@ static int init_encoder(Encoder *encoder, LzUsrContext *usr)
     encoder->free_image_segs = NULL;
     encoder->head_image_segs = NULL;
     encoder->tail_image_segs = NULL;
+    memset(encoder->bands, 0, sizeof(encoder->bands));
+    encoder->n_bands = 0;
     return TRUE;
 }
 
@@ -353,6 +410,7 @@ LzContext *lz_create(LzUsrContext *usr)
 void lz_destroy(LzContext *lz)
 {
     Encoder *encoder = (Encoder *)lz;
+    int i;
 
     if (!lz) {
         return;
@@ -364,6 +422,12 @@ void lz_destroy(LzContext *lz)
     }
     lz_dealloc_free_segments(encoder);
 
+    for (i = 0; i < LZ_MAX_BANDS; i++) {
+        if (encoder->bands[i]) {
+            lz_free_band(encoder->bands[i]);
+        }
+    }
+
     encoder->usr->free(encoder->usr, encoder);
 }
 
@@ -420,12 +484,22 @@ typedef uint16_t rgb16_pixel_t;
 #undef ATTR_PACKED
 
 
+/* Masks selecting, in a 64 bit word holding two pixels, the bytes that
+ * SAME_PIXEL compares, so match extension can compare several pixels at
+ * once. Built from pixel structs so they are right for either endianness. */
+static const union {
+    rgb32_pixel_t pixels[2];
+    uint64_t word;
+} lz_rgb32_word_mask = {{{0xff, 0xff, 0xff, 0x00}, {0xff, 0xff, 0xff, 0x00}}},
+  lz_rgb_alpha_word_mask = {{{0x00, 0x00, 0x00, 0xff}, {0x00, 0x00, 0x00, 0xff}}};
+
 #define MAX_COPY 32
 #define MAX_LEN 264          /* 256 + 8 */
 #define BOUND_OFFSET 2
 #define LIMIT_OFFSET 6
 #define MIN_FILE_SIZE 4
 #define COMP_LEVEL_SIZE_LIMIT 65536
+#define LZ_WILD_COPY_SIZE 16 // bytes copied at once when decompressing a match
 
 // TODO: implemented lz2. should lz1 be an option (no RLE + distance limitation of MAX_DISTANCE)
 // TODO: I think MAX_FARDISTANCE can be changed easily to 2^29
@@ -500,6 +574,388 @@ typedef uint16_t rgb16_pixel_t;
 #undef LZ_UNEXPECT_CONDITIONAL
 #undef LZ_EXPECT_CONDITIONAL
 
+/*******************************************************************
+*                banded streams
+********************************************************************/
+// bands run on worker threads, where the caller's error handler can't be
+// called: the error is kept and the band stopped, see lz_run_bands
+static void band_usr_error(LzUsrContext *usr, const char *fmt, ...)
+{
+    LzBand *band = (LzBand *)usr;
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(band->error, sizeof(band->error), fmt, ap);
+    va_end(ap);
+    band->failed = TRUE;
+    longjmp(band->jmp, 1);
+}
+
+static void band_usr_warn(LzUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    spice_logv(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_WARNING, SPICE_STRLOC, __FUNCTION__, fmt, ap);
+    va_end(ap);
+}
+
+static void band_usr_info(LzUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    spice_logv(SPICE_LOG_DOMAIN, SPICE_LOG_LEVEL_INFO, SPICE_STRLOC, __FUNCTION__, fmt, ap);
+    va_end(ap);
+}
+
+static void *band_usr_malloc(LzUsrContext *usr, int size)
+{
+    return spice_malloc(size);
+}
+
+static void band_usr_free(LzUsrContext *usr, void *ptr)
+{
+    free(ptr);
+}
+
+// the band output buffer is sized for the worst case, and when decoding the
+// whole band is given at once
+static int band_usr_more_space(LzUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+static int band_usr_more_lines(LzUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+static LzBand *lz_get_band(Encoder *encoder, int i)
+{
+    LzBand *band = encoder->bands[i];
+
+    if (!band) {
+        band = spice_new0(LzBand, 1);
+        band->usr.base.error = band_usr_error;
+        band->usr.base.warn = band_usr_warn;
+        band->usr.base.info = band_usr_info;
+        band->usr.base.malloc = band_usr_malloc;
+        band->usr.base.free = band_usr_free;
+        band->usr.base.more_space = band_usr_more_space;
+        band->usr.base.more_lines = band_usr_more_lines;
+        band->lz = lz_create(&band->usr.base);
+        band->parent = encoder;
+#ifdef LZ_BANDS_THREADED
+        pthread_mutex_init(&band->lock, NULL);
+        pthread_cond_init(&band->cond, NULL);
+#endif
+        encoder->bands[i] = band;
+    }
+    return band;
+}
+
+static void lz_free_band(LzBand *band)
+{
+#ifdef LZ_BANDS_THREADED
+    if (band->thread_running) {
+        pthread_mutex_lock(&band->lock);
+        band->quit = TRUE;
+        pthread_cond_broadcast(&band->cond);
+        pthread_mutex_unlock(&band->lock);
+        pthread_join(band->thread, NULL);
+    }
+    pthread_cond_destroy(&band->cond);
+    pthread_mutex_destroy(&band->lock);
+#endif
+    lz_destroy(band->lz);
+    free(band->usr.buf);
+    free(band);
+}
+
+static void lz_band_run(LzBand *band)
+{
+    Encoder *parent = band->parent;
+
+    band->failed = FALSE;
+    if (setjmp(band->jmp)) {
+        // the band encoder was stopped in the middle of the image
+        lz_reset_image_seg((Encoder *)band->lz);
+        return;
+    }
+
+    if (band->lines) {
+        band->data_size = lz_encode(band->lz, parent->type, parent->width, band->num_lines,
+                                    parent->top_down, band->lines, band->num_lines,
+                                    parent->stride, band->usr.buf, band->usr.buf_size);
+    } else {
+        Encoder *band_encoder = (Encoder *)band->lz;
+        int top_down;
+
+        // the type comes from stream data, check it before lz_decode uses it
+        if (lz_decode_header(band_encoder, band->data, band->data_size,
+                             &top_down) != LZ_MAGIC ||
+            band_encoder->type != parent->type || band_encoder->width != parent->width ||
+            band_encoder->height != band->num_lines) {
+            band->usr.base.error(&band->usr.base, "bad band header\n");
+        }
+        lz_decode(band->lz, band->to_type, band->out);
+    }
+}
+
+#ifdef LZ_BANDS_THREADED
+static void *lz_band_thread(void *opaque)
+{
+    LzBand *band = (LzBand *)opaque;
+
+    pthread_mutex_lock(&band->lock);
+    for (;;) {
+        while (!band->busy && !band->quit) {
+            pthread_cond_wait(&band->cond, &band->lock);
+        }
+        if (band->quit) {
+            break;
+        }
+        pthread_mutex_unlock(&band->lock);
+        lz_band_run(band);
+        pthread_mutex_lock(&band->lock);
+        band->busy = FALSE;
+        pthread_cond_broadcast(&band->cond);
+    }
+    pthread_mutex_unlock(&band->lock);
+    return NULL;
+}
+
+// hands the band to its thread, returns FALSE if the thread can't be started
+static int lz_band_start(LzBand *band)
+{
+    if (!band->thread_running) {
+        band->thread_running = pthread_create(&band->thread, NULL, lz_band_thread, band) == 0;
+        if (!band->thread_running) {
+            return FALSE;
+        }
+    }
+    pthread_mutex_lock(&band->lock);
+    band->busy = TRUE;
+    pthread_cond_broadcast(&band->cond);
+    pthread_mutex_unlock(&band->lock);
+    return TRUE;
+}
+
+static void lz_band_wait(LzBand *band)
+{
+    pthread_mutex_lock(&band->lock);
+    while (band->busy) {
+        pthread_cond_wait(&band->cond, &band->lock);
+    }
+    pthread_mutex_unlock(&band->lock);
+}
+#endif
+
+// runs the first n_bands bands, the first one on the calling thread, and
+// reports the error of the first band that failed. Returns FALSE on error
+static int lz_run_bands(Encoder *encoder, int n_bands)
+{
+    int i;
+#ifdef LZ_BANDS_THREADED
+    int started[LZ_MAX_BANDS];
+
+    for (i = 1; i < n_bands; i++) {
+        started[i] = lz_band_start(encoder->bands[i]);
+    }
+    lz_band_run(encoder->bands[0]);
+    for (i = 1; i < n_bands; i++) {
+        if (started[i]) {
+            lz_band_wait(encoder->bands[i]);
+        } else {
+            lz_band_run(encoder->bands[i]);
+        }
+    }
+#else
+    for (i = 0; i < n_bands; i++) {
+        lz_band_run(encoder->bands[i]);
+    }
+#endif
+
+    for (i = 0; i < n_bands; i++) {
+        if (encoder->bands[i]->failed) {
+            encoder->usr->error(encoder->usr, "band %d: %s", i, encoder->bands[i]->error);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static INLINE int lz_is_banded_type(LzImageType type)
+{
+    return type >= LZ_IMAGE_TYPE_RGB16 && type <= LZ_IMAGE_TYPE_XXXA;
+}
+
+static void encode_bytes(Encoder *encoder, const uint8_t *data, int size)
+{
+    while (size > 0) {
+        int n;
+
+        if (encoder->io_now == encoder->io_end) {
+            if (more_io_bytes(encoder) <= 0) {
+                encoder->usr->error(encoder->usr, "%s: no more bytes\n", __FUNCTION__);
+            }
+            spice_return_if_fail(encoder->io_now);
+        }
+        n = MIN(size, encoder->io_end - encoder->io_now);
+        memcpy(encoder->io_now, data, n);
+        encoder->io_now += n;
+        data += n;
+        size -= n;
+    }
+}
+
+int lz_encode_banded(LzContext *lz, LzImageType type, int width, int height, int top_down,
+                     uint8_t *lines, int stride, int n_bands,
+                     uint8_t *io_ptr, unsigned int num_io_bytes)
+{
+    Encoder *encoder = (Encoder *)lz;
+    uint8_t *io_ptr_end = io_ptr + num_io_bytes;
+    int first_line, i;
+
+    n_bands = MAX(1, MIN(n_bands, MIN(LZ_MAX_BANDS, height / 2)));
+    if (n_bands == 1 || !lz_is_banded_type(type) || width <= 0) {
+        return lz_encode(lz, type, width, height, top_down, lines, height, stride,
+                         io_ptr, num_io_bytes);
+    }
+
+    encoder->type = type;
+    encoder->width = width;
+    encoder->height = height;
+    encoder->stride = stride;
+    encoder->top_down = top_down;
+
+    for (i = 0, first_line = 0; i < n_bands; i++) {
+        LzBand *band = lz_get_band(encoder, i);
+        // worst case: every pixel is a literal, plus copy counts and header
+        size_t line_bound = (size_t)width * (RGB_BYTES_PER_PIXEL[type] + 1);
+        size_t bound;
+
+        band->num_lines = height / n_bands + (i < height % n_bands);
+        band->lines = lines + (size_t)first_line * stride;
+        if ((size_t)band->num_lines > (INT_MAX - 256) / line_bound) {
+            encoder->usr->error(encoder->usr, "image too big to be banded\n");
+            return 0;
+        }
+        bound = line_bound * band->num_lines + 256;
+        if (band->usr.buf_size < bound) {
+            free(band->usr.buf);
+            band->usr.buf = spice_malloc(bound);
+            band->usr.buf_size = bound;
+        }
+        first_line += band->num_lines;
+    }
+
+    if (!lz_run_bands(encoder, n_bands)) {
+        for (i = 0; i < n_bands; i++) {
+            encoder->bands[i]->lines = NULL;
+        }
+        return 0;
+    }
+
+    if (!encoder_reset(encoder, io_ptr, io_ptr_end)) {
+        encoder->usr->error(encoder->usr, "lz encoder io reset failed\n");
+    }
+
+    encode_32(encoder, LZ_BANDED_MAGIC);
+    encode_32(encoder, LZ_VERSION);
+    encode_32(encoder, type);
+    encode_32(encoder, width);
+    encode_32(encoder, height);
+    encode_32(encoder, stride);
+    encode_32(encoder, top_down);
+    encode_32(encoder, n_bands);
+    for (i = 0; i < n_bands; i++) {
+        encode_32(encoder, encoder->bands[i]->num_lines);
+        encode_32(encoder, encoder->bands[i]->data_size);
+    }
+    for (i = 0; i < n_bands; i++) {
+        encode_bytes(encoder, encoder->bands[i]->usr.buf, encoder->bands[i]->data_size);
+        encoder->bands[i]->lines = NULL;
+    }
+
+    encoder->io_bytes_count -= (encoder->io_end - encoder->io_now);
+
+    return encoder->io_bytes_count;
+}
+
+static void lz_decode_band_table(Encoder *encoder)
+{
+    uint32_t num_lines[LZ_MAX_BANDS], data_size[LZ_MAX_BANDS];
+    uint32_t total_lines = 0;
+    size_t total_size = 0;
+    size_t io_size;
+    int i;
+
+    encoder->n_bands = decode_32(encoder);
+    if (encoder->n_bands < 2 || encoder->n_bands > LZ_MAX_BANDS ||
+        !lz_is_banded_type(encoder->type) || encoder->width <= 0 || encoder->height <= 0 ||
+        (size_t)encoder->width * encoder->height > SIZE_MAX / 4) {
+        encoder->usr->error(encoder->usr, "bad banded stream\n");
+        encoder->n_bands = 0;
+        return;
+    }
+    for (i = 0; i < encoder->n_bands; i++) {
+        num_lines[i] = decode_32(encoder);
+        data_size[i] = decode_32(encoder);
+    }
+
+    // the bands are decoded in place, in parallel, so they must all be in the
+    // buffer given to lz_decode_begin
+    io_size = encoder->io_end - encoder->io_now;
+    for (i = 0; i < encoder->n_bands; i++) {
+        if (num_lines[i] == 0 || num_lines[i] > (uint32_t)encoder->height - total_lines ||
+            data_size[i] == 0 || data_size[i] > io_size - total_size) {
+            encoder->usr->error(encoder->usr, "bad band table\n");
+            encoder->n_bands = 0;
+            return;
+        }
+        total_lines += num_lines[i];
+        total_size += data_size[i];
+    }
+    if (total_lines != (uint32_t)encoder->height) {
+        encoder->usr->error(encoder->usr, "bad band table\n");
+        encoder->n_bands = 0;
+        return;
+    }
+
+    for (i = 0; i < encoder->n_bands; i++) {
+        LzBand *band = lz_get_band(encoder, i);
+
+        band->lines = NULL;
+        band->num_lines = num_lines[i];
+        band->data_size = data_size[i];
+        band->data = encoder->io_now;
+        encoder->io_now += data_size[i];
+    }
+}
+
+static void lz_decode_bands(Encoder *encoder, LzImageType to_type, uint8_t *buf)
+{
+    int i;
+
+    for (i = 0; i < encoder->n_bands; i++) {
+        LzBand *band = encoder->bands[i];
+
+        band->to_type = to_type;
+        band->out = buf;
+        buf += (size_t)encoder->width * band->num_lines * RGB_BYTES_PER_PIXEL[to_type];
+    }
+
+    if (!lz_run_bands(encoder, encoder->n_bands)) {
+        return;
+    }
+
+    if (!is_io_to_decode_end(encoder)) {
+        encoder->usr->error(encoder->usr, "bad decode size\n");
+    }
+}
+
 int lz_encode(LzContext *lz, LzImageType type, int width, int height, int top_down,
               uint8_t *lines, unsigned int num_lines, int stride,
               uint8_t *io_ptr, unsigned int num_io_bytes)
@@ -584,14 +1040,10 @@ int lz_encode(LzContext *lz, LzImageType type, int width, int height, int top_do
     return encoder->io_bytes_count;
 }
 
-/*
-    initialize and read lz magic
-*/
-void lz_decode_begin(LzContext *lz, uint8_t *io_ptr, unsigned int num_io_bytes,
-                     LzImageType *out_type, int *out_width, int *out_height,
-                     int *out_n_pixels, int *out_top_down, const SpicePalette *palette)
+// reads the stream header, up to the band table of banded streams
+static uint32_t lz_decode_header(Encoder *encoder, uint8_t *io_ptr, unsigned int num_io_bytes,
+                                 int *out_top_down)
 {
-    Encoder *encoder = (Encoder *)lz;
     uint8_t *io_ptr_end = io_ptr + num_io_bytes;
     uint32_t magic;
     uint32_t version;
@@ -601,7 +1053,7 @@ void lz_decode_begin(LzContext *lz, uint8_t *io_ptr, unsigned int num_io_bytes,
     }
 
     magic = decode_32(encoder);
-    if (magic != LZ_MAGIC) {
+    if (magic != LZ_MAGIC && magic != LZ_BANDED_MAGIC) {
         encoder->usr->error(encoder->usr, "bad magic\n");
     }
 
@@ -615,6 +1067,22 @@ void lz_decode_begin(LzContext *lz, uint8_t *io_ptr, unsigned int num_io_bytes,
     encoder->height = decode_32(encoder);
     encoder->stride = decode_32(encoder);
     *out_top_down = decode_32(encoder);
+    encoder->n_bands = 0;
+    return magic;
+}
+
+/*
+    initialize and read lz magic
+*/
+void lz_decode_begin(LzContext *lz, uint8_t *io_ptr, unsigned int num_io_bytes,
+                     LzImageType *out_type, int *out_width, int *out_height,
+                     int *out_n_pixels, int *out_top_down, const SpicePalette *palette)
+{
+    Encoder *encoder = (Encoder *)lz;
+
+    if (lz_decode_header(encoder, io_ptr, num_io_bytes, out_top_down) == LZ_BANDED_MAGIC) {
+        lz_decode_band_table(encoder);
+    }
 
     *out_width = encoder->width;
     *out_height = encoder->height;
@@ -637,6 +1105,15 @@ void lz_decode(LzContext *lz, LzImageType to_type, uint8_t *buf)
     size_t out_size = 0;
     size_t alpha_size = 0;
     size_t size = 0;
+
+    if (encoder->n_bands) {
+        if (to_type < LZ_IMAGE_TYPE_RGB16 || to_type > LZ_IMAGE_TYPE_XXXA) {
+            encoder->usr->error(encoder->usr, "unsupported output format\n");
+        }
+        lz_decode_bands(encoder, to_type, buf);
+        return;
+    }
+
     if (IS_IMAGE_TYPE_PLT[encoder->type]) {
         if (to_type == encoder->type) {
             size = encoder->height * encoder->stride;
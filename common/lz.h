@@ -50,6 +50,25 @@ int lz_encode(LzContext *lz, LzImageType type, int width, int height, int top_do
               uint8_t *lines, unsigned int num_lines, int stride,
               uint8_t *io_ptr, unsigned int num_io_bytes);
 
+/*
+        Same as lz_encode, but the image is cut into n_bands row bands that are
+        compressed independently, in parallel on worker threads the context starts
+        on first use and keeps until lz_destroy, and stored one after the other
+        behind a band table. Errors in a band are reported through the error
+        callback on the calling thread once all the bands are done. Decoding the result with lz_decode decodes the
+        bands in parallel too. Ratio is slightly worse, since matches can't cross
+        bands, but large images compress and decompress in a fraction of the time.
+
+        The whole image must be in lines (height lines, no more_lines calls) and
+        only the rgb types are supported. n_bands is clamped to [1, LZ_MAX_BANDS];
+        with one band a regular lz stream is produced.
+        A banded stream can only be decoded if it is passed whole to
+        lz_decode_begin, and it can't be decoded by older versions of this code.
+*/
+int lz_encode_banded(LzContext *lz, LzImageType type, int width, int height, int top_down,
+                     uint8_t *lines, int stride, int n_bands,
+                     uint8_t *io_ptr, unsigned int num_io_bytes);
+
 /*
         prepare encoder and read lz magic.
         out_n_pixels number of compressed pixels. May differ from Width*height in plt1/4.
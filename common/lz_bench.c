@@ -0,0 +1,408 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measures lz_encode() and lz_decode() on generated 1280x720 screens and
+   checks that every image decodes back to itself.
+
+   The screens are the same on every run:
+     ui        a window with panels, buttons and gray text
+     text      colored text on white
+     gradient  a diagonal gradient
+     noise     random pixels
+   each as RGB32 and RGBA, given to the encoder whole or in segments of 16
+   lines, as the server does with the chunks of a bitmap. For each one the
+   compressed size, the ratio and the best encode and decode times of a few
+   runs are printed.
+
+   --bands N adds a run of each image through lz_encode_banded() with N
+   bands, whose bands are encoded and decoded on the worker threads when lz.c
+   is built with LZ_BANDS_THREADED; comparing it with a build without
+   threads shows what the threads save on the machine at hand.
+
+   --write DIR saves the compressed streams in DIR and --check DIR decodes
+   the ones saved there instead of its own, so that the streams of a build
+   of another version of lz.c can be checked against this decoder and the
+   other way round. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "spice_common.h"
+#include "lz.h"
+#include "message_stats.h"
+
+#define BENCH_WIDTH 1280
+#define BENCH_HEIGHT 720
+#define BENCH_SEGMENT_LINES 16
+#define BENCH_RUNS 5
+
+enum {
+    BENCH_WHOLE,
+    BENCH_SEGMENTS,
+    BENCH_BANDS,
+};
+
+static const char *bench_mode_names[] = { "whole", "segments", "bands" };
+
+typedef struct BenchUsrContext {
+    LzUsrContext base;          // first, bench_usr_more_lines gets the context from it
+    uint8_t *next_lines;
+    int lines_left;
+    int stride;
+} BenchUsrContext;
+
+static const char *bench_kinds[] = {
+    "ui", "text", "gradient", "noise"
+};
+
+static uint32_t bench_seed;
+
+static uint32_t bench_random(void)
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return bench_seed >> 8;
+}
+
+static void bench_fill_rect(uint32_t *pixels, int x, int y, int width, int height,
+                            uint32_t color)
+{
+    int i, j;
+
+    for (j = y; j < MIN(y + height, BENCH_HEIGHT); j++) {
+        for (i = x; i < MIN(x + width, BENCH_WIDTH); i++) {
+            pixels[j * BENCH_WIDTH + i] = color;
+        }
+    }
+}
+
+static void bench_draw_text(uint32_t *pixels, int x0, int y0, int width, int height,
+                            int colored)
+{
+    uint8_t glyphs[16][8 * 12];
+    int x, y, i, j;
+
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < 8 * 12; j++) {
+            uint32_t r = bench_random() & 7;
+
+            glyphs[i][j] = r < 4 ? 0xff : (r < 6 ? 0 : 0x80);
+        }
+    }
+    for (y = y0; y + 12 <= y0 + height; y += 14) {
+        uint32_t color = colored ? bench_random() & 0xffffff : 0;
+
+        for (x = x0; x + 8 <= x0 + width; x += 8) {
+            const uint8_t *glyph = glyphs[bench_random() & 15];
+
+            if ((bench_random() & 7) == 0) {
+                continue;
+            }
+            for (j = 0; j < 12; j++) {
+                for (i = 0; i < 8; i++) {
+                    uint32_t *pixel = &pixels[(y + j) * BENCH_WIDTH + x + i];
+                    uint8_t v = glyph[j * 8 + i];
+
+                    if (v == 0) {
+                        *pixel = color;
+                    } else if (v == 0x80) {
+                        *pixel = ((*pixel >> 1) & 0x7f7f7f) + ((color >> 1) & 0x7f7f7f);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* The alpha channel is opaque but for a few translucent areas */
+static void bench_draw(uint32_t *pixels, int kind)
+{
+    int x, y, i;
+
+    bench_seed = kind + 1;
+    switch (kind) {
+    case 0:
+        bench_fill_rect(pixels, 0, 0, BENCH_WIDTH, BENCH_HEIGHT, 0xedeceb);
+        bench_fill_rect(pixels, 0, 0, BENCH_WIDTH, 28, 0x2e3436);
+        bench_fill_rect(pixels, 16, 40, 300, BENCH_HEIGHT - 56, 0xffffff);
+        bench_fill_rect(pixels, 332, 40, BENCH_WIDTH - 348, BENCH_HEIGHT - 56, 0xffffff);
+        for (i = 0; i < 6; i++) {
+            bench_fill_rect(pixels, BENCH_WIDTH - 120 * (i + 1), BENCH_HEIGHT - 52, 100, 28,
+                            0xd3d7cf);
+        }
+        bench_draw_text(pixels, 24, 48, 284, BENCH_HEIGHT - 80, FALSE);
+        bench_draw_text(pixels, 340, 48, BENCH_WIDTH - 364, BENCH_HEIGHT - 120, FALSE);
+        break;
+    case 1:
+        bench_fill_rect(pixels, 0, 0, BENCH_WIDTH, BENCH_HEIGHT, 0xffffff);
+        bench_draw_text(pixels, 8, 8, BENCH_WIDTH - 16, BENCH_HEIGHT - 16, TRUE);
+        break;
+    case 2:
+        for (y = 0; y < BENCH_HEIGHT; y++) {
+            for (x = 0; x < BENCH_WIDTH; x++) {
+                pixels[y * BENCH_WIDTH + x] = ((x * 255 / BENCH_WIDTH) << 16) |
+                                              ((y * 255 / BENCH_HEIGHT) << 8) |
+                                              ((x + y) * 255 / (BENCH_WIDTH + BENCH_HEIGHT));
+            }
+        }
+        break;
+    default:
+        for (i = 0; i < BENCH_WIDTH * BENCH_HEIGHT; i++) {
+            pixels[i] = bench_random() & 0xffffff;
+        }
+        break;
+    }
+    for (i = 0; i < BENCH_WIDTH * BENCH_HEIGHT; i++) {
+        pixels[i] |= 0xff000000;
+    }
+    bench_fill_rect(pixels, 64, 64, 200, 120, 0x80204060);
+}
+
+static void bench_usr_error(LzUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(1);
+}
+
+static void bench_usr_warn(LzUsrContext *usr, const char *fmt, ...)
+{
+}
+
+static void *bench_usr_malloc(LzUsrContext *usr, int size)
+{
+    return spice_malloc(size);
+}
+
+static void bench_usr_free(LzUsrContext *usr, void *ptr)
+{
+    free(ptr);
+}
+
+static int bench_usr_more_space(LzUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+static int bench_usr_more_lines(LzUsrContext *usr, uint8_t **lines)
+{
+    BenchUsrContext *bench_usr = (BenchUsrContext *)usr;
+    int n_lines = MIN(bench_usr->lines_left, BENCH_SEGMENT_LINES);
+
+    *lines = bench_usr->next_lines;
+    bench_usr->next_lines += n_lines * bench_usr->stride;
+    bench_usr->lines_left -= n_lines;
+    return n_lines;
+}
+
+static int bench_encode(LzContext *lz, BenchUsrContext *usr, LzImageType type,
+                        uint32_t *pixels, int mode, int n_bands, uint8_t *out, int out_size)
+{
+    int stride = BENCH_WIDTH * 4;
+    int n_lines = mode == BENCH_SEGMENTS ? BENCH_SEGMENT_LINES : BENCH_HEIGHT;
+
+    if (mode == BENCH_BANDS) {
+        return lz_encode_banded(lz, type, BENCH_WIDTH, BENCH_HEIGHT, TRUE, (uint8_t *)pixels,
+                                stride, n_bands, out, out_size);
+    }
+    usr->stride = stride;
+    usr->next_lines = (uint8_t *)pixels + n_lines * stride;
+    usr->lines_left = BENCH_HEIGHT - n_lines;
+    return lz_encode(lz, type, BENCH_WIDTH, BENCH_HEIGHT, TRUE, (uint8_t *)pixels, n_lines,
+                     stride, out, out_size);
+}
+
+static int bench_decode(LzContext *lz, LzImageType type, uint8_t *in, int size, uint32_t *out)
+{
+    LzImageType in_type;
+    int width, height, n_pixels, top_down;
+
+    lz_decode_begin(lz, in, size, &in_type, &width, &height, &n_pixels, &top_down, NULL);
+    if (in_type != type || width != BENCH_WIDTH || height != BENCH_HEIGHT ||
+        n_pixels != BENCH_WIDTH * BENCH_HEIGHT) {
+        return FALSE;
+    }
+    lz_decode(lz, type, (uint8_t *)out);
+    return TRUE;
+}
+
+/* RGB32 streams don't keep the alpha byte */
+static int bench_same(LzImageType type, const uint32_t *a, const uint32_t *b)
+{
+    uint32_t mask = type == LZ_IMAGE_TYPE_RGB32 ? 0x00ffffff : 0xffffffff;
+    int i;
+
+    for (i = 0; i < BENCH_WIDTH * BENCH_HEIGHT; i++) {
+        if ((a[i] & mask) != (b[i] & mask)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int bench_write(const char *dir, const char *name, const uint8_t *data, int size)
+{
+    char path[1024];
+    FILE *file;
+    int ok;
+
+    snprintf(path, sizeof(path), "%s/%s.lz", dir, name);
+    if (!(file = fopen(path, "wb"))) {
+        perror(path);
+        return FALSE;
+    }
+    ok = fwrite(data, 1, size, file) == (size_t)size;
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        perror(path);
+    }
+    return ok;
+}
+
+static int bench_read(const char *dir, const char *name, uint8_t *data, int max_size)
+{
+    char path[1024];
+    FILE *file;
+    int size;
+
+    snprintf(path, sizeof(path), "%s/%s.lz", dir, name);
+    if (!(file = fopen(path, "rb"))) {
+        perror(path);
+        return -1;
+    }
+    size = fread(data, 1, max_size, file);
+    fclose(file);
+    return size;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--bands N] [--write DIR | --check DIR]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    BenchUsrContext usr = {
+        { bench_usr_error, bench_usr_warn, bench_usr_warn, bench_usr_malloc,
+          bench_usr_free, bench_usr_more_space, bench_usr_more_lines },
+        NULL, 0, 0
+    };
+    static const LzImageType types[] = { LZ_IMAGE_TYPE_RGB32, LZ_IMAGE_TYPE_RGBA };
+    static const char *type_names[] = { "rgb32", "rgba" };
+    int n_pixels = BENCH_WIDTH * BENCH_HEIGHT;
+    int out_size = n_pixels * 5 + 1024;
+    const char *write_dir = NULL, *check_dir = NULL;
+    uint32_t *pixels, *decoded;
+    uint8_t *out;
+    uint64_t raw_total = 0, size_total = 0;
+    LzContext *lz;
+    int failed = FALSE;
+    int n_bands = 0;
+    int kind, t, mode, i;
+
+    for (i = 1; i < argc; i += 2) {
+        if (i + 1 == argc) {
+            usage(argv[0]);
+        } else if (strcmp(argv[i], "--bands") == 0) {
+            n_bands = atoi(argv[i + 1]);
+            if (n_bands < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--write") == 0 && !check_dir) {
+            write_dir = argv[i + 1];
+        } else if (strcmp(argv[i], "--check") == 0 && !write_dir) {
+            check_dir = argv[i + 1];
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    lz = lz_create(&usr.base);
+    if (lz == NULL) {
+        fprintf(stderr, "failed to create the lz context\n");
+        return 1;
+    }
+    pixels = spice_malloc_n(n_pixels, sizeof(uint32_t));
+    decoded = spice_malloc_n(n_pixels, sizeof(uint32_t));
+    out = spice_malloc(out_size);
+
+    printf("%-8s %-5s %-8s %10s %7s %11s %11s\n", "image", "type", "segments", "bytes", "ratio",
+           "encode ns", "decode ns");
+    for (kind = 0; kind < (int)SPICE_N_ELEMENTS(bench_kinds); kind++) {
+        bench_draw(pixels, kind);
+        for (t = 0; t < (int)SPICE_N_ELEMENTS(types); t++) {
+            for (mode = BENCH_WHOLE; mode <= (n_bands ? BENCH_BANDS : BENCH_SEGMENTS); mode++) {
+                uint64_t start, encode_time = UINT64_MAX, decode_time = UINT64_MAX;
+                char name[64], mode_name[32];
+                int run, size = 0, ok = TRUE;
+
+                snprintf(name, sizeof(name), "%s-%s-%s", bench_kinds[kind], type_names[t],
+                         bench_mode_names[mode]);
+                if (mode == BENCH_SEGMENTS) {
+                    snprintf(mode_name, sizeof(mode_name), "%d lines", BENCH_SEGMENT_LINES);
+                } else if (mode == BENCH_BANDS) {
+                    snprintf(mode_name, sizeof(mode_name), "%d bands", n_bands);
+                } else {
+                    snprintf(mode_name, sizeof(mode_name), "whole");
+                }
+                for (run = 0; run < BENCH_RUNS; run++) {
+                    start = spice_message_stats_now();
+                    size = bench_encode(lz, &usr, types[t], pixels, mode, n_bands, out, out_size);
+                    encode_time = MIN(encode_time, spice_message_stats_now() - start);
+                }
+                if (write_dir && !bench_write(write_dir, name, out, size)) {
+                    return 1;
+                }
+                if (check_dir && (size = bench_read(check_dir, name, out, out_size)) < 0) {
+                    return 1;
+                }
+                for (run = 0; run < BENCH_RUNS && ok; run++) {
+                    memset(decoded, 0, n_pixels * sizeof(uint32_t));
+                    start = spice_message_stats_now();
+                    ok = bench_decode(lz, types[t], out, size, decoded);
+                    decode_time = MIN(decode_time, spice_message_stats_now() - start);
+                    ok = ok && bench_same(types[t], pixels, decoded);
+                }
+                raw_total += n_pixels * 4;
+                size_total += size;
+                printf("%-8s %-5s %-8s %10d %7.2f %11.2f %11.2f%s\n", bench_kinds[kind],
+                       type_names[t], mode_name, size,
+                       (double)n_pixels * 4 / size, (double)encode_time / n_pixels,
+                       (double)decode_time / n_pixels, ok ? "" : "  MISMATCH");
+                failed = failed || !ok;
+            }
+        }
+    }
+    printf("total ratio %.3f%s\n", (double)raw_total / size_total,
+           failed ? ", some images didn't decode back" : "");
+
+    free(out);
+    free(decoded);
+    free(pixels);
+    lz_destroy(lz);
+    return failed;
+}
@@ -63,6 +63,10 @@ static const int RGB_BYTES_PER_PIXEL[] = {0, 1, 1, 1, 1, 1, 2, 3, 4, 4, 4, 1};
 #define LZ_VERSION_MINOR 1U
 #define LZ_VERSION ((LZ_VERSION_MAJOR << 16) | (LZ_VERSION_MINOR & 0xffff))
 
+/* banded streams: header, band table, then one complete LZ stream per band */
+#define LZ_BANDED_MAGIC (*(uint32_t *)"LZB ")
+#define LZ_MAX_BANDS 16
+
 SPICE_END_DECLS
 
 #endif  // _LZ_COMMON_H
@@ -51,20 +51,17 @@
 /*
     For each output pixel type the following macros are defined:
     OUT_PIXEL                      - the output pixel type
-    COPY_PIXEL(p, out)              - assigns the pixel to the place pointed by out and increases
-                                      out. Used in RLE. Need special handling because in alpha we
-                                      copy only the pad byte.
     COPY_REF_PIXEL(ref, out)      - copies the pixel pointed by ref to the pixel pointed by out.
                                     Increases ref and out.
     COPY_COMP_PIXEL(encoder, out) - copies pixel from the compressed buffer to the decompressed
                                     buffer. Increases out.
+    COPY_MATCH(op, ref, len, op_limit) - copies a match of len pixels. Increases op.
 */
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
 #if !defined(LZ_RGB_ALPHA)
-#define COPY_PIXEL(p, out) (*out++ = p)
 #define COPY_REF_PIXEL(ref, out) (*out++ = *ref++)
 #endif
 
@@ -77,6 +74,7 @@
 #define COPY_COMP_PIXEL(encoder, out) {out->a = decode(encoder); out++;}
 #else // TO_RGB32
 #define OUT_PIXEL rgb32_pixel_t
+// the palette is converted to output pixels once, in plt_rgb32, before decompressing
 #define COPY_PLT_ENTRY(ent, out) {    \
     (out)->b = ent;                   \
     (out)->g = (ent >> 8);            \
@@ -85,68 +83,52 @@
 }
 #ifdef PLT8
 #define FNAME(name) lz_plt8_to_rgb32_##name
+#define PLT_TABLE_SIZE 256
 #define COPY_COMP_PIXEL(encoder, out) {                     \
-    uint32_t rgb = encoder->palette->ents[decode(encoder)]; \
-    COPY_PLT_ENTRY(rgb, out);                               \
+    *out = plt_rgb32[decode(encoder)];                      \
     out++;}
 #elif defined(PLT4_BE)
 #define FNAME(name) lz_plt4_be_to_rgb32_##name
-#define COPY_COMP_PIXEL(encoder, out){                                                             \
-    uint8_t byte = decode(encoder);                                                                \
-    uint32_t rgb = encoder->palette->ents[((byte >> 4) & 0x0f) % (encoder->palette->num_ents)];    \
-    COPY_PLT_ENTRY(rgb, out);                                                                      \
-    out++;                                                                                         \
-    rgb = encoder->palette->ents[(byte & 0x0f) % (encoder->palette->num_ents)];                    \
-    COPY_PLT_ENTRY(rgb, out);                                                                      \
-    out++;                                                                                         \
+#define PLT_TABLE_SIZE 16
+#define COPY_COMP_PIXEL(encoder, out){                      \
+    uint8_t byte = decode(encoder);                         \
+    out[0] = plt_rgb32[(byte >> 4) & 0x0f];                 \
+    out[1] = plt_rgb32[byte & 0x0f];                        \
+    out += 2;                                               \
 }
 #define CAST_PLT_DISTANCE(dist) (dist*2)
 #elif  defined(PLT4_LE)
 #define FNAME(name) lz_plt4_le_to_rgb32_##name
-#define COPY_COMP_PIXEL(encoder, out){                                                      \
-    uint8_t byte = decode(encoder);                                                         \
-    uint32_t rgb = encoder->palette->ents[(byte & 0x0f) % (encoder->palette->num_ents)];    \
-    COPY_PLT_ENTRY(rgb, out);                                                               \
-    out++;                                                                                  \
-    rgb = encoder->palette->ents[((byte >> 4) & 0x0f) % (encoder->palette->num_ents)];      \
-    COPY_PLT_ENTRY(rgb, out);                                                               \
-    out++;                                                                                  \
+#define PLT_TABLE_SIZE 16
+#define COPY_COMP_PIXEL(encoder, out){                      \
+    uint8_t byte = decode(encoder);                         \
+    out[0] = plt_rgb32[byte & 0x0f];                        \
+    out[1] = plt_rgb32[(byte >> 4) & 0x0f];                 \
+    out += 2;                                               \
 }
 #define CAST_PLT_DISTANCE(dist) (dist*2)
-#elif defined(PLT1_BE) // TODO store palette entries for direct access
+#elif defined(PLT1_BE)
 #define FNAME(name) lz_plt1_be_to_rgb32_##name
-#define COPY_COMP_PIXEL(encoder, out){                                    \
-    uint8_t byte = decode(encoder);                                       \
-    int i;                                                                \
-    uint32_t fore = encoder->palette->ents[1];                            \
-    uint32_t back = encoder->palette->ents[0];                            \
-    for (i = 7; i >= 0; i--)                                              \
-    {                                                                     \
-        if ((byte >> i) & 1) {                                            \
-            COPY_PLT_ENTRY(fore, out);                                    \
-        } else {                                                          \
-            COPY_PLT_ENTRY(back, out);                                    \
-        }                                                                 \
-        out++;                                                            \
-    }                                                                     \
+#define PLT_TABLE_SIZE 2
+#define COPY_COMP_PIXEL(encoder, out){                      \
+    uint8_t byte = decode(encoder);                         \
+    int i;                                                  \
+    for (i = 0; i < 8; i++) {                               \
+        out[i] = plt_rgb32[(byte >> (7 - i)) & 1];          \
+    }                                                       \
+    out += 8;                                               \
 }
 #define CAST_PLT_DISTANCE(dist) (dist*8)
 #elif defined(PLT1_LE)
 #define FNAME(name) lz_plt1_le_to_rgb32_##name
-#define COPY_COMP_PIXEL(encoder, out){                                    \
-    uint8_t byte = decode(encoder);                                       \
-    int i;                                                                \
-    uint32_t fore = encoder->palette->ents[1];                            \
-    uint32_t back = encoder->palette->ents[0];                            \
-    for (i = 0; i < 8; i++)                                               \
-    {                                                                     \
-        if ((byte >> i) & 1) {                                            \
-            COPY_PLT_ENTRY(fore, out);                                    \
-        } else {                                                          \
-            COPY_PLT_ENTRY(back, out);                                    \
-        }                                                                 \
-        out++;                                                            \
-    }                                                                     \
+#define PLT_TABLE_SIZE 2
+#define COPY_COMP_PIXEL(encoder, out){                      \
+    uint8_t byte = decode(encoder);                         \
+    int i;                                                  \
+    for (i = 0; i < 8; i++) {                               \
+        out[i] = plt_rgb32[(byte >> i) & 1];                \
+    }                                                       \
+    out += 8;                                               \
 }
 #define CAST_PLT_DISTANCE(dist) (dist*8)
 #endif // PLT Type
@@ -211,9 +193,59 @@
 #ifdef LZ_RGB_ALPHA
 #define OUT_PIXEL rgb32_pixel_t
 #define FNAME(name) lz_rgb_alpha_##name
-#define COPY_PIXEL(p, out) {out->pad = p.pad; out++;}
 #define COPY_REF_PIXEL(ref, out) {out->pad = ref->pad; out++; ref++;}
 #define COPY_COMP_PIXEL(e, out) {out->pad = decode(e); out++;}
+// only the pad byte is written, the match is copied one pixel at a time
+#define COPY_MATCH(op, ref, len, op_limit) {    \
+    for (; len; --len) {                        \
+        COPY_REF_PIXEL(ref, op);                \
+    }                                           \
+}
+#endif
+
+#ifndef COPY_MATCH
+#define COPY_MATCH(op, ref, len, op_limit) {            \
+    FNAME(copy_match)(op, ref, len, op_limit);          \
+    op += len;                                          \
+}
+
+/* Copies a match of len pixels from ref to op. When there is room for it before op_limit,
+   the match is copied in chunks of LZ_WILD_COPY_SIZE bytes, possibly writing past its end
+   (the bytes are written again by the following matches/literals). Matches closer than a
+   chunk first get their pattern replicated until a chunk can be copied at once */
+static INLINE void FNAME(copy_match)(OUT_PIXEL *op, const OUT_PIXEL *ref, uint32_t len,
+                                     const OUT_PIXEL *op_limit)
+{
+    uint8_t *dst = (uint8_t *)op;
+    const uint8_t *src = (const uint8_t *)ref;
+    uint8_t *dst_end = (uint8_t *)(op + len);
+    size_t dist = dst - src;
+
+    if (LZ_UNEXPECT_CONDITIONAL((const uint8_t *)op_limit - dst_end < LZ_WILD_COPY_SIZE)) {
+        for (; len; --len) {
+            COPY_REF_PIXEL(ref, op);
+        }
+        return;
+    }
+
+    if (dist < LZ_WILD_COPY_SIZE) {
+        int i;
+
+        for (i = 0; i < LZ_WILD_COPY_SIZE; i++) {
+            dst[i] = src[i];
+        }
+        dst += LZ_WILD_COPY_SIZE;
+        // the copied bytes repeat every dist bytes, step back by enough periods for the
+        // source of the following chunks to be a whole chunk behind
+        src = dst - ((LZ_WILD_COPY_SIZE + dist - 1) / dist) * dist;
+    }
+
+    while (dst < dst_end) {
+        memcpy(dst, src, LZ_WILD_COPY_SIZE);
+        dst += LZ_WILD_COPY_SIZE;
+        src += LZ_WILD_COPY_SIZE;
+    }
+}
 #endif
 
 // return num of bytes in out_buf
@@ -223,6 +255,17 @@ static size_t FNAME(decompress)(Encoder *encoder, OUT_PIXEL *out_buf, int size)
     OUT_PIXEL    *op_limit = out_buf + size;
     uint32_t ctrl = decode(encoder);
     int loop = TRUE;
+#ifdef PLT_TABLE_SIZE
+    OUT_PIXEL plt_rgb32[PLT_TABLE_SIZE];
+    int i;
+
+    // out of range indices wrap around, as they did for PLT4
+    for (i = 0; i < PLT_TABLE_SIZE; i++) {
+        uint32_t rgb = encoder->palette->num_ents ?
+                       encoder->palette->ents[i % encoder->palette->num_ents] : 0;
+        COPY_PLT_ENTRY(rgb, &plt_rgb32[i]);
+    }
+#endif
 
     do {
         const OUT_PIXEL *ref = op;
@@ -274,26 +317,8 @@ static size_t FNAME(decompress)(Encoder *encoder, OUT_PIXEL *out_buf, int size)
             spice_assert(ref + len <= op_limit);
             spice_assert(ref >= out_buf);
 
-            // TODO: optimize by not calling loop at least 3 times when not PLT_TO_RGB32 (len is
-            //       always >=3). in PLT_TO_RGB32 len >= 3*number_of_pixels_per_byte
-
             /* copying the match*/
-
-            if (ref == (op - 1)) { // run // TODO: this will never be called in PLT4/1_TO_RGB
-                                          //       because the number of pixel copied is larger
-                                          //       then one...
-                /* optimize copy for a run */
-                OUT_PIXEL b = *ref;
-                for (; len; --len) {
-                    COPY_PIXEL(b, op);
-                    spice_assert(op <= op_limit);
-                }
-            } else {
-                for (; len; --len) {
-                    COPY_REF_PIXEL(ref, op);
-                    spice_assert(op <= op_limit);
-                }
-            }
+            COPY_MATCH(op, ref, len, op_limit);
         } else { // copy
             ctrl++; // copy count is biased by 1
 #if defined(TO_RGB32) && (defined(PLT4_BE) || defined(PLT4_LE) || defined(PLT1_BE) || \
@@ -302,13 +327,8 @@ static size_t FNAME(decompress)(Encoder *encoder, OUT_PIXEL *out_buf, int size)
 #else
             spice_assert(op + ctrl <= op_limit);
 #endif
-            COPY_COMP_PIXEL(encoder, op);
-
-            spice_assert(op <= op_limit);
-
-            for (--ctrl; ctrl; ctrl--) {
+            for (; ctrl; ctrl--) {
                 COPY_COMP_PIXEL(encoder, op);
-                spice_assert(op <= op_limit);
             }
         }
 
@@ -336,8 +356,9 @@ static size_t FNAME(decompress)(Encoder *encoder, OUT_PIXEL *out_buf, int size)
 #undef TO_RGB32
 #undef OUT_PIXEL
 #undef FNAME
-#undef COPY_PIXEL
 #undef COPY_REF_PIXEL
 #undef COPY_COMP_PIXEL
 #undef COPY_PLT_ENTRY
+#undef COPY_MATCH
+#undef PLT_TABLE_SIZE
 #undef CAST_PLT_DISTANCE
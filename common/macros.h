@@ -33,5 +33,12 @@
 #define SPICE_ATTR_NORETURN
 #endif /* __GNUC__ */
 
+#if    __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 3)
+#define SPICE_ATTR_COLD                                      \
+    __attribute__((cold))
+#else
+#define SPICE_ATTR_COLD
+#endif /* __GNUC__ */
+
 
 #endif /* __MACROS_H */
@@ -0,0 +1,90 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "message_stats.h"
+
+#ifdef __GNUC__
+#define STATS_ADD(field, val) __sync_fetch_and_add(&(field), (val))
+#define STATS_SET(field, val) __sync_lock_test_and_set(&(field), (val))
+#else
+#define STATS_ADD(field, val) ((field) += (val))
+#define STATS_SET(field, val) ((field) = (val))
+#endif
+
+uint64_t spice_message_stats_now(void)
+{
+#ifdef WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+void spice_message_stats_add(SpiceMessageStats *stats, uint64_t start,
+                             uint64_t wire_bytes, uint64_t mem_bytes)
+{
+    uint64_t nsec = spice_message_stats_now() - start;
+
+    STATS_ADD(stats->count, 1);
+    STATS_ADD(stats->wire_bytes, wire_bytes);
+    STATS_ADD(stats->mem_bytes, mem_bytes);
+    STATS_ADD(stats->nsec, nsec);
+}
+
+int spice_message_stats_copy(const SpiceMessageStats *table, int n_table,
+                             SpiceMessageStats *stats, int n_stats)
+{
+    int i;
+
+    for (i = 0; i < n_table && i < n_stats; i++) {
+        stats[i] = table[i];
+    }
+    return n_table;
+}
+
+void spice_message_stats_clear(SpiceMessageStats *table, int n_table)
+{
+    int i;
+
+    for (i = 0; i < n_table; i++) {
+        STATS_SET(table[i].count, 0);
+        STATS_SET(table[i].wire_bytes, 0);
+        STATS_SET(table[i].mem_bytes, 0);
+        STATS_SET(table[i].nsec, 0);
+    }
+}
@@ -0,0 +1,59 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_MESSAGE_STATS
+#define _H_MESSAGE_STATS
+
+#include <stdint.h>
+#include <spice/macros.h>
+
+SPICE_BEGIN_DECLS
+
+/* Per message type counters, kept by the marshallers and demarshallers when
+ * they are generated with spice_codegen.py --generate-stats. The generated
+ * code exports, with the same prefix as its other public symbols:
+ *
+ *   int spice_parse_msg_stats_snapshot(SpiceMessageStats *stats, int n_stats);
+ *   void spice_parse_msg_stats_reset(void);
+ *
+ * (spice_parse_reply_stats_* for client messages, spice_marshall_msg_stats_*
+ * and spice_marshall_msgc_stats_* for the marshallers). A snapshot copies up
+ * to n_stats entries and returns the number of message types. */
+typedef struct SpiceMessageStats {
+    const char *name;     /* "channel.message", or the marshaller name */
+    uint64_t count;
+    uint64_t wire_bytes;
+    uint64_t mem_bytes;   /* size of the parsed messages */
+    uint64_t nsec;        /* time spent parsing or marshalling */
+} SpiceMessageStats;
+
+/* Monotonic clock in nanoseconds */
+uint64_t spice_message_stats_now(void);
+
+/* Accounts one message handled since @start, safe to call from several
+ * threads */
+void spice_message_stats_add(SpiceMessageStats *stats, uint64_t start,
+                             uint64_t wire_bytes, uint64_t mem_bytes);
+
+int spice_message_stats_copy(const SpiceMessageStats *table, int n_table,
+                             SpiceMessageStats *stats, int n_stats);
+void spice_message_stats_clear(SpiceMessageStats *table, int n_table);
+
+SPICE_END_DECLS
+
+#endif
@@ -29,12 +29,14 @@ typedef CRITICAL_SECTION mutex_t;
 #define MUTEX_INIT(mutex) InitializeCriticalSection(&mutex)
 #define MUTEX_LOCK(mutex) EnterCriticalSection(&mutex)
 #define MUTEX_UNLOCK(mutex) LeaveCriticalSection(&mutex)
+#define MUTEX_DESTROY(mutex) DeleteCriticalSection(&mutex)
 #else
 #include <pthread.h>
 typedef pthread_mutex_t mutex_t;
 #define MUTEX_INIT(mutex) pthread_mutex_init(&mutex, NULL);
 #define MUTEX_LOCK(mutex) pthread_mutex_lock(&mutex)
 #define MUTEX_UNLOCK(mutex) pthread_mutex_unlock(&mutex)
+#define MUTEX_DESTROY(mutex) pthread_mutex_destroy(&mutex)
 #endif
 
 SPICE_END_DECLS
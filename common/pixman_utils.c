@@ -191,6 +191,76 @@ int spice_pixman_image_get_bpp(pixman_image_t *image)
     return depth;
 }
 
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3 0x165667b19e3779f9ULL
+
+static INLINE uint64_t hash_round(uint64_t hash, uint64_t value)
+{
+    hash += value * HASH_PRIME2;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * HASH_PRIME1;
+}
+
+static INLINE uint64_t hash_read64(const uint8_t *p)
+{
+    uint64_t value;
+
+    memcpy(&value, p, 8);
+    return value;
+}
+
+/* The rows are hashed 32 bytes at a time in four independent lanes, so the
+   multiplications of the lanes can overlap */
+uint64_t spice_pixman_hash_pixels(uint32_t seed, const uint8_t *line, int stride,
+                                  int width, int height, int bpp)
+{
+    int row_bytes = (width * bpp + 7) / 8;
+    uint64_t v1, v2, v3, v4, hash;
+
+    v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+    v2 = ((uint64_t)width << 32 | (uint32_t)height) + HASH_PRIME2;
+    v3 = bpp;
+    v4 = -HASH_PRIME1;
+    for (; height > 0; height--, line += stride) {
+        const uint8_t *p = line;
+        const uint8_t *end = line + row_bytes;
+        uint64_t value;
+
+        for (; p + 32 <= end; p += 32) {
+            v1 = hash_round(v1, hash_read64(p));
+            v2 = hash_round(v2, hash_read64(p + 8));
+            v3 = hash_round(v3, hash_read64(p + 16));
+            v4 = hash_round(v4, hash_read64(p + 24));
+        }
+        for (; p + 8 <= end; p += 8) {
+            v1 = hash_round(v1, hash_read64(p));
+        }
+        value = 0;
+        memcpy(&value, p, end - p);
+        v2 = hash_round(v2, value);
+    }
+
+    hash = ((v1 << 1) | (v1 >> 63)) + ((v2 << 7) | (v2 >> 57)) +
+           ((v3 << 12) | (v3 >> 52)) + ((v4 << 18) | (v4 >> 46));
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t spice_pixman_image_hash(pixman_image_t *image)
+{
+    return spice_pixman_hash_pixels(pixman_image_get_depth(image),
+                                    (uint8_t *)pixman_image_get_data(image),
+                                    pixman_image_get_stride(image),
+                                    pixman_image_get_width(image),
+                                    pixman_image_get_height(image),
+                                    spice_pixman_image_get_bpp(image));
+}
+
 void spice_pixman_fill_rect(pixman_image_t *dest,
                             int x, int y,
                             int width, int height,
@@ -800,11 +870,9 @@ void spice_pixman_blit_colorkey (pixman_image_t *dest,
             uint16_t *s = (uint16_t *)src_line;
 
             for (x = 0; x < width; x++) {
-                uint16_t val = *s;
-                if (val != (uint16_t)transparent_color) {
-                    *d = val;
-                }
-                s++; d++;
+                uint16_t val = s[x];
+                uint16_t keep = -(uint16_t)(val == (uint16_t)transparent_color);
+                d[x] = (val & ~keep) | (d[x] & keep);
             }
 
             byte_line += stride;
@@ -821,11 +889,10 @@ void spice_pixman_blit_colorkey (pixman_image_t *dest,
 
             transparent_color &= 0xffffff;
             for (x = 0; x < width; x++) {
-                uint32_t val = *s;
-                if ((0xffffff & val) != transparent_color) {
-                    *d = val;
-                }
-                s++; d++;
+                uint32_t val = s[x];
+                /* all ones where the pixel is the key; branchless so the loop vectorizes */
+                uint32_t keep = -(uint32_t)((val & 0xffffff) == transparent_color);
+                d[x] = (val & ~keep) | (d[x] & keep);
             }
 
             byte_line += stride;
@@ -834,6 +901,699 @@ void spice_pixman_blit_colorkey (pixman_image_t *dest,
     }
 }
 
+static INLINE uint32_t rgb_16_555_to_32(uint16_t color)
+{
+    uint32_t ret;
+
+    ret = ((color & 0x001f) << 3) | ((color & 0x001c) >> 2);
+    ret |= ((color & 0x03e0) << 6) | ((color & 0x0380) << 1);
+    ret |= ((color & 0x7c00) << 9) | ((color & 0x7000) << 4);
+
+    return ret;
+}
+
+static INLINE uint16_t rgb_32_to_16_555(uint32_t color)
+{
+    return
+        (((color) >> 3) & 0x001f) |
+        (((color) >> 6) & 0x03e0) |
+        (((color) >> 9) & 0x7c00);
+}
+
+/* The helpers below work on two 8 bit channels at a time, in the 0x00ff00ff
+   lanes of a word, and round like pixman so that spice_pixman_blend() gives
+   the same results as pixman_image_composite32(). */
+static INLINE uint32_t mul_un8x2(uint32_t x, uint32_t a)
+{
+    uint32_t t = (x & 0x00ff00ff) * a + 0x00800080;
+
+    return ((t + ((t >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+}
+
+static INLINE uint32_t add_un8x2_sat(uint32_t x, uint32_t y)
+{
+    uint32_t t = x + y;
+
+    t |= 0x01000100 - ((t >> 8) & 0x00ff00ff);
+    return t & 0x00ff00ff;
+}
+
+static INLINE uint32_t mul_un8x4(uint32_t x, uint32_t a)
+{
+    return mul_un8x2(x, a) | (mul_un8x2(x >> 8, a) << 8);
+}
+
+/* src OVER dest, src being premultiplied */
+static INLINE uint32_t over_un8x4(uint32_t src, uint32_t dest)
+{
+    uint32_t ia = 0xff - (src >> 24);
+
+    return add_un8x2_sat(mul_un8x2(dest, ia), src & 0x00ff00ff) |
+           (add_un8x2_sat(mul_un8x2(dest >> 8, ia), (src >> 8) & 0x00ff00ff) << 8);
+}
+
+static void blend_row_32(uint32_t *dest, const uint32_t *src, int width,
+                         uint32_t src_alpha, uint32_t dest_alpha_mask,
+                         uint32_t overall_alpha)
+{
+    int i;
+
+    for (i = 0; i < width; i++) {
+        uint32_t s = src[i] | src_alpha;
+
+        if (overall_alpha != 0xff) {
+            s = mul_un8x4(s, overall_alpha);
+        }
+        if (s >= 0xff000000) {
+            dest[i] = s & dest_alpha_mask;
+        } else if (s != 0) {
+            dest[i] = over_un8x4(s, dest[i]) & dest_alpha_mask;
+        } else {
+            dest[i] &= dest_alpha_mask;
+        }
+    }
+}
+
+static void blend_row_16_555(uint16_t *dest, const uint16_t *src, int width,
+                             uint32_t overall_alpha)
+{
+    int i;
+
+    for (i = 0; i < width; i++) {
+        uint32_t s = mul_un8x4(0xff000000 | rgb_16_555_to_32(src[i]), overall_alpha);
+
+        dest[i] = rgb_32_to_16_555(over_un8x4(s, rgb_16_555_to_32(dest[i])));
+    }
+}
+
+/* OVER composite of the (src_x, src_y, width, height) rectangle of src, with
+ * a constant alpha, onto dest at (dest_x, dest_y), only touching the parts
+ * that are in region. Gives the same result as pixman_image_composite32()
+ * with a solid mask and PIXMAN_REPEAT_NONE, except that the alpha byte of
+ * an x8r8g8b8 dest is cleared rather than set.
+ *
+ * Only handles 32 bpp images and x1r5g5b5 onto x1r5g5b5; returns FALSE
+ * without touching dest for anything else so the caller can fall back to
+ * pixman. */
+int spice_pixman_blend(pixman_image_t *dest,
+                       pixman_region32_t *region,
+                       pixman_image_t *src,
+                       int src_x, int src_y,
+                       int dest_x, int dest_y,
+                       int width, int height,
+                       int overall_alpha)
+{
+    uint8_t *dest_bits, *src_bits;
+    int dest_stride, src_stride, bpp;
+    int dest_depth, src_depth;
+    uint32_t src_alpha, dest_alpha_mask;
+    pixman_box32_t *rects;
+    int n_rects, i;
+
+    dest_depth = pixman_image_get_depth(dest);
+    src_depth = pixman_image_get_depth(src);
+    if (dest_depth == 15 && src_depth == 15) {
+        bpp = 16;
+    } else if ((dest_depth == 24 || dest_depth == 32) &&
+               (src_depth == 24 || src_depth == 32)) {
+        bpp = 32;
+    } else {
+        return FALSE;
+    }
+    src_bits = (uint8_t *)pixman_image_get_data(src);
+    dest_bits = (uint8_t *)pixman_image_get_data(dest);
+    if (src_bits == NULL || dest_bits == NULL) {
+        return FALSE;
+    }
+    src_stride = pixman_image_get_stride(src);
+    dest_stride = pixman_image_get_stride(dest);
+    src_alpha = src_depth == 32 ? 0 : 0xff000000;
+    dest_alpha_mask = dest_depth == 32 ? 0xffffffff : 0x00ffffff;
+    overall_alpha &= 0xff;
+
+    /* Outside of src there is nothing to draw */
+    if (src_x < 0) {
+        width += src_x;
+        dest_x -= src_x;
+        src_x = 0;
+    }
+    if (src_y < 0) {
+        height += src_y;
+        dest_y -= src_y;
+        src_y = 0;
+    }
+    width = MIN(width, pixman_image_get_width(src) - src_x);
+    height = MIN(height, pixman_image_get_height(src) - src_y);
+
+    rects = pixman_region32_rectangles(region, &n_rects);
+    for (i = 0; i < n_rects; i++) {
+        int x1 = MAX(rects[i].x1, MAX(dest_x, 0));
+        int y1 = MAX(rects[i].y1, MAX(dest_y, 0));
+        int x2 = MIN(rects[i].x2, MIN(dest_x + width, pixman_image_get_width(dest)));
+        int y2 = MIN(rects[i].y2, MIN(dest_y + height, pixman_image_get_height(dest)));
+        uint8_t *dest_line, *src_line;
+        int y;
+
+        if (x1 >= x2 || y1 >= y2) {
+            continue;
+        }
+        dest_line = dest_bits + y1 * dest_stride + x1 * (bpp / 8);
+        src_line = src_bits + (src_y + y1 - dest_y) * src_stride +
+                   (src_x + x1 - dest_x) * (bpp / 8);
+        for (y = y1; y < y2; y++) {
+            if (bpp == 16) {
+                blend_row_16_555((uint16_t *)dest_line, (uint16_t *)src_line, x2 - x1,
+                                 overall_alpha);
+            } else {
+                blend_row_32((uint32_t *)dest_line, (uint32_t *)src_line, x2 - x1,
+                             src_alpha, dest_alpha_mask, overall_alpha);
+            }
+            dest_line += dest_stride;
+            src_line += src_stride;
+        }
+    }
+
+    return TRUE;
+}
+
+/* BT.601 limited range to RGB in 8.8 fixed point */
+#define YUV_FIX_Y 298
+#define YUV_FIX_RV 409
+#define YUV_FIX_GU 100
+#define YUV_FIX_GV 208
+#define YUV_FIX_BU 516
+
+static INLINE int yuv_clamp(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static INLINE uint32_t yuv_to_rgb32(int y, int u, int v)
+{
+    int c = (y - 16) * YUV_FIX_Y + 128;
+    int r, g, b;
+
+    u -= 128;
+    v -= 128;
+    r = yuv_clamp((c + YUV_FIX_RV * v) >> 8);
+    g = yuv_clamp((c - YUV_FIX_GU * u - YUV_FIX_GV * v) >> 8);
+    b = yuv_clamp((c + YUV_FIX_BU * u) >> 8);
+
+    return (r << 16) | (g << 8) | b;
+}
+
+static INLINE uint16_t yuv_to_rgb16_555(int y, int u, int v)
+{
+    uint32_t c = yuv_to_rgb32(y, u, v);
+
+    return ((c >> 9) & 0x7c00) | ((c >> 6) & 0x03e0) | ((c >> 3) & 0x001f);
+}
+
+/* Convert one destination row. x_map holds, for each destination pixel,
+   the source column to sample; uv_step is the distance in bytes between
+   two chroma samples (1 for I420, 2 for NV12). */
+static void yuv_row_to_32(uint32_t *dest, int width, const int *x_map,
+                          const uint8_t *y_row, const uint8_t *u_row,
+                          const uint8_t *v_row, int uv_step, uint32_t alpha)
+{
+    int i;
+
+    for (i = 0; i < width; i++) {
+        int sx = x_map[i];
+        int c = (sx >> 1) * uv_step;
+
+        dest[i] = alpha | yuv_to_rgb32(y_row[sx], u_row[c], v_row[c]);
+    }
+}
+
+static void yuv_row_to_16_555(uint16_t *dest, int width, const int *x_map,
+                              const uint8_t *y_row, const uint8_t *u_row,
+                              const uint8_t *v_row, int uv_step)
+{
+    int i;
+
+    for (i = 0; i < width; i++) {
+        int sx = x_map[i];
+        int c = (sx >> 1) * uv_step;
+
+        dest[i] = yuv_to_rgb16_555(y_row[sx], u_row[c], v_row[c]);
+    }
+}
+
+/* Unscaled rows: one chroma sample covers two luma samples, so work on
+   pixel pairs and only compute the chroma terms once per pair. */
+static void yuv_row_to_32_unscaled(uint32_t *dest, int width, int src_x,
+                                   const uint8_t *y_row, const uint8_t *u_row,
+                                   const uint8_t *v_row, int uv_step, uint32_t alpha)
+{
+    const uint8_t *y_now = y_row + src_x;
+    uint32_t *end = dest + width;
+
+    if (src_x & 1) {
+        int c = (src_x >> 1) * uv_step;
+
+        *dest++ = alpha | yuv_to_rgb32(*y_now++, u_row[c], v_row[c]);
+        src_x++;
+    }
+    u_row += (src_x >> 1) * uv_step;
+    v_row += (src_x >> 1) * uv_step;
+
+    for (; dest + 1 < end; dest += 2, y_now += 2, u_row += uv_step, v_row += uv_step) {
+        int u = *u_row - 128;
+        int v = *v_row - 128;
+        int dr = YUV_FIX_RV * v;
+        int dg = -YUV_FIX_GU * u - YUV_FIX_GV * v;
+        int db = YUV_FIX_BU * u;
+        int c0 = (y_now[0] - 16) * YUV_FIX_Y + 128;
+        int c1 = (y_now[1] - 16) * YUV_FIX_Y + 128;
+
+        dest[0] = alpha |
+            (yuv_clamp((c0 + dr) >> 8) << 16) |
+            (yuv_clamp((c0 + dg) >> 8) << 8) |
+            yuv_clamp((c0 + db) >> 8);
+        dest[1] = alpha |
+            (yuv_clamp((c1 + dr) >> 8) << 16) |
+            (yuv_clamp((c1 + dg) >> 8) << 8) |
+            yuv_clamp((c1 + db) >> 8);
+    }
+    if (dest < end) {
+        *dest = alpha | yuv_to_rgb32(*y_now, *u_row, *v_row);
+    }
+}
+
+/* Paint the parts of the (dest_x, dest_y, dest_width, dest_height) rectangle
+ * that are in region with a 4:2:0 frame of src_width x src_height pixels,
+ * converting to RGB and scaling (nearest) in a single pass. region must be
+ * within both that rectangle and dest. */
+void spice_pixman_blit_yuv(pixman_image_t *dest,
+                           pixman_region32_t *region,
+                           int dest_x, int dest_y,
+                           int dest_width, int dest_height,
+                           SpiceYUVFormat format,
+                           const uint8_t *planes[3],
+                           const int strides[3],
+                           int src_width, int src_height)
+{
+    uint8_t *bits;
+    int stride, depth;
+    pixman_box32_t *rects;
+    int n_rects, i;
+    int *x_map = NULL;
+    int unscaled;
+    const uint8_t *u_plane, *v_plane;
+    int uv_stride, uv_step;
+    uint32_t alpha;
+
+    spice_return_if_fail(dest_width > 0 && dest_height > 0);
+    spice_return_if_fail(src_width > 0 && src_height > 0);
+
+    bits = (uint8_t *)pixman_image_get_data(dest);
+    stride = pixman_image_get_stride(dest);
+    depth = spice_pixman_image_get_bpp(dest);
+    spice_return_if_fail(depth == 32 || depth == 16);
+
+    if (format == SPICE_YUV_FORMAT_NV12) {
+        u_plane = planes[1];
+        v_plane = planes[1] + 1;
+        uv_stride = strides[1];
+        uv_step = 2;
+    } else {
+        u_plane = planes[1];
+        v_plane = planes[2];
+        uv_stride = strides[1];
+        spice_return_if_fail(strides[1] == strides[2]);
+        uv_step = 1;
+    }
+
+    alpha = (pixman_image_get_depth(dest) == 32) ? 0xff000000U : 0;
+    unscaled = (dest_width == src_width && dest_height == src_height);
+
+    if (!unscaled || depth != 32) {
+        /* sample at pixel centers, as pixman's nearest filter does */
+        x_map = spice_new(int, dest_width);
+        for (i = 0; i < dest_width; i++) {
+            x_map[i] = (int)(((int64_t)(2 * i + 1) * src_width) / (2 * dest_width));
+        }
+    }
+
+    rects = pixman_region32_rectangles(region, &n_rects);
+    for (i = 0; i < n_rects; i++) {
+        int x = rects[i].x1 - dest_x;
+        int width = rects[i].x2 - rects[i].x1;
+        int y;
+
+        for (y = rects[i].y1; y < rects[i].y2; y++) {
+            uint8_t *dest_line = bits + y * stride + rects[i].x1 * (depth / 8);
+            int sy = unscaled ? y - dest_y :
+                (int)(((int64_t)(2 * (y - dest_y) + 1) * src_height) / (2 * dest_height));
+            const uint8_t *y_row = planes[0] + sy * strides[0];
+            const uint8_t *u_row = u_plane + (sy >> 1) * uv_stride;
+            const uint8_t *v_row = v_plane + (sy >> 1) * uv_stride;
+
+            if (depth == 16) {
+                yuv_row_to_16_555((uint16_t *)dest_line, width, x_map + x,
+                                  y_row, u_row, v_row, uv_step);
+            } else if (unscaled) {
+                yuv_row_to_32_unscaled((uint32_t *)dest_line, width, x,
+                                       y_row, u_row, v_row, uv_step, alpha);
+            } else {
+                yuv_row_to_32((uint32_t *)dest_line, width, x_map + x,
+                              y_row, u_row, v_row, uv_step, alpha);
+            }
+        }
+    }
+
+    free(x_map);
+}
+
+void spice_pixman_scale_cache_init(SpicePixmanScaleCache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+}
+
+void spice_pixman_scale_cache_fini(SpicePixmanScaleCache *cache)
+{
+    int i;
+
+    for (i = 0; i < SPICE_PIXMAN_SCALE_CACHE_SIZE; i++) {
+        free(cache->entries[i].x.taps);
+        free(cache->entries[i].y.taps);
+    }
+    free(cache->rows);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static INLINE void scale_tap_set(SpicePixmanScaleTap *tap, int n,
+                                 int index, int weight, int src_limit)
+{
+    if (index < 0 || index >= src_limit) {
+        /* PIXMAN_REPEAT_NONE: samples outside the image are transparent */
+        tap->index[n] = 0;
+        tap->weight[n] = 0;
+    } else {
+        tap->index[n] = index;
+        tap->weight[n] = weight;
+    }
+}
+
+static INLINE int scale_axis_matches(const SpicePixmanScaleAxis *axis,
+                                     int src_pos, int src_size, int src_limit,
+                                     int dest_size, int scale_mode)
+{
+    return axis->taps != NULL &&
+           axis->src_pos == src_pos &&
+           axis->src_size == src_size &&
+           axis->src_limit == src_limit &&
+           axis->dest_size == dest_size &&
+           axis->scale_mode == scale_mode;
+}
+
+/* The sample positions follow what pixman does for a scale + translate
+ * transform: the center of each destination pixel is mapped through the
+ * 16.16 transform, nearest then picks the pixel containing the point
+ * (rounding down on ties), bilinear blends the two closest centers. */
+static void scale_axis_update(SpicePixmanScaleAxis *axis,
+                              int src_pos, int src_size, int src_limit,
+                              int dest_size, int scale_mode)
+{
+    pixman_fixed_t scale;
+    int i;
+
+    if (scale_axis_matches(axis, src_pos, src_size, src_limit, dest_size, scale_mode)) {
+        return;
+    }
+
+    free(axis->taps);
+    axis->taps = spice_new(SpicePixmanScaleTap, dest_size);
+    axis->src_pos = src_pos;
+    axis->src_size = src_size;
+    axis->src_limit = src_limit;
+    axis->dest_size = dest_size;
+    axis->scale_mode = scale_mode;
+
+    scale = ((pixman_fixed_48_16_t) src_size * 65536) / dest_size;
+    for (i = 0; i < dest_size; i++) {
+        SpicePixmanScaleTap *tap = &axis->taps[i];
+        pixman_fixed_48_16_t v;
+
+        v = ((pixman_fixed_48_16_t)scale * (((pixman_fixed_48_16_t)i << 16) + 0x8000) +
+             0x8000) >> 16;
+        v += (pixman_fixed_48_16_t)src_pos << 16;
+
+        if (scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST) {
+            scale_tap_set(tap, 0, (int)((v - pixman_fixed_e) >> 16), 256, src_limit);
+            scale_tap_set(tap, 1, 0, 0, src_limit);
+        } else {
+            int frac;
+
+            v -= pixman_fixed_1 / 2;
+            frac = (v >> 8) & 0xff;
+            scale_tap_set(tap, 0, (int)(v >> 16), 256 - frac, src_limit);
+            scale_tap_set(tap, 1, (int)(v >> 16) + 1, frac, src_limit);
+        }
+    }
+}
+
+/* Returns the entry holding the taps of the given scale, computing them in
+ * place of the least recently used entry if none has them */
+static SpicePixmanScaleEntry *scale_cache_lookup(SpicePixmanScaleCache *cache,
+                                                 int src_x, int src_y,
+                                                 int src_width, int src_height,
+                                                 int src_image_width, int src_image_height,
+                                                 int dest_width, int dest_height,
+                                                 int scale_mode)
+{
+    SpicePixmanScaleEntry *entry = NULL;
+    int i;
+
+    for (i = 0; i < SPICE_PIXMAN_SCALE_CACHE_SIZE; i++) {
+        SpicePixmanScaleEntry *e = &cache->entries[i];
+
+        if (scale_axis_matches(&e->x, src_x, src_width, src_image_width,
+                               dest_width, scale_mode) &&
+            scale_axis_matches(&e->y, src_y, src_height, src_image_height,
+                               dest_height, scale_mode)) {
+            entry = e;
+            break;
+        }
+        if (entry == NULL || e->last_used < entry->last_used) {
+            entry = e;
+        }
+    }
+
+    scale_axis_update(&entry->x, src_x, src_width, src_image_width, dest_width, scale_mode);
+    scale_axis_update(&entry->y, src_y, src_height, src_image_height, dest_height, scale_mode);
+    entry->last_used = ++cache->clock;
+    return entry;
+}
+
+/* Weighted sum of two pixels, two channels at a time. The weights are 8.8
+   fixed point and add up to at most 256, so no lane can overflow. */
+static INLINE uint32_t lerp_pixel(uint32_t a, uint32_t b, uint32_t wa, uint32_t wb)
+{
+    uint32_t rb, ag;
+
+    rb = ((a & 0x00ff00ff) * wa + (b & 0x00ff00ff) * wb + 0x00800080) >> 8;
+    ag = ((a >> 8) & 0x00ff00ff) * wa + ((b >> 8) & 0x00ff00ff) * wb + 0x00800080;
+
+    return (rb & 0x00ff00ff) | (ag & 0xff00ff00);
+}
+
+static void scale_row_nearest(uint32_t *dest, const uint32_t *src,
+                              const SpicePixmanScaleTap *taps, int width)
+{
+    int i;
+
+    for (i = 0; i < width; i++) {
+        /* weight is either 256 or 0, turn it into an all-ones or zero mask */
+        dest[i] = src[taps[i].index[0]] & -(uint32_t)(taps[i].weight[0] >> 8);
+    }
+}
+
+static void scale_row_bilinear(uint32_t *dest, const uint32_t *src,
+                               const SpicePixmanScaleTap *taps, int width)
+{
+    int i;
+
+    for (i = 0; i < width; i++) {
+        dest[i] = lerp_pixel(src[taps[i].index[0]], src[taps[i].index[1]],
+                             taps[i].weight[0], taps[i].weight[1]);
+    }
+}
+
+static void blend_rows(uint32_t *dest, const uint32_t *a, const uint32_t *b,
+                       uint32_t wa, uint32_t wb, int width)
+{
+    int i;
+
+    for (i = 0; i < width; i++) {
+        dest[i] = lerp_pixel(a[i], b[i], wa, wb);
+    }
+}
+
+static void scale_rect_nearest(SpicePixmanScaleEntry *entry,
+                               uint8_t *dest_bits, int dest_stride,
+                               const uint8_t *src_bits, int src_stride,
+                               int x, int y, int width, int height,
+                               int dest_x, int dest_y)
+{
+    const SpicePixmanScaleTap *x_taps = entry->x.taps + (x - dest_x);
+    const SpicePixmanScaleTap *y_tap = entry->y.taps + (y - dest_y);
+    uint32_t *dest_line = (uint32_t *)(dest_bits + y * dest_stride) + x;
+    uint32_t *prev_line = NULL;
+    int prev_index = -1;
+    int j;
+
+    for (j = 0; j < height; j++, y_tap++) {
+        if (y_tap->weight[0] == 0) {
+            memset(dest_line, 0, width * sizeof(uint32_t));
+            prev_line = NULL;
+        } else if (prev_line != NULL && y_tap->index[0] == prev_index) {
+            /* upscaling, the source row did not change */
+            memcpy(dest_line, prev_line, width * sizeof(uint32_t));
+        } else {
+            scale_row_nearest(dest_line,
+                              (const uint32_t *)(src_bits + y_tap->index[0] * src_stride),
+                              x_taps, width);
+            prev_line = dest_line;
+            prev_index = y_tap->index[0];
+        }
+        dest_line = (uint32_t *)((uint8_t *)dest_line + dest_stride);
+    }
+}
+
+/* Separable bilinear: each source row the rect needs is scaled
+ * horizontally once into one of two row buffers, then destination rows
+ * are produced by blending the buffers vertically. Consecutive
+ * destination rows usually share source rows, so when upscaling most
+ * rows cost only the vertical blend. */
+static void scale_rect_bilinear(SpicePixmanScaleCache *cache,
+                                SpicePixmanScaleEntry *entry,
+                                uint8_t *dest_bits, int dest_stride,
+                                const uint8_t *src_bits, int src_stride,
+                                int x, int y, int width, int height,
+                                int dest_x, int dest_y)
+{
+    const SpicePixmanScaleTap *x_taps = entry->x.taps + (x - dest_x);
+    const SpicePixmanScaleTap *y_tap = entry->y.taps + (y - dest_y);
+    uint32_t *dest_line = (uint32_t *)(dest_bits + y * dest_stride) + x;
+    uint32_t *rows[2];
+    int row_index[2] = { -1, -1 };
+    int j;
+
+    if (cache->rows_size < width * 2) {
+        free(cache->rows);
+        cache->rows = spice_new(uint32_t, width * 2);
+        cache->rows_size = width * 2;
+    }
+    rows[0] = cache->rows;
+    rows[1] = cache->rows + width;
+
+    for (j = 0; j < height; j++, y_tap++) {
+        int n;
+
+        for (n = 0; n < 2; n++) {
+            int index = y_tap->index[n];
+
+            if (y_tap->weight[n] == 0 || row_index[n] == index) {
+                continue;
+            }
+            if (row_index[1 - n] == index) {
+                uint32_t *tmp = rows[0];
+
+                rows[0] = rows[1];
+                rows[1] = tmp;
+                row_index[1 - n] = row_index[n];
+                row_index[n] = index;
+                continue;
+            }
+            scale_row_bilinear(rows[n],
+                               (const uint32_t *)(src_bits + index * src_stride),
+                               x_taps, width);
+            row_index[n] = index;
+        }
+
+        if (y_tap->weight[0] == 0 && y_tap->weight[1] == 0) {
+            memset(dest_line, 0, width * sizeof(uint32_t));
+        } else {
+            /* a zero weight row may hold stale data, it is multiplied by 0 */
+            blend_rows(dest_line, rows[0], rows[1],
+                       y_tap->weight[0], y_tap->weight[1], width);
+        }
+        dest_line = (uint32_t *)((uint8_t *)dest_line + dest_stride);
+    }
+}
+
+/* Scale the (src_x, src_y, src_width, src_height) rectangle of src onto
+ * the (dest_x, dest_y, dest_width, dest_height) rectangle of dest, only
+ * touching the parts that are in region. Gives the same result as a
+ * PIXMAN_OP_SRC composite with a scaling transform, NEAREST or GOOD
+ * filter and PIXMAN_REPEAT_NONE, up to rounding.
+ *
+ * Only handles 32 bpp images of the same depth; returns FALSE without
+ * touching dest for anything else so the caller can fall back to pixman. */
+int spice_pixman_scale(SpicePixmanScaleCache *cache,
+                       pixman_image_t *dest,
+                       pixman_region32_t *region,
+                       int dest_x, int dest_y,
+                       int dest_width, int dest_height,
+                       pixman_image_t *src,
+                       int src_x, int src_y,
+                       int src_width, int src_height,
+                       int scale_mode)
+{
+    uint8_t *dest_bits, *src_bits;
+    int dest_stride, src_stride;
+    int dest_image_width, dest_image_height;
+    SpicePixmanScaleEntry *entry;
+    pixman_box32_t *rects;
+    int n_rects, i;
+
+    if (spice_pixman_image_get_bpp(dest) != 32 ||
+        pixman_image_get_depth(src) != pixman_image_get_depth(dest)) {
+        return FALSE;
+    }
+    if (scale_mode != SPICE_IMAGE_SCALE_MODE_NEAREST &&
+        scale_mode != SPICE_IMAGE_SCALE_MODE_INTERPOLATE) {
+        return FALSE;
+    }
+    src_bits = (uint8_t *)pixman_image_get_data(src);
+    dest_bits = (uint8_t *)pixman_image_get_data(dest);
+    if (src_bits == NULL || dest_bits == NULL ||
+        dest_width <= 0 || dest_height <= 0 || src_width <= 0 || src_height <= 0) {
+        return FALSE;
+    }
+    src_stride = pixman_image_get_stride(src);
+    dest_stride = pixman_image_get_stride(dest);
+    dest_image_width = pixman_image_get_width(dest);
+    dest_image_height = pixman_image_get_height(dest);
+
+    entry = scale_cache_lookup(cache, src_x, src_y, src_width, src_height,
+                               pixman_image_get_width(src), pixman_image_get_height(src),
+                               dest_width, dest_height, scale_mode);
+
+    rects = pixman_region32_rectangles(region, &n_rects);
+    for (i = 0; i < n_rects; i++) {
+        int x1 = MAX(rects[i].x1, MAX(dest_x, 0));
+        int y1 = MAX(rects[i].y1, MAX(dest_y, 0));
+        int x2 = MIN(rects[i].x2, MIN(dest_x + dest_width, dest_image_width));
+        int y2 = MIN(rects[i].y2, MIN(dest_y + dest_height, dest_image_height));
+
+        if (x1 >= x2 || y1 >= y2) {
+            continue;
+        }
+        if (scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST) {
+            scale_rect_nearest(entry, dest_bits, dest_stride, src_bits, src_stride,
+                               x1, y1, x2 - x1, y2 - y1, dest_x, dest_y);
+        } else {
+            scale_rect_bilinear(cache, entry, dest_bits, dest_stride, src_bits, src_stride,
+                                x1, y1, x2 - x1, y2 - y1, dest_x, dest_y);
+        }
+    }
+
+    return TRUE;
+}
+
 static void copy_bits_up(uint8_t *data, const int stride, int bpp,
                          const int src_x, const int src_y,
                          const int width, const int height,
@@ -905,6 +1665,99 @@ void spice_pixman_copy_rect (pixman_image_t *image,
     }
 }
 
+/* Copies the rows [y1, y2) of one band of dest_region. When the band is a
+ * single rect covering whole rows the lines are contiguous in memory and
+ * the band moves in one go. */
+static void copy_region_band(uint8_t *data, int stride, int bpp,
+                             pixman_box32_t *first, pixman_box32_t *last,
+                             int dx, int dy)
+{
+    int y1 = first->y1;
+    int y2 = first->y2;
+    int forward_rows = dy <= 0;
+    int forward_rects = dx <= 0;
+    int y;
+
+    if (first == last && dx == 0 && (first->x2 - first->x1) * bpp == stride) {
+        uint8_t *dest = data + y1 * stride;
+        uint8_t *src = dest - dy * stride;
+        size_t size = (size_t)(y2 - y1) * stride;
+
+        if (ABS(dy) >= y2 - y1) {
+            memcpy(dest, src, size);
+        } else {
+            memmove(dest, src, size);
+        }
+        return;
+    }
+
+    for (y = forward_rows ? y1 : y2 - 1;
+         forward_rows ? y < y2 : y >= y1;
+         y += forward_rows ? 1 : -1) {
+        uint8_t *dest_line = data + y * stride;
+        uint8_t *src_line = dest_line - dy * stride - dx * bpp;
+        pixman_box32_t *rect;
+
+        for (rect = forward_rects ? first : last;
+             forward_rects ? rect <= last : rect >= first;
+             rect += forward_rects ? 1 : -1) {
+            int x = rect->x1 * bpp;
+            int width = (rect->x2 - rect->x1) * bpp;
+
+            if (dy == 0 && ABS(dx) * bpp < width) {
+                /* source and destination overlap on the same line */
+                memmove(dest_line + x, src_line + x, width);
+            } else {
+                memcpy(dest_line + x, src_line + x, width);
+            }
+        }
+    }
+}
+
+/* Moves the pixels of image so that the pixel at (x - dx, y - dy) ends up
+ * at (x, y), for every (x, y) in dest_region. The source may overlap the
+ * destination.
+ *
+ * The region is walked band by band, and within a band line by line
+ * across all its rects, so memory is touched in address order (reversed
+ * when scrolling down). Going in the direction opposite to the move
+ * guarantees that no line is read after it has been overwritten. */
+void spice_pixman_copy_region(pixman_image_t *image,
+                              pixman_region32_t *dest_region,
+                              int dx, int dy)
+{
+    uint8_t *data;
+    int stride;
+    int bpp;
+    pixman_box32_t *rects, *first, *last;
+    int n_rects, i;
+
+    rects = pixman_region32_rectangles(dest_region, &n_rects);
+    if (n_rects == 0 || (dx == 0 && dy == 0)) {
+        return;
+    }
+
+    data = (uint8_t *)pixman_image_get_data(image);
+    stride = pixman_image_get_stride(image);
+    bpp = spice_pixman_image_get_bpp(image) / 8;
+
+    if (dy <= 0) {
+        for (i = 0; i < n_rects; i = last - rects + 1) {
+            first = &rects[i];
+            for (last = first; last + 1 < rects + n_rects && last[1].y1 == first->y1; last++) {
+            }
+            copy_region_band(data, stride, bpp, first, last, dx, dy);
+        }
+    } else {
+        for (i = n_rects - 1; i >= 0; i = first - rects - 1) {
+            last = &rects[i];
+            for (first = last; first > rects && first[-1].y1 == last->y1; first--) {
+            }
+            copy_region_band(data, stride, bpp, first, last, dx, dy);
+        }
+    }
+}
+
 pixman_bool_t spice_pixman_region32_init_rects (pixman_region32_t *region,
                                                 const SpiceRect   *rects,
                                                 int                count)
@@ -1045,26 +1898,6 @@ pixman_image_t *spice_bitmap_try_as_pixman(int src_format,
 #define UINT32_FROM_LE(x) (x)
 #endif
 
-static INLINE uint32_t rgb_16_555_to_32(uint16_t color)
-{
-    uint32_t ret;
-
-    ret = ((color & 0x001f) << 3) | ((color & 0x001c) >> 2);
-    ret |= ((color & 0x03e0) << 6) | ((color & 0x0380) << 1);
-    ret |= ((color & 0x7c00) << 9) | ((color & 0x7000) << 4);
-
-    return ret;
-}
-
-static INLINE uint16_t rgb_32_to_16_555(uint32_t color)
-{
-    return
-        (((color) >> 3) & 0x001f) |
-        (((color) >> 6) & 0x03e0) |
-        (((color) >> 9) & 0x7c00);
-}
-
-
 static void bitmap_32_to_32(uint8_t* dest, int dest_stride,
                             uint8_t* src, int src_stride,
                             int width, uint8_t* end)
@@ -1395,6 +2228,263 @@ static void bitmap_1be_16_to_16_555(uint8_t* dest, int dest_stride,
     }
 }
 
+static void bitmap_8_tables_to_32(uint8_t *dest, int dest_stride,
+                                  uint8_t *src, int src_stride,
+                                  int width, uint8_t *end,
+                                  const SpicePaletteTables *tables)
+{
+    const uint32_t *pixels = tables->pixels;
+
+    for (; src != end; src += src_stride, dest += dest_stride) {
+        uint32_t *dest_line = (uint32_t*)dest;
+        uint8_t *src_line = src;
+        uint8_t *src_line_end = src_line + width;
+
+        while (src_line < src_line_end) {
+            *(dest_line++) = pixels[*(src_line++)];
+        }
+    }
+}
+
+static void bitmap_8_tables_to_16(uint8_t *dest, int dest_stride,
+                                  uint8_t *src, int src_stride,
+                                  int width, uint8_t *end,
+                                  const SpicePaletteTables *tables)
+{
+    const uint32_t *pixels = tables->pixels;
+
+    for (; src != end; src += src_stride, dest += dest_stride) {
+        uint16_t *dest_line = (uint16_t*)dest;
+        uint8_t *src_line = src;
+        uint8_t *src_line_end = src_line + width;
+
+        while (src_line < src_line_end) {
+            *(dest_line++) = pixels[*(src_line++)];
+        }
+    }
+}
+
+static void bitmap_4be_tables_to_32(uint8_t *dest, int dest_stride,
+                                    uint8_t *src, int src_stride,
+                                    int width, uint8_t *end,
+                                    const SpicePaletteTables *tables)
+{
+    for (; src != end; src += src_stride, dest += dest_stride) {
+        uint32_t *dest_line = (uint32_t *)dest;
+        uint8_t *row = src;
+        int i;
+
+        for (i = 0; i < (width >> 1); i++) {
+            const uint32_t *pixels = tables->pixels_4bpp[*(row++)];
+
+            *(dest_line++) = pixels[0];
+            *(dest_line++) = pixels[1];
+        }
+        if (width & 1) {
+            *(dest_line) = tables->pixels_4bpp[*row][0];
+        }
+    }
+}
+
+static void bitmap_4be_tables_to_16(uint8_t *dest, int dest_stride,
+                                    uint8_t *src, int src_stride,
+                                    int width, uint8_t *end,
+                                    const SpicePaletteTables *tables)
+{
+    for (; src != end; src += src_stride, dest += dest_stride) {
+        uint16_t *dest_line = (uint16_t *)dest;
+        uint8_t *row = src;
+        int i;
+
+        for (i = 0; i < (width >> 1); i++) {
+            const uint32_t *pixels = tables->pixels_4bpp[*(row++)];
+
+            *(dest_line++) = pixels[0];
+            *(dest_line++) = pixels[1];
+        }
+        if (width & 1) {
+            *(dest_line) = tables->pixels_4bpp[*row][0];
+        }
+    }
+}
+
+static void bitmap_1be_tables_to_32(uint8_t *dest, int dest_stride,
+                                    uint8_t *src, int src_stride,
+                                    int width, uint8_t *end,
+                                    const SpicePaletteTables *tables)
+{
+    for (; src != end; src += src_stride, dest += dest_stride) {
+        uint32_t *dest_line = (uint32_t *)dest;
+        uint8_t *row = src;
+        int i;
+
+        for (i = 0; i < (width >> 3); i++) {
+            memcpy(dest_line, tables->pixels_1bpp[*(row++)], 8 * sizeof(uint32_t));
+            dest_line += 8;
+        }
+        for (i = 0; i < (width & 7); i++) {
+            dest_line[i] = tables->pixels_1bpp[*row][i];
+        }
+    }
+}
+
+static void bitmap_1be_tables_to_16(uint8_t *dest, int dest_stride,
+                                    uint8_t *src, int src_stride,
+                                    int width, uint8_t *end,
+                                    const SpicePaletteTables *tables)
+{
+    for (; src != end; src += src_stride, dest += dest_stride) {
+        uint16_t *dest_line = (uint16_t *)dest;
+        uint8_t *row = src;
+        int i, j;
+
+        for (i = 0; i < (width >> 3); i++) {
+            const uint32_t *pixels = tables->pixels_1bpp[*(row++)];
+
+            for (j = 0; j < 8; j++) {
+                *(dest_line++) = pixels[j];
+            }
+        }
+        for (i = 0; i < (width & 7); i++) {
+            dest_line[i] = tables->pixels_1bpp[*row][i];
+        }
+    }
+}
+
+static void bitmap_tables_to_pixman(uint8_t *dest, int dest_stride,
+                                    uint8_t *src, int src_stride,
+                                    int width, uint8_t *end,
+                                    int src_format,
+                                    const SpicePaletteTables *tables)
+{
+    int bpp_16;
+
+    if (tables->palette_surface_format == SPICE_SURFACE_FMT_32_ARGB ||
+        tables->palette_surface_format == SPICE_SURFACE_FMT_32_xRGB) {
+        bpp_16 = FALSE;
+    } else if (tables->palette_surface_format == SPICE_SURFACE_FMT_16_555) {
+        bpp_16 = TRUE;
+    } else {
+        spice_error("Unsupported palette format");
+        return;
+    }
+
+    switch (src_format) {
+    case SPICE_BITMAP_FMT_8BIT:
+        if (bpp_16) {
+            bitmap_8_tables_to_16(dest, dest_stride, src, src_stride, width, end, tables);
+        } else {
+            bitmap_8_tables_to_32(dest, dest_stride, src, src_stride, width, end, tables);
+        }
+        break;
+    case SPICE_BITMAP_FMT_4BIT_BE:
+        if (bpp_16) {
+            bitmap_4be_tables_to_16(dest, dest_stride, src, src_stride, width, end, tables);
+        } else {
+            bitmap_4be_tables_to_32(dest, dest_stride, src, src_stride, width, end, tables);
+        }
+        break;
+    case SPICE_BITMAP_FMT_1BIT_BE:
+        if (bpp_16) {
+            bitmap_1be_tables_to_16(dest, dest_stride, src, src_stride, width, end, tables);
+        } else {
+            bitmap_1be_tables_to_32(dest, dest_stride, src, src_stride, width, end, tables);
+        }
+        break;
+    default:
+        spice_error("Unsupported bitmap format");
+        break;
+    }
+}
+
+static void palette_tables_init(SpicePaletteTables *tables, SpicePalette *palette,
+                                uint32_t palette_surface_format)
+{
+    int n_ents = MIN(palette->num_ents, 256);
+    int i, j;
+
+    tables->unique = palette->unique;
+    tables->palette_surface_format = palette_surface_format;
+    tables->num_ents = palette->num_ents;
+    memset(tables->ents, 0, sizeof(tables->ents));
+    memcpy(tables->ents, palette->ents, n_ents * sizeof(uint32_t));
+
+    for (i = 0; i < 256; i++) {
+        tables->pixels[i] = i < n_ents ? UINT32_FROM_LE(palette->ents[i]) : 0;
+    }
+    for (i = 0; i < 256; i++) {
+        tables->pixels_4bpp[i][0] = tables->pixels[(i >> 4) & 0x0f];
+        tables->pixels_4bpp[i][1] = tables->pixels[i & 0x0f];
+        for (j = 0; j < 8; j++) {
+            tables->pixels_1bpp[i][j] = tables->pixels[(i >> (7 - j)) & 1];
+        }
+    }
+
+    tables->palette_32bpp = NULL;
+    if (palette_surface_format == SPICE_SURFACE_FMT_16_555) {
+        tables->palette_32bpp = (SpicePalette *)spice_malloc(sizeof(SpicePalette) +
+                                                             n_ents * sizeof(uint32_t));
+        tables->palette_32bpp->unique = palette->unique;
+        tables->palette_32bpp->num_ents = n_ents;
+        for (i = 0; i < n_ents; i++) {
+            tables->palette_32bpp->ents[i] = rgb_16_555_to_32(palette->ents[i]);
+        }
+    }
+}
+
+void spice_palette_tables_cache_init(SpicePaletteTablesCache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+}
+
+void spice_palette_tables_cache_fini(SpicePaletteTablesCache *cache)
+{
+    int i;
+
+    for (i = 0; i < SPICE_PALETTE_TABLES_CACHE_SIZE; i++) {
+        if (cache->tables[i]) {
+            free(cache->tables[i]->palette_32bpp);
+            free(cache->tables[i]);
+        }
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+const SpicePaletteTables *spice_palette_tables_cache_get(SpicePaletteTablesCache *cache,
+                                                         SpicePalette *palette,
+                                                         uint32_t palette_surface_format)
+{
+    SpicePaletteTables *tables;
+    int i;
+
+    if (palette == NULL || palette->unique == 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < SPICE_PALETTE_TABLES_CACHE_SIZE; i++) {
+        tables = cache->tables[i];
+        if (tables && tables->unique == palette->unique &&
+            tables->palette_surface_format == palette_surface_format &&
+            tables->num_ents == palette->num_ents &&
+            memcmp(tables->ents, palette->ents,
+                   MIN(palette->num_ents, 256) * sizeof(uint32_t)) == 0) {
+            return tables;
+        }
+    }
+
+    tables = cache->tables[cache->next];
+    if (tables == NULL) {
+        tables = spice_new(SpicePaletteTables, 1);
+        cache->tables[cache->next] = tables;
+    } else {
+        free(tables->palette_32bpp);
+    }
+    cache->next = (cache->next + 1) % SPICE_PALETTE_TABLES_CACHE_SIZE;
+    palette_tables_init(tables, palette, palette_surface_format);
+
+    return tables;
+}
+
 #ifdef NOT_USED_ATM
 
 static void bitmap_16_to_32(uint8_t* dest, int dest_stride,
@@ -1451,15 +2541,16 @@ static void bitmap_24_to_16_555(uint8_t* dest, int dest_stride,
 
 /* This assumes that the dest, if set is the same format as
    spice_bitmap_format_to_pixman would have picked */
-pixman_image_t *spice_bitmap_to_pixman(pixman_image_t *dest_image,
-                                       int src_format,
-                                       int flags,
-                                       int width,
-                                       int height,
-                                       uint8_t *src,
-                                       int src_stride,
-                                       uint32_t palette_surface_format,
-                                       SpicePalette *palette)
+static pixman_image_t *bitmap_to_pixman(pixman_image_t *dest_image,
+                                        int src_format,
+                                        int flags,
+                                        int width,
+                                        int height,
+                                        uint8_t *src,
+                                        int src_stride,
+                                        uint32_t palette_surface_format,
+                                        SpicePalette *palette,
+                                        const SpicePaletteTables *tables)
 {
     uint8_t* dest;
     int dest_stride;
@@ -1484,6 +2575,14 @@ pixman_image_t *spice_bitmap_to_pixman(pixman_image_t *dest_image,
     }
     end = src + (height * src_stride);
 
+    if (tables && (src_format == SPICE_BITMAP_FMT_8BIT ||
+                   src_format == SPICE_BITMAP_FMT_4BIT_BE ||
+                   src_format == SPICE_BITMAP_FMT_1BIT_BE)) {
+        bitmap_tables_to_pixman(dest, dest_stride, src, src_stride, width, end,
+                                src_format, tables);
+        return dest_image;
+    }
+
     switch (src_format) {
     case SPICE_BITMAP_FMT_32BIT:
     case SPICE_BITMAP_FMT_RGBA:
@@ -1536,6 +2635,20 @@ pixman_image_t *spice_bitmap_to_pixman(pixman_image_t *dest_image,
     return dest_image;
 }
 
+pixman_image_t *spice_bitmap_to_pixman(pixman_image_t *dest_image,
+                                       int src_format,
+                                       int flags,
+                                       int width,
+                                       int height,
+                                       uint8_t *src,
+                                       int src_stride,
+                                       uint32_t palette_surface_format,
+                                       SpicePalette *palette)
+{
+    return bitmap_to_pixman(dest_image, src_format, flags, width, height, src, src_stride,
+                            palette_surface_format, palette, NULL);
+}
+
 static int pixman_format_compatible (pixman_format_code_t dest_format,
                               pixman_format_code_t src_format)
 {
@@ -1552,16 +2665,17 @@ static int pixman_format_compatible (pixman_format_code_t dest_format,
     return FALSE;
 }
 
-pixman_image_t *spice_bitmap_convert_to_pixman(pixman_format_code_t dest_format,
-                                               pixman_image_t *dest_image,
-                                               int src_format,
-                                               int flags,
-                                               int width,
-                                               int height,
-                                               uint8_t *src,
-                                               int src_stride,
-                                               uint32_t palette_surface_format,
-                                               SpicePalette *palette)
+static pixman_image_t *bitmap_convert_to_pixman(pixman_format_code_t dest_format,
+                                                pixman_image_t *dest_image,
+                                                int src_format,
+                                                int flags,
+                                                int width,
+                                                int height,
+                                                uint8_t *src,
+                                                int src_stride,
+                                                uint32_t palette_surface_format,
+                                                SpicePalette *palette,
+                                                const SpicePaletteTables *tables)
 {
     pixman_image_t *src_image;
     pixman_format_code_t native_format;
@@ -1576,11 +2690,11 @@ pixman_image_t *spice_bitmap_convert_to_pixman(pixman_format_code_t dest_format,
         spice_bitmap_format_to_pixman(src_format, palette_surface_format);
 
     if (pixman_format_compatible (dest_format, native_format)) {
-        return spice_bitmap_to_pixman(dest_image,
-                                      src_format,
-                                      flags, width,height,
-                                      src, src_stride,
-                                      palette_surface_format, palette);
+        return bitmap_to_pixman(dest_image,
+                                src_format,
+                                flags, width,height,
+                                src, src_stride,
+                                palette_surface_format, palette, tables);
     }
 
     src_image = spice_bitmap_try_as_pixman(src_format,
@@ -1594,11 +2708,11 @@ pixman_image_t *spice_bitmap_convert_to_pixman(pixman_format_code_t dest_format,
      * shows up here commonly we might want to add non-temporary
      * conversion special casing here */
     if (src_image == NULL) {
-        src_image = spice_bitmap_to_pixman(NULL,
-                                           src_format,
-                                           flags, width,height,
-                                           src, src_stride,
-                                           palette_surface_format, palette);
+        src_image = bitmap_to_pixman(NULL,
+                                     src_format,
+                                     flags, width,height,
+                                     src, src_stride,
+                                     palette_surface_format, palette, tables);
     }
 
     pixman_image_composite32 (PIXMAN_OP_SRC,
@@ -1612,3 +2726,33 @@ pixman_image_t *spice_bitmap_convert_to_pixman(pixman_format_code_t dest_format,
 
     return dest_image;
 }
+
+pixman_image_t *spice_bitmap_convert_to_pixman(pixman_format_code_t dest_format,
+                                               pixman_image_t *dest_image,
+                                               int src_format,
+                                               int flags,
+                                               int width,
+                                               int height,
+                                               uint8_t *src,
+                                               int src_stride,
+                                               uint32_t palette_surface_format,
+                                               SpicePalette *palette)
+{
+    return bitmap_convert_to_pixman(dest_format, dest_image, src_format, flags, width, height,
+                                    src, src_stride, palette_surface_format, palette, NULL);
+}
+
+pixman_image_t *spice_bitmap_convert_to_pixman_tables(pixman_format_code_t dest_format,
+                                                      pixman_image_t *dest_image,
+                                                      int src_format,
+                                                      int flags,
+                                                      int width,
+                                                      int height,
+                                                      uint8_t *src,
+                                                      int src_stride,
+                                                      const SpicePaletteTables *tables)
+{
+    return bitmap_convert_to_pixman(dest_format, dest_image, src_format, flags, width, height,
+                                    src, src_stride, tables->palette_surface_format, NULL,
+                                    tables);
+}
@@ -54,8 +54,90 @@ typedef enum {
     SPICE_ROP_SET            /* 0xf    1 */
 } SpiceROP;
 
+/* Layout of 4:2:0 subsampled video frames handed to
+ * spice_pixman_blit_yuv(). Samples are BT.601 limited range. */
+typedef enum {
+    SPICE_YUV_FORMAT_I420,  /* Y plane, U plane, V plane */
+    SPICE_YUV_FORMAT_NV12,  /* Y plane, interleaved UV plane */
+} SpiceYUVFormat;
+
+/* Precomputed source taps for one axis of a scale operation. */
+typedef struct SpicePixmanScaleTap {
+    int index[2];
+    uint16_t weight[2];  /* 8.8 fixed point, 0 for samples outside the image */
+} SpicePixmanScaleTap;
+
+typedef struct SpicePixmanScaleAxis {
+    int src_pos;
+    int src_size;
+    int src_limit;
+    int dest_size;
+    int scale_mode;
+    SpicePixmanScaleTap *taps;
+} SpicePixmanScaleAxis;
+
+/* The tap tables of one (source rect, destination size, scale mode) */
+typedef struct SpicePixmanScaleEntry {
+    SpicePixmanScaleAxis x;
+    SpicePixmanScaleAxis y;
+    uint32_t last_used;
+} SpicePixmanScaleEntry;
+
+#define SPICE_PIXMAN_SCALE_CACHE_SIZE 4
+
+/* Keeps the tap tables of the last few scale operations, along with the
+ * row buffers, so that scaling frame after frame to the same sizes does
+ * not recompute them even when several streams or scaling ops share a
+ * canvas. The least recently used entry is replaced on a miss. */
+typedef struct SpicePixmanScaleCache {
+    SpicePixmanScaleEntry entries[SPICE_PIXMAN_SCALE_CACHE_SIZE];
+    uint32_t clock;
+    uint32_t *rows;
+    int rows_size;
+} SpicePixmanScaleCache;
+
+void spice_pixman_scale_cache_init(SpicePixmanScaleCache *cache);
+void spice_pixman_scale_cache_fini(SpicePixmanScaleCache *cache);
+
+/* The entries of a palette converted for the bitmap converters, along with
+ * the pixels each byte of a 4 or 1 bpp bitmap expands to. */
+typedef struct SpicePaletteTables {
+    uint64_t unique;
+    uint32_t palette_surface_format;
+    uint16_t num_ents;
+    uint32_t ents[256];             /* as received, to check a palette is the
+                                       one the tables were built from */
+    uint32_t pixels[256];           /* 0 past num_ents */
+    uint32_t pixels_4bpp[256][2];
+    uint32_t pixels_1bpp[256][8];
+    SpicePalette *palette_32bpp;    /* the palette with 32 bpp entries, for the
+                                       lz decoder, NULL if they already are */
+} SpicePaletteTables;
+
+#define SPICE_PALETTE_TABLES_CACHE_SIZE 8
+
+/* Keeps the tables of the last palettes used, so that palettized bitmaps
+ * sharing a palette don't convert it again. */
+typedef struct SpicePaletteTablesCache {
+    SpicePaletteTables *tables[SPICE_PALETTE_TABLES_CACHE_SIZE];
+    int next;                       /* slot replaced on the next miss */
+} SpicePaletteTablesCache;
+
+void spice_palette_tables_cache_init(SpicePaletteTablesCache *cache);
+void spice_palette_tables_cache_fini(SpicePaletteTablesCache *cache);
+/* Returns NULL for palettes without an id, they aren't cached */
+const SpicePaletteTables *spice_palette_tables_cache_get(SpicePaletteTablesCache *cache,
+                                                         SpicePalette *palette,
+                                                         uint32_t palette_surface_format);
 
 int spice_pixman_image_get_bpp(pixman_image_t *image);
+/* Fast non-cryptographic hash of the pixels of a width x height area, not
+   looking at the padding at the end of the rows. Not stable across versions,
+   don't store it */
+uint64_t spice_pixman_hash_pixels(uint32_t seed, const uint8_t *line, int stride,
+                                  int width, int height, int bpp);
+/* Hash of the depth, size and pixels of image */
+uint64_t spice_pixman_image_hash(pixman_image_t *image);
 
 pixman_format_code_t spice_surface_format_to_pixman(uint32_t surface_format);
 pixman_format_code_t spice_bitmap_format_to_pixman(int bitmap_format,
@@ -76,6 +158,13 @@ pixman_image_t *spice_bitmap_convert_to_pixman(pixman_format_code_t dest_format,
                                                uint8_t *src, int src_stride,
                                                uint32_t palette_surface_format,
                                                SpicePalette *palette);
+/* Same as spice_bitmap_convert_to_pixman(), using the tables of the palette */
+pixman_image_t *spice_bitmap_convert_to_pixman_tables(pixman_format_code_t dest_format,
+                                                      pixman_image_t *dest_image,
+                                                      int src_format, int flags,
+                                                      int width, int height,
+                                                      uint8_t *src, int src_stride,
+                                                      const SpicePaletteTables *tables);
 
 void spice_pixman_region32_init_from_bitmap(pixman_region32_t *region,
                                             uint32_t *data,
@@ -123,10 +212,37 @@ void spice_pixman_blit_colorkey(pixman_image_t *dest,
                                 int dest_x, int dest_y,
                                 int width, int height,
                                 uint32_t transparent_color);
+int spice_pixman_blend(pixman_image_t *dest,
+                       pixman_region32_t *region,
+                       pixman_image_t *src,
+                       int src_x, int src_y,
+                       int dest_x, int dest_y,
+                       int width, int height,
+                       int overall_alpha);
+void spice_pixman_blit_yuv(pixman_image_t *dest,
+                           pixman_region32_t *region,
+                           int dest_x, int dest_y,
+                           int dest_width, int dest_height,
+                           SpiceYUVFormat format,
+                           const uint8_t *planes[3],
+                           const int strides[3],
+                           int src_width, int src_height);
+int spice_pixman_scale(SpicePixmanScaleCache *cache,
+                       pixman_image_t *dest,
+                       pixman_region32_t *region,
+                       int dest_x, int dest_y,
+                       int dest_width, int dest_height,
+                       pixman_image_t *src,
+                       int src_x, int src_y,
+                       int src_width, int src_height,
+                       int scale_mode);
 void spice_pixman_copy_rect(pixman_image_t *image,
                             int src_x, int src_y,
                             int w, int h,
                             int dest_x, int dest_y);
+void spice_pixman_copy_region(pixman_image_t *image,
+                              pixman_region32_t *dest_region,
+                              int dx, int dy);
 
 SPICE_END_DECLS
 
@@ -65,6 +65,14 @@ typedef uint8_t BYTE;
 #define MINwminext 1
 #define MAXwminext 100000000
 
+/* number of bits looked up at once when decoding a codeword */
+#define GOLOMB_LUT_BITS 8
+
+typedef struct GolombLUTEntry {
+    BYTE value;    /* decoded value */
+    BYTE len;      /* codeword length, 0 if longer than GOLOMB_LUT_BITS */
+} GolombLUTEntry;
+
 typedef struct QuicFamily {
     unsigned int nGRcodewords[MAXNUMCODES];      /* indexed by code number, contains number of
                                                     unmodified GR codewords in the code */
@@ -82,6 +90,15 @@ typedef struct QuicFamily {
     /* array for translating distribution L to U for depths up to 8 bpp,
        initialized by corelateinit() */
     unsigned int xlatL2U[256];
+
+    /* indexed by value and code number, contain the codeword of the value
+       without its leading zeroes, and its length. Initialized by family_init() */
+    uint16_t golomb_code[256][MAXNUMCODES];
+    BYTE golomb_code_len[256][MAXNUMCODES];
+
+    /* indexed by code number and by the next GOLOMB_LUT_BITS bits of the
+       input, contains the decoded short codeword. Initialized by family_init() */
+    GolombLUTEntry golomb_lut[MAXNUMCODES][1 << GOLOMB_LUT_BITS];
 } QuicFamily;
 
 static QuicFamily family_8bpc;
@@ -293,21 +310,35 @@ static int ceil_log_2(int val) /* ceil(log_2(val)) */
     return result;
 }
 
-/* number of leading zeroes in the byte, used by cntlzeroes(uint)*/
-static const BYTE lzeroes[256] = {
-    8, 7, 6, 6, 5, 5, 5, 5, 4, 4, 4, 4, 4, 4, 4, 4, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-};
-
 /* count leading zeroes */
 static unsigned int cnt_l_zeroes(const unsigned int bits)
 {
+#if defined(__GNUC__) && (__GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4))
+    if (bits) {
+        return __builtin_clz(bits);
+    }
+    return 32;
+#else
+    /* number of leading zeroes in the byte, used by cntlzeroes(uint)*/
+    static const BYTE lzeroes[256] = {
+        8, 7, 6, 6, 5, 5, 5, 5, 4, 4, 4, 4, 4, 4, 4, 4,
+        3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+
     if (bits & 0xff800000) {
         return lzeroes[bits >> 24];
     } else if (bits & 0xffff8000) {
@@ -317,6 +348,7 @@ static unsigned int cnt_l_zeroes(const unsigned int bits)
     } else {
         return 24 + lzeroes[bits & 0x000000ff];
     }
+#endif
 }
 
 #define QUIC_FAMILY_8BPC
@@ -360,9 +392,44 @@ static void corelate_init(QuicFamily *family, int bpc)
     }
 }
 
+static void golomb_lut_init(QuicFamily *family, int bpc)
+{
+    unsigned int l;
+    unsigned int i;
+
+    for (l = 0; l < (unsigned int)bpc; l++) {
+        for (i = 0; i < (1U << GOLOMB_LUT_BITS); i++) {
+            const unsigned int bits = i << (32 - GOLOMB_LUT_BITS);
+            unsigned int cwlen;
+            unsigned int value;
+
+            /* same as golomb_decoding(), the GR test is exact whenever the
+               codeword fits in the looked up bits */
+            if (bits > family->notGRprefixmask[l]) {
+                const unsigned int zeroprefix = cnt_l_zeroes(bits);
+                cwlen = zeroprefix + 1 + l;
+                value = (zeroprefix << l) | ((bits >> (32 - cwlen)) & bppmask[l]);
+            } else {
+                cwlen = family->notGRcwlen[l];
+                value = family->nGRcodewords[l] +
+                        ((bits >> (32 - cwlen)) & bppmask[family->notGRsuffixlen[l]]);
+            }
+
+            if (cwlen <= GOLOMB_LUT_BITS) {
+                family->golomb_lut[l][i].value = value;
+                family->golomb_lut[l][i].len = cwlen;
+            } else {
+                family->golomb_lut[l][i].value = 0;
+                family->golomb_lut[l][i].len = 0;
+            }
+        }
+    }
+}
+
 static void family_init(QuicFamily *family, int bpc, int limit)
 {
     int l;
+    unsigned int s;
 
     for (l = 0; l < bpc; l++) { /* fill arrays indexed by code number */
         int altprefixlen, altcodewords;
@@ -378,10 +445,21 @@ static void family_init(QuicFamily *family, int bpc, int limit)
         family->notGRcwlen[l] = altprefixlen + ceil_log_2(altcodewords);
         family->notGRprefixmask[l] = bppmask[32 - altprefixlen]; /* needed for decoding only */
         family->notGRsuffixlen[l] = ceil_log_2(altcodewords); /* needed for decoding only */
+
+        for (s = 0; s <= bppmask[bpc]; s++) { /* codeword lengths never exceed limit */
+            if (s < family->nGRcodewords[l]) {
+                family->golomb_code[s][l] = bitat[l] | (s & bppmask[l]);
+                family->golomb_code_len[s][l] = (s >> l) + 1 + l;
+            } else {
+                family->golomb_code[s][l] = s - family->nGRcodewords[l];
+                family->golomb_code_len[s][l] = family->notGRcwlen[l];
+            }
+        }
     }
 
     decorelate_init(family, bpc);
     corelate_init(family, bpc);
+    golomb_lut_init(family, bpc);
 }
 
 static void more_io_words(Encoder *encoder)
@@ -1120,6 +1198,9 @@ static int encoder_reste_channels(Encoder *encoder, int channels, int width, int
             encoder->channels[i].correlate_row_width = width;
         }
 
+        /* the whole model is reset for every image, even a small one: this is
+           about 1% of coding a tiny image, so it isn't worth resetting only
+           the touched buckets */
         if (bpc == 8) {
             MEMCLEAR(encoder->channels[i].family_stat_8bpc.counters,
                      encoder->n_buckets_8bpc * sizeof(COUNTER) * MAXNUMCODES);
@@ -35,30 +35,23 @@
 #endif
 
 
-static unsigned int FNAME(golomb_code_len)(const BYTE n, const unsigned int l)
-{
-    if (n < VNAME(family).nGRcodewords[l]) {
-        return (n >> l) + 1 + l;
-    } else {
-        return VNAME(family).notGRcwlen[l];
-    }
-}
-
 static void FNAME(golomb_coding)(const BYTE n, const unsigned int l, unsigned int * const codeword,
                                  unsigned int * const codewordlen)
 {
-    if (n < VNAME(family).nGRcodewords[l]) {
-        (*codeword) = bitat[l] | (n & bppmask[l]);
-        (*codewordlen) = (n >> l) + l + 1;
-    } else {
-        (*codeword) = n - VNAME(family).nGRcodewords[l];
-        (*codewordlen) = VNAME(family).notGRcwlen[l];
-    }
+    (*codeword) = VNAME(family).golomb_code[n][l];
+    (*codewordlen) = VNAME(family).golomb_code_len[n][l];
 }
 
 static unsigned int FNAME(golomb_decoding)(const unsigned int l, const unsigned int bits,
                                            unsigned int * const codewordlen)
 {
+    const GolombLUTEntry entry = VNAME(family).golomb_lut[l][bits >> (32 - GOLOMB_LUT_BITS)];
+
+    if (SPICE_LIKELY(entry.len)) { /* short codeword */
+        (*codewordlen) = entry.len;
+        return entry.value;
+    }
+
     if (bits > VNAME(family).notGRprefixmask[l]) { /*GR*/
         const unsigned int zeroprefix = cnt_l_zeroes(bits);       /* leading zeroes in codeword */
         const unsigned int cwlen = zeroprefix + 1 + l;            /* codeword length */
@@ -77,6 +70,7 @@ static void FNAME(update_model)(CommonState *state, s_bucket * const bucket,
                                 const BYTE curval, unsigned int bpp)
 {
     COUNTER * const pcounters = bucket->pcounters;
+    const BYTE * const codelen = VNAME(family).golomb_code_len[curval];
     unsigned int i;
     unsigned int bestcode;
     unsigned int bestcodelen;
@@ -85,10 +79,10 @@ static void FNAME(update_model)(CommonState *state, s_bucket * const bucket,
     /* update counters, find minimum */
 
     bestcode = bpp - 1;
-    bestcodelen = (pcounters[bestcode] += FNAME(golomb_code_len)(curval, bestcode));
+    bestcodelen = (pcounters[bestcode] += codelen[bestcode]);
 
     for (i = bpp - 2; i < bpp; i--) { /* NOTE: expression i<bpp for signed int i would be: i>=0 */
-        const unsigned int ithcodelen = (pcounters[i] += FNAME(golomb_code_len)(curval, i));
+        const unsigned int ithcodelen = (pcounters[i] += codelen[i]);
 
         if (ithcodelen < bestcodelen) {
             bestcode = i;
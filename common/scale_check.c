@@ -0,0 +1,249 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2012 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compares spice_pixman_scale() with pixman's own scaling, done the way
+   the sw canvas falls back to it: a PIXMAN_OP_SRC composite through a
+   scaling transform, with PIXMAN_REPEAT_NONE and the NEAREST or GOOD
+   filter, clipped to the same region.
+
+   The cases use more scales than the scale cache holds and go over them a
+   few times, so that tap tables are computed, reused from the cache and
+   evicted. Each case is also scaled with an empty cache, which must give
+   the same pixels. For each scale mode the largest difference of a
+   channel is printed. Nearest must match exactly and bilinear must be
+   within 2 per channel; the exit status tells whether it did. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spice_common.h"
+#include "pixman_utils.h"
+
+#define CHECK_DEST_WIDTH 160
+#define CHECK_DEST_HEIGHT 120
+#define CHECK_ROUNDS 3
+
+typedef struct CheckCase {
+    int src_width, src_height;      // the source image
+    int src_x, src_y;               // the scaled rectangle of the source
+    int width, height;
+    int dest_x, dest_y;             // where it goes in the destination
+    int dest_width, dest_height;
+} CheckCase;
+
+static const CheckCase check_cases[] = {
+    { 64, 48, 0, 0, 64, 48, 0, 0, 32, 24 },             // halving
+    { 64, 48, 8, 4, 40, 30, 10, 6, 60, 45 },            // 1.5x, inner rectangle
+    { 70, 50, 3, 5, 63, 35, 1, 2, 27, 15 },             // 3/7
+    { 16, 16, 0, 0, 16, 16, 4, 4, 128, 96 },            // 8x/6x, cursor like
+    { 100, 80, 10, 10, 80, 60, -8, -6, 170, 130 },      // clipped by the destination
+    { 37, 23, 0, 0, 37, 23, 5, 5, 111, 23 },            // horizontal only
+};
+
+static const int check_modes[] = {
+    SPICE_IMAGE_SCALE_MODE_NEAREST, SPICE_IMAGE_SCALE_MODE_INTERPOLATE
+};
+
+static const char *check_mode_names[] = { "nearest", "bilinear" };
+
+static uint32_t check_seed;
+
+static uint32_t check_random(void)
+{
+    check_seed = check_seed * 1103515245 + 12345;
+    return check_seed >> 8;
+}
+
+/* smooth areas with some edges, as a scaled video frame or window has */
+static pixman_image_t *check_create_src(int width, int height)
+{
+    pixman_image_t *image;
+    uint32_t *data;
+    int stride, x, y;
+
+    image = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, 0);
+    spice_return_val_if_fail(image != NULL, NULL);
+    data = pixman_image_get_data(image);
+    stride = pixman_image_get_stride(image) / 4;
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            uint32_t pixel = ((x * 255 / width) << 16) | ((y * 255 / height) << 8);
+
+            if ((check_random() & 3) == 0) {
+                pixel = check_random() & 0xffffff;
+            }
+            data[y * stride + x] = pixel | 0xff000000;
+        }
+    }
+    return image;
+}
+
+static pixman_image_t *check_create_dest(void)
+{
+    pixman_image_t *image;
+    uint32_t *data;
+    int i;
+
+    image = pixman_image_create_bits(PIXMAN_x8r8g8b8, CHECK_DEST_WIDTH, CHECK_DEST_HEIGHT,
+                                     NULL, 0);
+    spice_return_val_if_fail(image != NULL, NULL);
+    data = pixman_image_get_data(image);
+    for (i = 0; i < CHECK_DEST_WIDTH * CHECK_DEST_HEIGHT; i++) {
+        data[i] = 0xff00ff00;
+    }
+    return image;
+}
+
+/* the destination rectangle without a hole in its middle, so that the
+   region has several rectangles */
+static void check_init_region(pixman_region32_t *region, const CheckCase *c)
+{
+    pixman_region32_t hole;
+
+    pixman_region32_init_rect(region, c->dest_x, c->dest_y, c->dest_width, c->dest_height);
+    pixman_region32_init_rect(&hole, c->dest_x + c->dest_width / 3,
+                              c->dest_y + c->dest_height / 3,
+                              c->dest_width / 3, c->dest_height / 3);
+    pixman_region32_subtract(region, region, &hole);
+    pixman_region32_fini(&hole);
+}
+
+static void check_pixman_scale(pixman_image_t *dest, pixman_region32_t *region,
+                               pixman_image_t *src, const CheckCase *c, int scale_mode)
+{
+    pixman_transform_t transform;
+    pixman_fixed_t fsx, fsy;
+
+    fsx = ((pixman_fixed_48_16_t) c->width * 65536) / c->dest_width;
+    fsy = ((pixman_fixed_48_16_t) c->height * 65536) / c->dest_height;
+
+    pixman_image_set_clip_region32(dest, region);
+    pixman_transform_init_scale(&transform, fsx, fsy);
+    pixman_transform_translate(&transform, NULL,
+                               pixman_int_to_fixed (c->src_x),
+                               pixman_int_to_fixed (c->src_y));
+    pixman_image_set_transform(src, &transform);
+    pixman_image_set_repeat(src, PIXMAN_REPEAT_NONE);
+    pixman_image_set_filter(src,
+                            (scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST) ?
+                            PIXMAN_FILTER_NEAREST : PIXMAN_FILTER_GOOD,
+                            NULL, 0);
+    pixman_image_composite32(PIXMAN_OP_SRC,
+                             src, NULL, dest,
+                             0, 0, /* src */
+                             0, 0, /* mask */
+                             c->dest_x, c->dest_y, /* dst */
+                             c->dest_width, c->dest_height);
+    pixman_transform_init_identity(&transform);
+    pixman_image_set_transform(src, &transform);
+    pixman_image_set_clip_region32(dest, NULL);
+}
+
+/* largest difference of a color channel, the alpha byte of x8r8g8b8 is
+   left out */
+static int check_diff(pixman_image_t *a, pixman_image_t *b)
+{
+    const uint32_t *data_a = pixman_image_get_data(a);
+    const uint32_t *data_b = pixman_image_get_data(b);
+    int i, shift, diff = 0;
+
+    for (i = 0; i < CHECK_DEST_WIDTH * CHECK_DEST_HEIGHT; i++) {
+        for (shift = 0; shift < 24; shift += 8) {
+            diff = MAX(diff, abs((int)((data_a[i] >> shift) & 0xff) -
+                                 (int)((data_b[i] >> shift) & 0xff)));
+        }
+    }
+    return diff;
+}
+
+int main(int argc, char **argv)
+{
+    SpicePixmanScaleCache cache, empty_cache;
+    int max_diff[SPICE_N_ELEMENTS(check_modes)];
+    int cache_mismatch = FALSE;
+    int failed = FALSE;
+    int round, i, m;
+
+    memset(max_diff, 0, sizeof(max_diff));
+    spice_pixman_scale_cache_init(&cache);
+    for (round = 0; round < CHECK_ROUNDS; round++) {
+        for (i = 0; i < (int)SPICE_N_ELEMENTS(check_cases); i++) {
+            const CheckCase *c = &check_cases[i];
+
+            for (m = 0; m < (int)SPICE_N_ELEMENTS(check_modes); m++) {
+                pixman_image_t *src, *dest, *cache_dest, *pixman_dest;
+                pixman_region32_t region;
+
+                check_seed = i + 1;
+                src = check_create_src(c->src_width, c->src_height);
+                dest = check_create_dest();
+                cache_dest = check_create_dest();
+                pixman_dest = check_create_dest();
+                if (!src || !dest || !cache_dest || !pixman_dest) {
+                    return 1;
+                }
+                check_init_region(&region, c);
+
+                if (!spice_pixman_scale(&cache, dest, &region,
+                                        c->dest_x, c->dest_y, c->dest_width, c->dest_height,
+                                        src, c->src_x, c->src_y, c->width, c->height,
+                                        check_modes[m])) {
+                    printf("case %d %s: not handled by spice_pixman_scale\n", i,
+                           check_mode_names[m]);
+                    failed = TRUE;
+                }
+
+                spice_pixman_scale_cache_init(&empty_cache);
+                spice_pixman_scale(&empty_cache, cache_dest, &region,
+                                   c->dest_x, c->dest_y, c->dest_width, c->dest_height,
+                                   src, c->src_x, c->src_y, c->width, c->height,
+                                   check_modes[m]);
+                spice_pixman_scale_cache_fini(&empty_cache);
+                if (check_diff(dest, cache_dest) != 0) {
+                    printf("case %d %s round %d: the cached taps give other pixels\n", i,
+                           check_mode_names[m], round);
+                    cache_mismatch = TRUE;
+                }
+
+                check_pixman_scale(pixman_dest, &region, src, c, check_modes[m]);
+                max_diff[m] = MAX(max_diff[m], check_diff(dest, pixman_dest));
+
+                pixman_region32_fini(&region);
+                pixman_image_unref(pixman_dest);
+                pixman_image_unref(cache_dest);
+                pixman_image_unref(dest);
+                pixman_image_unref(src);
+            }
+        }
+    }
+    spice_pixman_scale_cache_fini(&cache);
+
+    for (m = 0; m < (int)SPICE_N_ELEMENTS(check_modes); m++) {
+        int limit = check_modes[m] == SPICE_IMAGE_SCALE_MODE_NEAREST ? 0 : 2;
+
+        printf("%-8s max channel difference from pixman %d (limit %d)\n",
+               check_mode_names[m], max_diff[m], limit);
+        failed = failed || max_diff[m] > limit;
+    }
+    return failed || cache_mismatch;
+}
@@ -21,6 +21,7 @@
 #endif
 
 #include "mem.h"
+#include "mutex.h"
 #include "ssl_verify.h"
 #include "log.h"
 
@@ -358,7 +359,6 @@ static int verify_subject(X509* cert, SpiceOpenSSLVerify* verify)
 {
     X509_NAME *cert_subject = NULL;
     int ret;
-    int in_entries;
 
     if (!cert) {
         spice_debug("warning: no cert!");
@@ -372,7 +372,8 @@ static int verify_subject(X509* cert, SpiceOpenSSLVerify* verify)
     }
 
     if (!verify->in_subject) {
-        verify->in_subject = subject_to_x509_name(verify->subject, &in_entries);
+        verify->in_subject = subject_to_x509_name(verify->subject,
+                                                  &verify->in_subject_entries);
         if (!verify->in_subject) {
             spice_debug("warning: no in_subject!");
             return 0;
@@ -380,9 +381,9 @@ static int verify_subject(X509* cert, SpiceOpenSSLVerify* verify)
     }
 
     /* Note: this check is redundant with the pre-condition in X509_NAME_cmp */
-    if (X509_NAME_entry_count(cert_subject) != in_entries) {
+    if (X509_NAME_entry_count(cert_subject) != verify->in_subject_entries) {
         spice_debug("subject mismatch: #entries cert=%d, input=%d",
-            X509_NAME_entry_count(cert_subject), in_entries);
+            X509_NAME_entry_count(cert_subject), verify->in_subject_entries);
         return 0;
     }
 
@@ -406,6 +407,130 @@ static int verify_subject(X509* cert, SpiceOpenSSLVerify* verify)
     return !ret;
 }
 
+#define VERIFY_CACHE_SIZE 16
+#define VERIFY_DIGEST_SIZE 32 /* sha256 */
+
+typedef struct VerifyCacheEntry {
+    unsigned char cert_digest[VERIFY_DIGEST_SIZE];
+    unsigned char options_digest[VERIFY_DIGEST_SIZE];
+    int checked;  /* SPICE_SSL_VERIFY_OP mask */
+    int passed;
+    unsigned int last_used;
+} VerifyCacheEntry;
+
+struct SpiceOpenSSLVerifyCache {
+    mutex_t lock;
+    VerifyCacheEntry entries[VERIFY_CACHE_SIZE];
+    int n_entries;
+    unsigned int clock;
+};
+
+static VerifyCacheEntry *verify_cache_find(SpiceOpenSSLVerifyCache *cache,
+                                           const unsigned char *cert_digest,
+                                           const unsigned char *options_digest)
+{
+    int i;
+
+    for (i = 0; i < cache->n_entries; i++) {
+        VerifyCacheEntry *entry = &cache->entries[i];
+
+        if (!memcmp(entry->cert_digest, cert_digest, VERIFY_DIGEST_SIZE) &&
+            !memcmp(entry->options_digest, options_digest, VERIFY_DIGEST_SIZE)) {
+            entry->last_used = ++cache->clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* returns TRUE and sets @passed if the result of @op is cached */
+static int verify_cache_lookup(SpiceOpenSSLVerify *verify, const unsigned char *cert_digest,
+                               SPICE_SSL_VERIFY_OP op, int *passed)
+{
+    SpiceOpenSSLVerifyCache *cache = verify->cache;
+    VerifyCacheEntry *entry;
+    int found = FALSE;
+
+    MUTEX_LOCK(cache->lock);
+    entry = verify_cache_find(cache, cert_digest, verify->options_digest);
+    if (entry && (entry->checked & op)) {
+        *passed = !!(entry->passed & op);
+        found = TRUE;
+    }
+    MUTEX_UNLOCK(cache->lock);
+
+    return found;
+}
+
+static void verify_cache_store(SpiceOpenSSLVerify *verify, const unsigned char *cert_digest,
+                               SPICE_SSL_VERIFY_OP op, int passed)
+{
+    SpiceOpenSSLVerifyCache *cache = verify->cache;
+    VerifyCacheEntry *entry;
+    int i;
+
+    MUTEX_LOCK(cache->lock);
+    entry = verify_cache_find(cache, cert_digest, verify->options_digest);
+    if (!entry) {
+        if (cache->n_entries < VERIFY_CACHE_SIZE) {
+            entry = &cache->entries[cache->n_entries++];
+        } else {
+            /* evict the least recently used */
+            entry = &cache->entries[0];
+            for (i = 1; i < VERIFY_CACHE_SIZE; i++) {
+                if (cache->entries[i].last_used < entry->last_used) {
+                    entry = &cache->entries[i];
+                }
+            }
+        }
+        memcpy(entry->cert_digest, cert_digest, VERIFY_DIGEST_SIZE);
+        memcpy(entry->options_digest, verify->options_digest, VERIFY_DIGEST_SIZE);
+        entry->checked = 0;
+        entry->passed = 0;
+        entry->last_used = ++cache->clock;
+    }
+    entry->checked |= op;
+    if (passed) {
+        entry->passed |= op;
+    } else {
+        entry->passed &= ~op;
+    }
+    MUTEX_UNLOCK(cache->lock);
+}
+
+/* Runs the @op check on the server certificate, @cert_digest is NULL when
+ * the results are not cached */
+static int verify_op(SpiceOpenSSLVerify *v, X509 *cert,
+                     const unsigned char *cert_digest, SPICE_SSL_VERIFY_OP op)
+{
+    int passed = 0;
+
+    if (cert_digest && verify_cache_lookup(v, cert_digest, op, &passed)) {
+        spice_debug("using cached result %d for verification %d", passed, op);
+        return passed;
+    }
+
+    switch (op) {
+    case SPICE_SSL_VERIFY_OP_PUBKEY:
+        passed = !!verify_pubkey(cert, v->pubkey, v->pubkey_size);
+        break;
+    case SPICE_SSL_VERIFY_OP_HOSTNAME:
+        passed = verify_hostname(cert, v->hostname);
+        break;
+    case SPICE_SSL_VERIFY_OP_SUBJECT:
+        passed = verify_subject(cert, v);
+        break;
+    default:
+        spice_warn_if_reached();
+        return 0;
+    }
+
+    if (cert_digest) {
+        verify_cache_store(v, cert_digest, op, passed);
+    }
+    return passed;
+}
+
 static int openssl_verify(int preverify_ok, X509_STORE_CTX *ctx)
 {
     int depth, err;
@@ -414,6 +539,9 @@ static int openssl_verify(int preverify_ok, X509_STORE_CTX *ctx)
     X509* cert;
     char buf[256];
     unsigned int failed_verifications;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+    const unsigned char *cert_digest = NULL;
 
     ssl = (SSL*)X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
     v = (SpiceOpenSSLVerify*)SSL_get_app_data(ssl);
@@ -445,9 +573,14 @@ static int openssl_verify(int preverify_ok, X509_STORE_CTX *ctx)
         return 0;
     }
 
+    if (v->cache && X509_digest(cert, EVP_sha256(), digest, &digest_size) &&
+        digest_size == VERIFY_DIGEST_SIZE) {
+        cert_digest = digest;
+    }
+
     failed_verifications = 0;
     if (v->verifyop & SPICE_SSL_VERIFY_OP_PUBKEY) {
-        if (verify_pubkey(cert, v->pubkey, v->pubkey_size))
+        if (verify_op(v, cert, cert_digest, SPICE_SSL_VERIFY_OP_PUBKEY))
             return 1;
         else
             failed_verifications |= SPICE_SSL_VERIFY_OP_PUBKEY;
@@ -457,7 +590,7 @@ static int openssl_verify(int preverify_ok, X509_STORE_CTX *ctx)
         return 0;
 
     if (v->verifyop & SPICE_SSL_VERIFY_OP_HOSTNAME) {
-       if (verify_hostname(cert, v->hostname))
+       if (verify_op(v, cert, cert_digest, SPICE_SSL_VERIFY_OP_HOSTNAME))
            return 1;
         else
             failed_verifications |= SPICE_SSL_VERIFY_OP_HOSTNAME;
@@ -465,7 +598,7 @@ static int openssl_verify(int preverify_ok, X509_STORE_CTX *ctx)
 
 
     if (v->verifyop & SPICE_SSL_VERIFY_OP_SUBJECT) {
-        if (verify_subject(cert, v))
+        if (verify_op(v, cert, cert_digest, SPICE_SSL_VERIFY_OP_SUBJECT))
             return 1;
         else
             failed_verifications |= SPICE_SSL_VERIFY_OP_SUBJECT;
@@ -532,3 +665,67 @@ void spice_openssl_verify_free(SpiceOpenSSLVerify* verify)
         SSL_set_app_data(verify->ssl, NULL);
     free(verify);
 }
+
+SpiceOpenSSLVerifyCache* spice_openssl_verify_cache_new(void)
+{
+    SpiceOpenSSLVerifyCache *cache;
+
+    cache = spice_new0(SpiceOpenSSLVerifyCache, 1);
+    MUTEX_INIT(cache->lock);
+
+    return cache;
+}
+
+void spice_openssl_verify_cache_free(SpiceOpenSSLVerifyCache *cache)
+{
+    if (!cache)
+        return;
+
+    MUTEX_DESTROY(cache->lock);
+    free(cache);
+}
+
+void spice_openssl_verify_set_cache(SpiceOpenSSLVerify *verify,
+                                    SpiceOpenSSLVerifyCache *cache)
+{
+    size_t hostname_size, subject_size, size;
+    uint8_t *options, *p;
+    uint32_t verifyop;
+
+    spice_return_if_fail(verify != NULL);
+
+    verify->cache = NULL;
+    if (!cache)
+        return;
+
+    /* everything the checks depend on, strings are nul terminated so that
+     * different options can't give the same buffer */
+    hostname_size = verify->hostname ? strlen(verify->hostname) + 1 : 0;
+    subject_size = verify->subject ? strlen(verify->subject) + 1 : 0;
+    size = sizeof(verifyop) + 2 + hostname_size + subject_size + verify->pubkey_size;
+    options = p = spice_malloc(size);
+
+    verifyop = verify->verifyop;
+    memcpy(p, &verifyop, sizeof(verifyop));
+    p += sizeof(verifyop);
+    *p++ = verify->hostname != NULL;
+    if (hostname_size) {
+        memcpy(p, verify->hostname, hostname_size);
+        p += hostname_size;
+    }
+    *p++ = verify->subject != NULL;
+    if (subject_size) {
+        memcpy(p, verify->subject, subject_size);
+        p += subject_size;
+    }
+    if (verify->pubkey_size) {
+        memcpy(p, verify->pubkey, verify->pubkey_size);
+    }
+
+    if (EVP_Digest(options, size, verify->options_digest, NULL, EVP_sha256(), NULL)) {
+        verify->cache = cache;
+    } else {
+        spice_warning("failed to digest the verify options, not caching");
+    }
+    free(options);
+}
@@ -46,6 +46,8 @@ typedef enum {
   SPICE_SSL_VERIFY_OP_SUBJECT  = (1 << 2),
 } SPICE_SSL_VERIFY_OP;
 
+typedef struct SpiceOpenSSLVerifyCache SpiceOpenSSLVerifyCache;
+
 typedef struct {
     SSL                 *ssl;
     SPICE_SSL_VERIFY_OP verifyop;
@@ -55,6 +57,9 @@ typedef struct {
     size_t              pubkey_size;
     char                *subject;
     X509_NAME           *in_subject;
+    int                 in_subject_entries;
+    SpiceOpenSSLVerifyCache *cache;
+    unsigned char       options_digest[EVP_MAX_MD_SIZE];
 } SpiceOpenSSLVerify;
 
 SpiceOpenSSLVerify* spice_openssl_verify_new(SSL *ssl, SPICE_SSL_VERIFY_OP verifyop,
@@ -63,6 +68,15 @@ SpiceOpenSSLVerify* spice_openssl_verify_new(SSL *ssl, SPICE_SSL_VERIFY_OP verif
                                              const char *subject);
 void spice_openssl_verify_free(SpiceOpenSSLVerify* verify);
 
+/* Results of the pubkey/hostname/subject checks, keyed by the certificate
+ * digest and the verify options. Meant to be shared by the channels of a
+ * session so that only the first handshake does the checks, the cache must
+ * outlive the SpiceOpenSSLVerify using it. It is thread safe. */
+SpiceOpenSSLVerifyCache* spice_openssl_verify_cache_new(void);
+void spice_openssl_verify_cache_free(SpiceOpenSSLVerifyCache *cache);
+void spice_openssl_verify_set_cache(SpiceOpenSSLVerify *verify,
+                                    SpiceOpenSSLVerifyCache *cache);
+
 SPICE_END_DECLS
 
 #endif // SSL_VERIFY_H
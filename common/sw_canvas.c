@@ -38,6 +38,7 @@ struct SwCanvas {
     uint32_t *private_data;
     int private_data_size;
     pixman_image_t *image;
+    SpicePixmanScaleCache scale_cache;
 };
 
 static pixman_image_t *canvas_get_pixman_brush(SwCanvas *canvas,
@@ -115,73 +116,8 @@ static void copy_region(SpiceCanvas *spice_canvas,
                         int dx, int dy)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
-    pixman_box32_t *dest_rects;
-    int n_rects;
-    int i, j, end_line;
-
-    dest_rects = pixman_region32_rectangles(dest_region, &n_rects);
-
-    if (dy > 0) {
-        if (dx >= 0) {
-            /* south-east: copy x and y in reverse order */
-            for (i = n_rects - 1; i >= 0; i--) {
-                spice_pixman_copy_rect(canvas->image,
-                                       dest_rects[i].x1 - dx, dest_rects[i].y1 - dy,
-                                       dest_rects[i].x2 - dest_rects[i].x1,
-                                       dest_rects[i].y2 - dest_rects[i].y1,
-                                       dest_rects[i].x1, dest_rects[i].y1);
-            }
-        } else {
-            /* south-west: Copy y in reverse order, but x in forward order */
-            i = n_rects - 1;
-
-            while (i >= 0) {
-                /* Copy all rects with same y in forward order */
-                for (end_line = i - 1;
-                     end_line >= 0 && dest_rects[end_line].y1 == dest_rects[i].y1;
-                     end_line--) {
-                }
-                for (j = end_line + 1; j <= i; j++) {
-                    spice_pixman_copy_rect(canvas->image,
-                                           dest_rects[j].x1 - dx, dest_rects[j].y1 - dy,
-                                           dest_rects[j].x2 - dest_rects[j].x1,
-                                           dest_rects[j].y2 - dest_rects[j].y1,
-                                           dest_rects[j].x1, dest_rects[j].y1);
-                }
-                i = end_line;
-            }
-        }
-    } else {
-        if (dx > 0) {
-            /* north-east: copy y in forward order, but x in reverse order */
-            i = 0;
-
-            while (i < n_rects) {
-                /* Copy all rects with same y in reverse order */
-                for (end_line = i;
-                     end_line < n_rects && dest_rects[end_line].y1 == dest_rects[i].y1;
-                     end_line++) {
-                }
-                for (j = end_line - 1; j >= i; j--) {
-                    spice_pixman_copy_rect(canvas->image,
-                                           dest_rects[j].x1 - dx, dest_rects[j].y1 - dy,
-                                           dest_rects[j].x2 - dest_rects[j].x1,
-                                           dest_rects[j].y2 - dest_rects[j].y1,
-                                           dest_rects[j].x1, dest_rects[j].y1);
-                }
-                i = end_line;
-            }
-        } else {
-            /* north-west: Copy x and y in forward order */
-            for (i = 0; i < n_rects; i++) {
-                spice_pixman_copy_rect(canvas->image,
-                                       dest_rects[i].x1 - dx, dest_rects[i].y1 - dy,
-                                       dest_rects[i].x2 - dest_rects[i].x1,
-                                       dest_rects[i].y2 - dest_rects[i].y1,
-                                       dest_rects[i].x1, dest_rects[i].y1);
-            }
-        }
-    }
+
+    spice_pixman_copy_region(canvas->image, dest_region, dx, dy);
 }
 
 static void fill_solid_spans(SpiceCanvas *spice_canvas,
@@ -322,13 +258,19 @@ static void fill_tiled_rects_rop_from_surface(SpiceCanvas *spice_canvas,
    xRGB32. However, this fills our alpha bits with
    data that is not wanted or expected by windows, and its
    causing us to send rgba images rather than rgb images to
-   the client. So, we manually clear these bytes. */
+   the client. So, we manually clear these bytes, in the
+   part of the rectangle that was drawn, which is also what
+   spice_pixman_blend() leaves cleared. */
 static void clear_dest_alpha(pixman_image_t *dest,
+                             pixman_region32_t *region,
                              int x, int y,
                              int width, int height)
 {
+    pixman_region32_t area;
+    pixman_box32_t *rects;
     uint32_t *data;
     int stride;
+    int n_rects, i;
     int w, h;
 
     w = pixman_image_get_width(dest);
@@ -356,15 +298,27 @@ static void clear_dest_alpha(pixman_image_t *dest,
         height = h - y;
     }
 
-    stride = pixman_image_get_stride(dest);
-    data = (uint32_t *) (
-        (uint8_t *)pixman_image_get_data(dest) + y * stride + 4 * x);
+    pixman_region32_init_rect(&area, x, y, width, height);
+    pixman_region32_intersect(&area, &area, region);
+    rects = pixman_region32_rectangles(&area, &n_rects);
+
+    if (n_rects > 0) {
+        stride = pixman_image_get_stride(dest);
+        data = (uint32_t *) (
+            (uint8_t *)pixman_image_get_data(dest) + rects[0].y1 * stride + 4 * rects[0].x1);
 
-    if ((*data & 0xff000000U) == 0xff000000U) {
-        spice_pixman_fill_rect_rop(dest,
-                                   x, y, width, height,
-                                   0x00ffffff, SPICE_ROP_AND);
+        if ((*data & 0xff000000U) == 0xff000000U) {
+            for (i = 0; i < n_rects; i++) {
+                spice_pixman_fill_rect_rop(dest,
+                                           rects[i].x1, rects[i].y1,
+                                           rects[i].x2 - rects[i].x1,
+                                           rects[i].y2 - rects[i].y1,
+                                           0x00ffffff, SPICE_ROP_AND);
+            }
+        }
     }
+
+    pixman_region32_fini(&area);
 }
 
 static void __blit_image(SpiceCanvas *spice_canvas,
@@ -479,6 +433,13 @@ static void __scale_image(SpiceCanvas *spice_canvas,
     pixman_transform_t transform;
     pixman_fixed_t fsx, fsy;
 
+    if (spice_pixman_scale(&canvas->scale_cache, canvas->image, region,
+                           dest_x, dest_y, dest_width, dest_height,
+                           src, src_x, src_y, src_width, src_height,
+                           scale_mode)) {
+        return;
+    }
+
     fsx = ((pixman_fixed_48_16_t) src_width * 65536) / dest_width;
     fsy = ((pixman_fixed_48_16_t) src_height * 65536) / dest_height;
 
@@ -563,34 +524,41 @@ static void __scale_image_rop(SpiceCanvas *spice_canvas,
                                       dest_width,
                                       dest_height,
                                       NULL, 0);
+    spice_return_if_fail(scaled != NULL);
 
     pixman_region32_translate(region, -dest_x, -dest_y);
-    pixman_image_set_clip_region32(scaled, region);
 
-    pixman_transform_init_scale(&transform, fsx, fsy);
-    pixman_transform_translate(&transform, NULL,
-                               pixman_int_to_fixed (src_x),
-                               pixman_int_to_fixed (src_y));
+    if (!spice_pixman_scale(&canvas->scale_cache, scaled, region,
+                            0, 0, dest_width, dest_height,
+                            src, src_x, src_y, src_width, src_height,
+                            scale_mode)) {
+        pixman_image_set_clip_region32(scaled, region);
 
-    pixman_image_set_transform(src, &transform);
-    pixman_image_set_repeat(src, PIXMAN_REPEAT_NONE);
-    spice_return_if_fail(scale_mode == SPICE_IMAGE_SCALE_MODE_INTERPOLATE ||
-                         scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST);
-    pixman_image_set_filter(src,
-                            (scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST) ?
-                            PIXMAN_FILTER_NEAREST : PIXMAN_FILTER_GOOD,
-                            NULL, 0);
+        pixman_transform_init_scale(&transform, fsx, fsy);
+        pixman_transform_translate(&transform, NULL,
+                                   pixman_int_to_fixed (src_x),
+                                   pixman_int_to_fixed (src_y));
 
-    pixman_image_composite32(PIXMAN_OP_SRC,
-                             src, NULL, scaled,
-                             0, 0, /* src */
-                             0, 0, /* mask */
-                             0, 0, /* dst */
-                             dest_width,
-                             dest_height);
+        pixman_image_set_transform(src, &transform);
+        pixman_image_set_repeat(src, PIXMAN_REPEAT_NONE);
+        spice_return_if_fail(scale_mode == SPICE_IMAGE_SCALE_MODE_INTERPOLATE ||
+                             scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST);
+        pixman_image_set_filter(src,
+                                (scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST) ?
+                                PIXMAN_FILTER_NEAREST : PIXMAN_FILTER_GOOD,
+                                NULL, 0);
 
-    pixman_transform_init_identity(&transform);
-    pixman_image_set_transform(src, &transform);
+        pixman_image_composite32(PIXMAN_OP_SRC,
+                                 src, NULL, scaled,
+                                 0, 0, /* src */
+                                 0, 0, /* mask */
+                                 0, 0, /* dst */
+                                 dest_width,
+                                 dest_height);
+
+        pixman_transform_init_identity(&transform);
+        pixman_image_set_transform(src, &transform);
+    }
 
     /* Translate back */
     pixman_region32_translate(region, dest_x, dest_y);
@@ -671,6 +639,12 @@ static void __blend_image(SpiceCanvas *spice_canvas,
 
     dest = canvas_get_as_surface(canvas, dest_has_alpha);
 
+    if (spice_pixman_blend(dest, region, src, src_x, src_y,
+                           dest_x, dest_y, width, height, overall_alpha)) {
+        pixman_image_unref(dest);
+        return;
+    }
+
     pixman_image_set_clip_region32(dest, region);
 
     mask = NULL;
@@ -692,7 +666,7 @@ static void __blend_image(SpiceCanvas *spice_canvas,
 
     if (canvas->base.format == SPICE_SURFACE_FMT_32_xRGB &&
         !dest_has_alpha) {
-        clear_dest_alpha(dest, dest_x, dest_y, width, height);
+        clear_dest_alpha(dest, region, dest_x, dest_y, width, height);
     }
 
     if (mask) {
@@ -751,21 +725,41 @@ static void __blend_scale_image(SpiceCanvas *spice_canvas,
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
     pixman_transform_t transform;
-    pixman_image_t *mask, *dest;
+    pixman_image_t *mask, *dest, *scaled;
+    pixman_box32_t *extents;
+    pixman_format_code_t format;
     pixman_fixed_t fsx, fsy;
 
     fsx = ((pixman_fixed_48_16_t) src_width * 65536) / dest_width;
     fsy = ((pixman_fixed_48_16_t) src_height * 65536) / dest_height;
 
+    /* Scale only the visible part into a temporary with the fast scaler,
+       then let pixman do an unscaled OVER, which it has fast paths for */
+    scaled = NULL;
+    extents = pixman_region32_extents(region);
+    if (extents->x2 > extents->x1 && extents->y2 > extents->y1 &&
+        spice_pixman_image_get_format(src, &format)) {
+        scaled = pixman_image_create_bits(format,
+                                          extents->x2 - extents->x1,
+                                          extents->y2 - extents->y1,
+                                          NULL, 0);
+        spice_return_if_fail(scaled != NULL);
+        pixman_region32_translate(region, -extents->x1, -extents->y1);
+        if (!spice_pixman_scale(&canvas->scale_cache, scaled, region,
+                                dest_x - extents->x1, dest_y - extents->y1,
+                                dest_width, dest_height,
+                                src, src_x, src_y, src_width, src_height,
+                                scale_mode)) {
+            pixman_image_unref(scaled);
+            scaled = NULL;
+        }
+        pixman_region32_translate(region, extents->x1, extents->y1);
+    }
+
     dest = canvas_get_as_surface(canvas, dest_has_alpha);
 
     pixman_image_set_clip_region32(dest, region);
 
-    pixman_transform_init_scale(&transform, fsx, fsy);
-    pixman_transform_translate(&transform, NULL,
-                               pixman_int_to_fixed (src_x),
-                               pixman_int_to_fixed (src_y));
-
     mask = NULL;
     if (overall_alpha != 0xff) {
         pixman_color_t color = { 0, 0, 0, 0 };
@@ -773,30 +767,46 @@ static void __blend_scale_image(SpiceCanvas *spice_canvas,
         mask = pixman_image_create_solid_fill(&color);
     }
 
-    pixman_image_set_transform(src, &transform);
-    pixman_image_set_repeat(src, PIXMAN_REPEAT_NONE);
-    spice_return_if_fail(scale_mode == SPICE_IMAGE_SCALE_MODE_INTERPOLATE ||
-                         scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST);
-    pixman_image_set_filter(src,
-                            (scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST) ?
-                            PIXMAN_FILTER_NEAREST : PIXMAN_FILTER_GOOD,
-                            NULL, 0);
+    if (scaled) {
+        pixman_image_composite32(PIXMAN_OP_OVER,
+                                 scaled, mask, dest,
+                                 0, 0, /* src */
+                                 0, 0, /* mask */
+                                 extents->x1, extents->y1, /* dst */
+                                 extents->x2 - extents->x1,
+                                 extents->y2 - extents->y1);
+        pixman_image_unref(scaled);
+    } else {
+        pixman_transform_init_scale(&transform, fsx, fsy);
+        pixman_transform_translate(&transform, NULL,
+                                   pixman_int_to_fixed (src_x),
+                                   pixman_int_to_fixed (src_y));
 
-    pixman_image_composite32(PIXMAN_OP_OVER,
-                             src, mask, dest,
-                             0, 0, /* src */
-                             0, 0, /* mask */
-                             dest_x, dest_y, /* dst */
-                             dest_width, dest_height);
+        pixman_image_set_transform(src, &transform);
+        pixman_image_set_repeat(src, PIXMAN_REPEAT_NONE);
+        spice_return_if_fail(scale_mode == SPICE_IMAGE_SCALE_MODE_INTERPOLATE ||
+                             scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST);
+        pixman_image_set_filter(src,
+                                (scale_mode == SPICE_IMAGE_SCALE_MODE_NEAREST) ?
+                                PIXMAN_FILTER_NEAREST : PIXMAN_FILTER_GOOD,
+                                NULL, 0);
+
+        pixman_image_composite32(PIXMAN_OP_OVER,
+                                 src, mask, dest,
+                                 0, 0, /* src */
+                                 0, 0, /* mask */
+                                 dest_x, dest_y, /* dst */
+                                 dest_width, dest_height);
+
+        pixman_transform_init_identity(&transform);
+        pixman_image_set_transform(src, &transform);
+    }
 
     if (canvas->base.format == SPICE_SURFACE_FMT_32_xRGB &&
         !dest_has_alpha) {
-        clear_dest_alpha(dest, dest_x, dest_y, dest_width, dest_height);
+        clear_dest_alpha(dest, region, dest_x, dest_y, dest_width, dest_height);
     }
 
-    pixman_transform_init_identity(&transform);
-    pixman_image_set_transform(src, &transform);
-
     if (mask) {
         pixman_image_unref(mask);
     }
@@ -1129,7 +1139,7 @@ static void canvas_draw_text(SpiceCanvas *spice_canvas, SpiceRect *bbox,
                                  pixman_image_get_width(str_mask),
                                  pixman_image_get_height(str_mask));
         if (canvas->base.format == SPICE_SURFACE_FMT_32_xRGB) {
-            clear_dest_alpha(canvas->image, pos.x, pos.y,
+            clear_dest_alpha(canvas->image, &dest_region, pos.x, pos.y,
                              pixman_image_get_width(str_mask),
                              pixman_image_get_height(str_mask));
         }
@@ -1166,6 +1176,45 @@ static void canvas_read_bits(SpiceCanvas *spice_canvas, uint8_t *dest,
     }
 }
 
+static void canvas_put_yuv_image(SpiceCanvas *spice_canvas,
+                                 const SpiceRect *dest,
+                                 SpiceYUVFormat format,
+                                 const uint8_t *planes[3], const int strides[3],
+                                 uint32_t src_width, uint32_t src_height,
+                                 const QRegion *clip)
+{
+    SwCanvas *canvas = (SwCanvas *)spice_canvas;
+    pixman_region32_t dest_region, bounds;
+    int dest_width, dest_height;
+
+    dest_width = dest->right - dest->left;
+    dest_height = dest->bottom - dest->top;
+    if (dest_width <= 0 || dest_height <= 0) {
+        return;
+    }
+
+    pixman_region32_init_rect(&dest_region,
+                              dest->left, dest->top,
+                              dest_width, dest_height);
+    if (clip) {
+        pixman_region32_intersect(&dest_region, &dest_region,
+                                  (pixman_region32_t *)clip);
+    }
+    pixman_region32_init_rect(&bounds, 0, 0,
+                              pixman_image_get_width(canvas->image),
+                              pixman_image_get_height(canvas->image));
+    pixman_region32_intersect(&dest_region, &dest_region, &bounds);
+    pixman_region32_fini(&bounds);
+
+    spice_pixman_blit_yuv(canvas->image, &dest_region,
+                          dest->left, dest->top,
+                          dest_width, dest_height,
+                          format, planes, strides,
+                          src_width, src_height);
+
+    pixman_region32_fini(&dest_region);
+}
+
 static void canvas_clear(SpiceCanvas *spice_canvas)
 {
     SwCanvas *canvas = (SwCanvas *)spice_canvas;
@@ -1183,6 +1232,7 @@ static void canvas_destroy(SpiceCanvas *spice_canvas)
         return;
     }
     pixman_image_unref(canvas->image);
+    spice_pixman_scale_cache_fini(&canvas->scale_cache);
     canvas_base_destroy(&canvas->base);
     free(canvas->private_data);
     free(canvas);
@@ -1233,6 +1283,7 @@ static SpiceCanvas *canvas_create_common(pixman_image_t *image,
     canvas->private_data_size = 0;
 
     canvas->image = image;
+    spice_pixman_scale_cache_init(&canvas->scale_cache);
 
     return (SpiceCanvas *)canvas;
 }
@@ -1341,5 +1392,6 @@ void sw_canvas_init(void) //unsafe global function
     sw_canvas_ops.colorkey_scale_image_from_surface = colorkey_scale_image_from_surface;
     sw_canvas_ops.copy_region = copy_region;
     sw_canvas_ops.get_image = get_image;
+    sw_canvas_ops.put_yuv_image = canvas_put_yuv_image;
     rop3_init();
 }
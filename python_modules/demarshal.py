@@ -74,10 +74,10 @@ def write_parser_helpers(writer):
 
     writer.newline()
     writer.statement("typedef struct PointerInfo PointerInfo")
-    writer.statement("typedef void (*message_destructor_t)(uint8_t *message)")
     writer.statement("typedef uint8_t * (*parse_func_t)(uint8_t *message_start, uint8_t *message_end, uint8_t *struct_data, PointerInfo *ptr_info, int minor)")
-    writer.statement("typedef uint8_t * (*parse_msg_func_t)(uint8_t *message_start, uint8_t *message_end, int minor, size_t *size_out, message_destructor_t *free_message)")
-    writer.statement("typedef uint8_t * (*spice_parse_channel_func_t)(uint8_t *message_start, uint8_t *message_end, uint16_t message_type, int minor, size_t *size_out, message_destructor_t *free_message)")
+    writer.statement("typedef struct ParseArena ParseArena")
+    writer.statement("typedef uint8_t * (*parse_msg_func_t)(uint8_t *message_start, uint8_t *message_end, int minor, size_t *size_out, message_destructor_t *free_message, ParseArena *arena)")
+    writer.statement("typedef uint8_t * (*parse_channel_arena_func_t)(uint8_t *message_start, uint8_t *message_end, uint16_t message_type, int minor, size_t *size_out, message_destructor_t *free_message, ParseArena *arena)")
 
     writer.newline()
     writer.begin_block("struct PointerInfo")
@@ -87,6 +87,53 @@ def write_parser_helpers(writer):
     writer.variable_def("uint32_t", "nelements")
     writer.end_block(semicolon=True)
 
+    write_parse_arena(writer)
+
+def write_parse_arena(writer):
+    # Messages parsed by a batch are allocated from a single block, the
+    # arena. When it is full, or when parsing a single message, they get
+    # their own allocation. An arena without a block only carries the
+    # in_place flag of the *_in_place() entry points.
+    writer.newline()
+    writer.begin_block("struct ParseArena")
+    writer.variable_def("uint8_t *", "start")
+    writer.variable_def("uint8_t *", "ptr")
+    writer.variable_def("uint8_t *", "end")
+    writer.variable_def("int", "in_place")
+    writer.end_block(semicolon=True)
+
+    write_nofree(writer)
+
+    writer.newline()
+    scope = writer.function("SPICE_GNUC_UNUSED parse_in_arena", "int", "ParseArena *arena, uint8_t *data", True)
+    writer.statement("return arena != NULL && data >= arena->start && data < arena->end")
+    writer.end_block()
+
+    writer.newline()
+    scope = writer.function("SPICE_GNUC_UNUSED parse_alloc", "uint8_t *", "ParseArena *arena, size_t size", True)
+    scope.variable_def("uint8_t *", "data")
+    writer.newline()
+    with writer.if_block("arena != NULL && arena->ptr != NULL"):
+        writer.assign("data", "(uint8_t *)SPICE_ALIGN((size_t)arena->ptr, 8)")
+        with writer.if_block("data <= arena->end && size <= (size_t)(arena->end - data)"):
+            writer.assign("arena->ptr", "data + size")
+            writer.statement("return data")
+    writer.statement("return (uint8_t *)malloc(size)")
+    writer.end_block()
+
+    writer.newline()
+    scope = writer.function("SPICE_GNUC_UNUSED parse_free", "void", "ParseArena *arena, uint8_t *data", True)
+    with writer.if_block("!parse_in_arena(arena, data)"):
+        writer.statement("free(data)")
+    writer.end_block()
+
+    writer.newline()
+    scope = writer.function("SPICE_GNUC_UNUSED parse_destructor", "message_destructor_t", "ParseArena *arena, uint8_t *data", True)
+    with writer.if_block("parse_in_arena(arena, data)"):
+        writer.statement("return nofree")
+    writer.statement("return (message_destructor_t) free")
+    writer.end_block()
+
 def write_read_primitive(writer, start, container, name, scope):
     m = container.lookup_member(name)
     assert(m.is_primitive())
@@ -997,10 +1044,65 @@ def write_ptr_info_check(writer):
 def write_nofree(writer):
     if writer.is_generated("helper", "nofree"):
         return
+    writer.set_is_generated("helper", "nofree")
     writer = writer.function_helper()
     scope = writer.function("nofree", "static void", "uint8_t *data")
     writer.end_block()
 
+def get_fixed_layout_fields(container, prefix):
+    # Returns the list of (member path, wire size) of the primitives of a
+    # message whose wire representation may be the same as its C struct,
+    # or None if it has to be parsed member by member
+    fields = []
+    for m in container.members:
+        if m.is_switch():
+            return None
+        for attr in ["virtual", "minor", "end", "to_ptr", "zero", "bytes_count",
+                     "nocopy", "chunk", "as_ptr"]:
+            if m.has_attr(attr):
+                return None
+        t = m.member_type
+        if t.is_pointer() or t.is_array():
+            return None
+        elif t.is_primitive():
+            fields.append((prefix + m.name, t.get_fixed_nw_size()))
+        elif t.is_struct():
+            f = get_fixed_layout_fields(t, prefix + m.name + ".")
+            if f == None:
+                return None
+            fields = fields + f
+        else:
+            return None
+    return fields
+
+def write_in_place_parser(writer, message, fields):
+    # When the caller asked for it and the C struct has exactly the wire
+    # layout, which is checked at compile time, the message is used from
+    # the receive buffer as is
+    msg_type = message.c_type()
+    nw_size = message.get_fixed_nw_size()
+    align = 1
+    checks = ["arena != NULL && arena->in_place",
+              "sizeof(%s) == %d" % (msg_type, nw_size)]
+    offset = 0
+    for path, size in fields:
+        checks.append("offsetof(%s, %s) == %d" % (msg_type, path, offset))
+        checks.append("sizeof(((%s *)0)->%s) == %d" % (msg_type, path, size))
+        offset = offset + size
+        align = max(align, size)
+    if align > 1:
+        checks.append("((size_t)start & %d) == 0" % (align - 1))
+
+    write_nofree(writer)
+    writer.ifndef("WORDS_BIGENDIAN")
+    writer.comment("Wire layout matches %s, use the message in place" % msg_type).newline()
+    with writer.if_block(" &&\n        ".join(checks)):
+        writer.assign("*size", "nw_size")
+        writer.assign("*free_message", "nofree")
+        writer.statement("return start")
+    writer.endif("WORDS_BIGENDIAN")
+    writer.newline()
+
 def write_msg_parser(writer, message):
     msg_name = message.c_name()
     function_name = "parse_%s" % msg_name
@@ -1019,7 +1121,7 @@ def write_msg_parser(writer, message):
         writer.ifdef(message.attributes["ifdef"][0])
     parent_scope = writer.function(function_name,
                                    "uint8_t *",
-                                   "uint8_t *message_start, uint8_t *message_end, int minor, size_t *size, message_destructor_t *free_message", True)
+                                   "uint8_t *message_start, uint8_t *message_end, int minor, size_t *size, message_destructor_t *free_message, ParseArena *arena", True)
     parent_scope.variable_def("SPICE_GNUC_UNUSED uint8_t *", "pos")
     parent_scope.variable_def("uint8_t *", "start = message_start")
     parent_scope.variable_def("uint8_t *", "data = NULL")
@@ -1046,7 +1148,15 @@ def write_msg_parser(writer, message):
     with writer.block("if (start + nw_size > message_end)"):
         writer.statement("return NULL")
 
-    writer.newline().comment("Validated extents and calculated size").newline()
+    writer.newline()
+
+    if (not message.has_attr("nocopy") and num_pointers == 0 and
+        message.is_fixed_nw_size() and not message.is_extra_size()):
+        fields = get_fixed_layout_fields(message, "")
+        if fields:
+            write_in_place_parser(writer, message, fields)
+
+    writer.comment("Validated extents and calculated size").newline()
 
     if message.has_attr("nocopy"):
         write_nofree(writer)
@@ -1054,7 +1164,7 @@ def write_msg_parser(writer, message):
         writer.assign("*size", "message_end - message_start")
         writer.assign("*free_message", "nofree")
     else:
-        writer.assign("data", "(uint8_t *)malloc(mem_size)")
+        writer.assign("data", "parse_alloc(arena, mem_size)")
         writer.error_check("data == NULL")
         writer.assign("end", "data + %s" % (msg_sizeof))
         writer.assign("in", "start").newline()
@@ -1075,14 +1185,14 @@ def write_msg_parser(writer, message):
 
         writer.newline()
         writer.assign("*size", "end - data")
-        writer.assign("*free_message", "(message_destructor_t) free")
+        writer.assign("*free_message", "parse_destructor(arena, data)")
 
     writer.statement("return data")
     writer.newline()
     if writer.has_error_check:
         writer.label("error")
         with writer.block("if (data != NULL)"):
-            writer.statement("free(data)")
+            writer.statement("parse_free(arena, data)")
         writer.statement("return NULL")
     writer.end_block()
 
@@ -1091,7 +1201,7 @@ def write_msg_parser(writer, message):
 
     return function_name
 
-def write_channel_parser(writer, channel, server):
+def write_channel_parser(writer, channel, server, stats):
     writer.newline()
     ids = {}
     min_id = 1000000
@@ -1119,9 +1229,9 @@ def write_channel_parser(writer, channel, server):
     writer.newline()
     if channel.has_attr("ifdef"):
         writer.ifdef(channel.attributes["ifdef"][0])
-    scope = writer.function(function_name,
+    scope = writer.function(function_name + "_arena",
                             "static uint8_t *",
-                            "uint8_t *message_start, uint8_t *message_end, uint16_t message_type, int minor, size_t *size_out, message_destructor_t *free_message")
+                            "uint8_t *message_start, uint8_t *message_end, uint16_t message_type, int minor, size_t *size_out, message_destructor_t *free_message, ParseArena *arena")
 
     helpers = writer.function_helper()
 
@@ -1139,15 +1249,36 @@ def write_channel_parser(writer, channel, server):
 
         writer.end_block(semicolon = True)
 
+    if stats != None:
+        scope.variable_def("uint8_t *", "data")
+        scope.variable_def("uint64_t", "stats_start")
+        writer.newline()
+        writer.assign("stats_start", "spice_message_stats_now()")
+
     d = 0
     for r in ranges:
         d = d + 1
         with writer.if_block("message_type >= %d && message_type < %d" % (r[0], r[1]), d > 1, False):
-            writer.statement("return funcs%d[message_type-%d](message_start, message_end, minor, size_out, free_message)" % (d, r[0]))
+            parse = "funcs%d[message_type-%d](message_start, message_end, minor, size_out, free_message, arena)" % (d, r[0])
+            if stats == None:
+                writer.statement("return " + parse)
+            else:
+                writer.assign("data", parse)
+                writer.statement("spice_message_stats_add(&%s[%d + message_type - %d], stats_start, message_end - message_start, data != NULL ? *size_out : 0)" % (stats_table_name(server), len(stats), r[0]))
+                writer.statement("return data")
+                for i in range(r[0], r[1]):
+                    stats.append("%s.%s" % (channel.name, ids[i].name))
     writer.newline()
 
     writer.statement("return NULL")
     writer.end_block()
+
+    writer.newline()
+    scope = writer.function(function_name,
+                            "static uint8_t *",
+                            "uint8_t *message_start, uint8_t *message_end, uint16_t message_type, int minor, size_t *size_out, message_destructor_t *free_message")
+    writer.statement("return %s_arena(message_start, message_end, message_type, minor, size_out, free_message, NULL)" % function_name)
+    writer.end_block()
     if channel.has_attr("ifdef"):
         writer.endif(channel.attributes["ifdef"][0])
 
@@ -1231,26 +1362,224 @@ def write_full_protocol_parser(writer, is_server):
     writer.statement("return NULL")
     writer.end_block()
 
+def write_in_place_protocol_parser(writer, channel_parsers, max_channel, is_server):
+    # Same as the full protocol parser, but the messages whose C struct has
+    # the wire layout are returned in place instead of being copied
+    if is_server:
+        function_name = "spice_parse_msg_in_place"
+    else:
+        function_name = "spice_parse_reply_in_place"
+
+    writer.newline()
+    scope = writer.function(function_name + writer.public_prefix,
+                            "uint8_t *",
+                            "uint8_t *message_start, uint8_t *message_end, uint32_t channel, uint16_t message_type, int minor, size_t *size_out, message_destructor_t *free_message")
+    scope.variable_def("ParseArena", "arena = { NULL, NULL, NULL, 1 }")
+
+    writer.write("static parse_channel_arena_func_t channels[%d] = " % (max_channel+1))
+    write_channel_arena_funcs(writer, channel_parsers, max_channel)
+    writer.newline()
+
+    with writer.if_block("channel >= %d || channels[channel] == NULL" % (max_channel + 1)):
+        writer.statement("return NULL")
+    writer.statement("return channels[channel](message_start, message_end, message_type, minor, size_out, free_message, &arena)")
+    writer.end_block()
+
+def write_channel_arena_funcs(writer, channel_parsers, max_channel):
+    writer.begin_block()
+    for i in range(0, max_channel + 1):
+        separator = ","
+        if i == max_channel:
+            separator = ""
+        if channel_parsers.has_key(i):
+            channel = channel_parsers[i][0]
+            if channel.has_attr("ifdef"):
+                writer.ifdef(channel.attributes["ifdef"][0])
+            writer.write("%s_arena%s" % (channel_parsers[i][1], separator)).newline()
+            if channel.has_attr("ifdef"):
+                writer.ifdef_else(channel.attributes["ifdef"][0])
+                writer.write("NULL%s" % separator).newline()
+                writer.endif(channel.attributes["ifdef"][0])
+        else:
+            writer.write("NULL%s" % separator).newline()
+    writer.end_block(semicolon = True)
+
+def write_batch_protocol_parser(writer, channel_parsers, max_channel, is_server):
+    # Parses all the complete messages of a receive buffer in one call. The
+    # headers are validated first so that the parsed messages can share a
+    # single allocation with the returned array.
+    if is_server:
+        function_name = "spice_parse_msg_batch"
+    else:
+        function_name = "spice_parse_reply_batch"
+
+    writer.newline()
+    scope = writer.function(function_name + writer.public_prefix,
+                            "int",
+                            "uint8_t *buffer, uint8_t *buffer_end, uint32_t channel, int minor, int mini_header, SpiceParsedMessage **messages_out, uint8_t **consumed_out")
+    scope.variable_def("parse_channel_arena_func_t", "func")
+    scope.variable_def("SpiceParsedMessage *", "messages")
+    scope.variable_def("ParseArena", "arena")
+    scope.variable_def("uint8_t *", "pos", "body")
+    scope.variable_def("size_t", "header_size", "array_size", "wire_size = 0")
+    scope.variable_def("uint16_t", "type")
+    scope.variable_def("uint32_t", "size")
+    scope.variable_def("int", "i", "n")
+
+    writer.write("static parse_channel_arena_func_t channels[%d] = " % (max_channel+1))
+    write_channel_arena_funcs(writer, channel_parsers, max_channel)
+    writer.newline()
+
+    writer.assign("*messages_out", "NULL")
+    writer.assign("*consumed_out", "buffer")
+    with writer.if_block("channel >= %d || channels[channel] == NULL" % (max_channel + 1)):
+        writer.statement("return -1")
+    writer.assign("func", "channels[channel]")
+    # SpiceMiniDataHeader is type:16, size:32, SpiceDataHeader is
+    # serial:64, type:16, size:32, sub_list:32
+    writer.assign("header_size", "mini_header ? 6 : 18")
+    writer.newline()
+
+    writer.comment("Count the complete messages, stopping at the first one with sub messages").newline()
+    writer.assign("n", "0")
+    writer.assign("pos", "buffer")
+    with writer.while_loop("(size_t)(buffer_end - pos) >= header_size"):
+        with writer.if_block("mini_header", newline=False):
+            writer.assign("size", "read_uint32(pos + 2)")
+        with writer.block(" else"):
+            with writer.if_block("read_uint32(pos + 14) != 0"):
+                writer.statement("break")
+            writer.assign("size", "read_uint32(pos + 10)")
+        with writer.if_block("size > (size_t)(buffer_end - pos) - header_size"):
+            writer.statement("break")
+        writer.increment("pos", "header_size + size")
+        writer.increment("wire_size", "size")
+        writer.increment("n", "1")
+    with writer.if_block("n == 0"):
+        writer.statement("return 0")
+    writer.newline()
+
+    writer.comment("Parsed messages are usually no more than twice their wire size").newline()
+    writer.assign("array_size", "SPICE_ALIGN(n * sizeof(SpiceParsedMessage), 8)")
+    writer.assign("messages", "(SpiceParsedMessage *)malloc(array_size + 2 * wire_size + n * 32)")
+    with writer.if_block("messages == NULL"):
+        writer.statement("return -1")
+    writer.assign("arena.start", "(uint8_t *)messages + array_size")
+    writer.assign("arena.ptr", "arena.start")
+    writer.assign("arena.end", "arena.start + 2 * wire_size + n * 32")
+    writer.assign("arena.in_place", "0")
+    writer.newline()
+
+    writer.assign("pos", "buffer")
+    with writer.for_loop("i", "n"):
+        with writer.if_block("mini_header", newline=False):
+            writer.assign("type", "read_uint16(pos)")
+            writer.assign("size", "read_uint32(pos + 2)")
+        with writer.block(" else"):
+            writer.assign("type", "read_uint16(pos + 8)")
+            writer.assign("size", "read_uint32(pos + 10)")
+        writer.assign("body", "pos + header_size")
+        writer.assign("pos", "body + size")
+        writer.writeln("#ifdef __GNUC__")
+        with writer.if_block("i + 1 < n"):
+            writer.statement("__builtin_prefetch(pos + header_size)")
+        writer.writeln("#endif")
+        writer.assign("messages[i].type", "type")
+        writer.assign("messages[i].size", "0")
+        writer.assign("messages[i].free_message", "NULL")
+        writer.assign("messages[i].data", "func(body, pos, type, minor, &messages[i].size, &messages[i].free_message, &arena)")
+    writer.newline()
+
+    writer.assign("*messages_out", "messages")
+    writer.assign("*consumed_out", "pos")
+    writer.statement("return n")
+    writer.end_block()
+
+    writer.newline()
+    scope = writer.function(function_name + "_free" + writer.public_prefix,
+                            "void",
+                            "SpiceParsedMessage *messages, int n_messages")
+    scope.variable_def("int", "i")
+    writer.newline()
+    with writer.for_loop("i", "n_messages"):
+        with writer.if_block("messages[i].data != NULL"):
+            writer.statement("messages[i].free_message(messages[i].data)")
+    writer.statement("free(messages)")
+    writer.end_block()
+
+def stats_table_name(is_server):
+    if is_server:
+        return "parse_msg_stats"
+    else:
+        return "parse_reply_stats"
+
+def write_stats_table(writer, stats, is_server):
+    # Counters of each message type, indexed by the order in which the
+    # channel parsers were generated
+    # Positional initializers, the generated code is also built with MSVC
+    # versions that don't have designated ones
+    writer.newline()
+    writer.write("static SpiceMessageStats %s[%d] = " % (stats_table_name(is_server), len(stats)))
+    writer.begin_block()
+    for i in range(len(stats)):
+        writer.write('{ "%s", 0, 0, 0, 0 }' % stats[i])
+        if i != len(stats) - 1:
+            writer.write(",")
+        writer.newline()
+    writer.end_block(semicolon = True)
+
+def write_stats_functions(writer, n_stats, is_server):
+    if is_server:
+        function_name = "spice_parse_msg_stats"
+    else:
+        function_name = "spice_parse_reply_stats"
+    table = stats_table_name(is_server)
+
+    writer.newline()
+    writer.function(function_name + "_snapshot" + writer.public_prefix, "int", "SpiceMessageStats *stats, int n_stats")
+    writer.statement("return spice_message_stats_copy(%s, %d, stats, n_stats)" % (table, n_stats))
+    writer.end_block()
+
+    writer.newline()
+    writer.function(function_name + "_reset" + writer.public_prefix, "void", "void")
+    writer.statement("spice_message_stats_clear(%s, %d)" % (table, n_stats))
+    writer.end_block()
+
 def write_protocol_parser(writer, proto, is_server):
     max_channel = 0
     parsers = {}
+    stats = None
+
+    if writer.has_option("stats"):
+        stats = []
+        stats_writer = writer.get_subwriter()
 
     for channel in proto.channels:
         max_channel = max(max_channel, channel.value)
 
-        parsers[channel.value] = (channel.channel_type, write_channel_parser(writer, channel.channel_type, is_server))
+        parsers[channel.value] = (channel.channel_type, write_channel_parser(writer, channel.channel_type, is_server, stats))
 
     write_get_channel_parser(writer, parsers, max_channel, is_server)
     write_full_protocol_parser(writer, is_server)
+    write_in_place_protocol_parser(writer, parsers, max_channel, is_server)
+    write_batch_protocol_parser(writer, parsers, max_channel, is_server)
+
+    if stats != None:
+        write_stats_table(stats_writer, stats, is_server)
+        write_stats_functions(writer, len(stats), is_server)
 
 def write_includes(writer):
     writer.writeln("#include <string.h>")
     writer.writeln("#include <assert.h>")
     writer.writeln("#include <stdlib.h>")
     writer.writeln("#include <stdio.h>")
+    writer.writeln("#include <stddef.h>")
     writer.writeln("#include <spice/protocol.h>")
     writer.writeln("#include <spice/macros.h>")
     writer.writeln('#include "mem.h"')
+    writer.writeln('#include "client_demarshallers.h"')
+    if writer.has_option("stats"):
+        writer.writeln('#include "message_stats.h"')
     writer.newline()
     writer.writeln("#ifdef _MSC_VER")
     writer.writeln("#pragma warning(disable:4101)")
@@ -5,6 +5,8 @@ import codegen
 def write_includes(writer):
     writer.header.writeln("#include <spice/protocol.h>")
     writer.header.writeln('#include "marshaller.h"')
+    if writer.has_option("stats"):
+        writer.header.writeln('#include "message_stats.h"')
     writer.header.newline()
     writer.header.writeln("#ifndef _GENERATED_HEADERS_H")
     writer.header.writeln("#define _GENERATED_HEADERS_H")
@@ -16,6 +18,8 @@ def write_includes(writer):
     writer.writeln("#include <spice/protocol.h>")
     writer.writeln("#include <spice/macros.h>")
     writer.writeln('#include "marshaller.h"')
+    if writer.has_option("stats"):
+        writer.writeln('#include "message_stats.h"')
     writer.newline()
     writer.writeln("#ifdef _MSC_VER")
     writer.writeln("#pragma warning(disable:4101)")
@@ -23,6 +27,26 @@ def write_includes(writer):
     writer.writeln("#endif")
     writer.newline()
 
+    # Used to store runs of fixed size members after reserving their space
+    # at once, see write_fixed_run_marshaller
+    writer.writeln("#ifdef WORDS_BIGENDIAN")
+    for size in [8, 16, 32, 64]:
+        for sign in ["", "u"]:
+            utype = "uint%d" % (size)
+            type = "%sint%d" % (sign, size)
+            swap = "SPICE_BYTESWAP%d" % size
+            if size == 8:
+                writer.macro("write_%s" % type, "ptr, val", "(*((%s_t *)(ptr)) = (val))" % (type))
+            else:
+                writer.macro("write_%s" % type, "ptr, val", "(*((%s_t *)(ptr)) = %s((%s_t)(val)))" % (utype, swap, utype))
+    writer.writeln("#else")
+    for size in [8, 16, 32, 64]:
+        for sign in ["", "u"]:
+            type = "%sint%d" % (sign, size)
+            writer.macro("write_%s" % type, "ptr, val", "(*((%s_t *)(ptr)) = (val))" % type)
+    writer.writeln("#endif")
+    writer.newline()
+
 class MarshallingSource:
     def __init__(self):
         pass
@@ -326,14 +350,76 @@ def write_member_marshaller(writer, container, member, src, scope):
     else:
         raise NotImplementedError("TODO can't handle parsing of %s" % t)
 
+def get_fixed_member_fields(member, src):
+    # Returns the list of (reference, type) of the primitives a member is
+    # marshalled as, or None if it can't be part of a fixed size run
+    if member.has_attr("virtual") or member.has_attr("nomarshal"):
+        return []
+    if member.is_switch():
+        return None
+
+    t = member.member_type
+    if t.is_pointer():
+        return None
+    elif t.is_primitive():
+        if member.has_attr("zero") or member.has_attr("bytes_count"):
+            return None
+        return [(src.get_ref(member.name), t)]
+    elif t.is_struct():
+        src2 = src.child_sub(member)
+        fields = []
+        for m in t.members:
+            f = get_fixed_member_fields(m, src2)
+            if f == None:
+                return None
+            fields = fields + f
+        return fields
+    return None
+
+def write_fixed_run_marshaller(writer, fields, scope):
+    # A single spice_marshaller_reserve_space() for the whole run, then
+    # direct stores instead of one spice_marshaller_add_*() per primitive
+    size = 0
+    for ref, t in fields:
+        size = size + t.get_fixed_nw_size()
+
+    if not scope.variable_defined("fixed__data"):
+        scope.variable_def("uint8_t *", "fixed__data")
+    writer.assign("fixed__data", "spice_marshaller_reserve_space(m, %d)" % size)
+
+    offset = 0
+    for ref, t in fields:
+        if offset == 0:
+            writer.statement("write_%s(fixed__data, %s)" % (t.primitive_type(), ref))
+        else:
+            writer.statement("write_%s(fixed__data + %d, %s)" % (t.primitive_type(), offset, ref))
+        offset = offset + t.get_fixed_nw_size()
+
 def write_container_marshaller(writer, container, src):
     saved_out_prefix = writer.out_prefix
     with src.declare(writer) as scope:
-        for m in container.members:
+        members = container.members
+        i = 0
+        while i < len(members):
+            # Collect the longest run of fixed size members starting here
+            run = []
+            j = i
+            while j < len(members):
+                f = get_fixed_member_fields(members[j], src)
+                if f == None:
+                    break
+                run = run + f
+                j = j + 1
+            if len(run) > 1:
+                write_fixed_run_marshaller(writer, run, scope)
+                i = j
+                continue
+
             writer.out_prefix = saved_out_prefix
-            write_member_marshaller(writer, container, m, src, scope)
+            write_member_marshaller(writer, container, members[i], src, scope)
+            i = i + 1
 
-def write_message_marshaller(writer, message, is_server, private):
+def write_message_marshaller(writer, message, is_server, private, stats):
     if message.has_attr("ifdef"):
         writer.ifdef(message.attributes["ifdef"][0])
     writer.out_prefix = ""
@@ -355,6 +441,12 @@ def write_message_marshaller(writer, message, is_server, private):
                             "static void" if private else "void",
                             "SpiceMarshaller *m, %s *msg" % message.c_type() + names_args)
     scope.variable_def("SPICE_GNUC_UNUSED SpiceMarshaller *", "m2")
+    if stats != None:
+        scope.variable_def("uint64_t", "stats_start")
+        scope.variable_def("size_t", "stats_size")
+        writer.newline()
+        writer.assign("stats_start", "spice_message_stats_now()")
+        writer.assign("stats_size", "spice_marshaller_get_total_size(m)")
 
     for n in names:
         writer.assign("*%s_out" % n, "NULL")
@@ -366,14 +458,64 @@ def write_message_marshaller(writer, message, is_server, private):
 
         write_container_marshaller(writer, message, src)
 
+    if stats != None:
+        # Data the caller adds to the returned pointer marshallers is not
+        # accounted for
+        writer.statement("spice_message_stats_add(&%s[%d], stats_start, spice_marshaller_get_total_size(m) - stats_size, 0)" % (stats_table_name(is_server), len(stats)))
+        stats.append(function_name)
+
     writer.end_block()
     if message.has_attr("ifdef"):
         writer.endif(message.attributes["ifdef"][0])
     writer.newline()
     return function_name
 
+def stats_table_name(is_server):
+    if is_server:
+        return "marshall_msgc_stats"
+    else:
+        return "marshall_msg_stats"
+
+def write_stats_table(writer, stats, is_server):
+    # Counters of each marshaller, indexed by the order in which they were
+    # generated
+    # Positional initializers, the generated code is also built with MSVC
+    # versions that don't have designated ones
+    writer.newline()
+    writer.write("static SpiceMessageStats %s[%d] = " % (stats_table_name(is_server), len(stats)))
+    writer.begin_block()
+    for i in range(len(stats)):
+        writer.write('{ "%s", 0, 0, 0, 0 }' % stats[i])
+        if i != len(stats) - 1:
+            writer.write(",")
+        writer.newline()
+    writer.end_block(semicolon = True)
+
+def write_stats_functions(writer, n_stats, is_server):
+    function_name = "spice_" + stats_table_name(is_server)
+    table = stats_table_name(is_server)
+
+    writer.header.writeln("int %s_snapshot%s(SpiceMessageStats *stats, int n_stats);" % (function_name, writer.public_prefix))
+    writer.header.writeln("void %s_reset%s(void);" % (function_name, writer.public_prefix))
+
+    writer.function(function_name + "_snapshot" + writer.public_prefix, "int", "SpiceMessageStats *stats, int n_stats")
+    writer.statement("return spice_message_stats_copy(%s, %d, stats, n_stats)" % (table, n_stats))
+    writer.end_block()
+
+    writer.newline()
+    writer.function(function_name + "_reset" + writer.public_prefix, "void", "void")
+    writer.statement("spice_message_stats_clear(%s, %d)" % (table, n_stats))
+    writer.end_block()
+    writer.newline()
+
 def write_protocol_marshaller(writer, proto, is_server, private_marshallers):
     functions = {}
+    stats = None
+
+    if writer.has_option("stats"):
+        stats = []
+        stats_writer = writer.get_subwriter()
+
     for c in proto.channels:
         channel = c.channel_type
         if channel.has_attr("ifdef"):
@@ -382,7 +524,7 @@ def write_protocol_marshaller(writer, proto, is_server, private_marshallers):
         if is_server:
             for m in channel.client_messages:
                 message = m.message_type
-                f = write_message_marshaller(writer, message, is_server, private_marshallers)
+                f = write_message_marshaller(writer, message, is_server, private_marshallers, stats)
                 if channel.has_attr("ifdef") and not functions.has_key(f):
                     functions[f] = channel.attributes["ifdef"][0]
                 elif message.has_attr("ifdef") and not functions.has_key(f):
@@ -392,7 +534,7 @@ def write_protocol_marshaller(writer, proto, is_server, private_marshallers):
         else:
             for m in channel.server_messages:
                 message = m.message_type
-                f = write_message_marshaller(writer, message, is_server, private_marshallers)
+                f = write_message_marshaller(writer, message, is_server, private_marshallers, stats)
                 if channel.has_attr("ifdef") and not functions.has_key(f):
                     functions[f] = channel.attributes["ifdef"][0]
                 elif message.has_attr("ifdef") and not functions.has_key(f):
@@ -423,5 +565,9 @@ def write_protocol_marshaller(writer, proto, is_server, private_marshallers):
         writer.end_block()
         writer.newline()
 
+    if stats != None:
+        write_stats_table(stats_writer, stats, is_server)
+        write_stats_functions(writer, len(stats), is_server)
+
 def write_trailer(writer):
     writer.header.writeln("#endif")
@@ -113,6 +113,9 @@ parser.add_option("-k", "--keep-identical-file",
 parser.add_option("-i", "--include",
                   action="append", dest="includes", metavar="FILE",
                   help="Include FILE in generated code")
+parser.add_option("--generate-stats",
+                  action="store_true", dest="generate_stats", default=False,
+                  help="Count the messages handled by the (de)marshallers, see message_stats.h")
 parser.add_option("--prefix", dest="prefix",
                   help="set public symbol prefix", default="")
 parser.add_option("--ptrsize", dest="ptrsize",
@@ -155,6 +158,9 @@ if options.assert_on_error:
 if options.print_error:
     writer.set_option("print_error")
 
+if options.generate_stats:
+    writer.set_option("stats")
+
 if options.includes:
     for i in options.includes:
         writer.header.writeln('#include "%s"' % i)